@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "access_log.h"
+
+// the longest line of the text format: the fields, and a request line of escapes only
+#define ACCESS_TEXT_MAX (160 + ACCESS_LINE_MAX * 6)
+
+// the thread's key value when no ring was free for it
+static char no_ring;
+
+// open the file at the log's path for appending, a new binary file starts with the magic
+static int open_file(access_log* log) {
+    log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        perror("open access log");
+        return -1;
+    }
+    struct stat st;
+    log->file_bytes = fstat(log->fd, &st) == 0 ? (size_t) st.st_size : 0;
+    if (log->format == ACCESS_LOG_BINARY && log->file_bytes == 0) {
+        if (write(log->fd, ACCESS_LOG_MAGIC, strlen(ACCESS_LOG_MAGIC)) < 0)
+            perror("write access log");
+        else
+            log->file_bytes = strlen(ACCESS_LOG_MAGIC);
+    }
+    return 0;
+}
+
+// the file reached max_bytes: it becomes path.1 and a new one is started
+static void rotate(access_log* log) {
+    size_t len = strlen(log->path);
+    char* rotated = (char*) malloc(len + 3);
+    if (rotated == NULL) {
+        perror("malloc");
+        return;
+    }
+    snprintf(rotated, len + 3, "%s.1", log->path);
+    close(log->fd);
+    if (rename(log->path, rotated) < 0)
+        perror("rename access log");
+    free(rotated);
+    open_file(log);
+    atomic_fetch_add_explicit(&log->rotations, 1, memory_order_relaxed);
+}
+
+// a thread that logged exits: its ring may be given to another one
+static void release_ring(void* ring) {
+    if (ring != &no_ring)
+        atomic_store_explicit(&((access_ring*) ring)->owned, false, memory_order_release);
+}
+
+// the ring of the calling thread, claimed on its first record. NULL if none was free.
+static access_ring* thread_ring(access_log* log) {
+    void* ring = pthread_getspecific(log->key);
+    if (ring != NULL)
+        return ring == &no_ring ? NULL : (access_ring*) ring;
+
+    access_ring* claimed = NULL;
+    pthread_mutex_lock(&log->claim_lock);
+    int num_rings = atomic_load_explicit(&log->num_rings, memory_order_relaxed);
+    for (int i = 0; i < num_rings && claimed == NULL; ++i) {
+        access_ring* released = atomic_load_explicit(&log->rings[i], memory_order_relaxed);
+        if (!atomic_load_explicit(&released->owned, memory_order_acquire))
+            claimed = released;
+    }
+    if (claimed == NULL && num_rings < ACCESS_LOG_MAX_THREADS) {
+        claimed = (access_ring*) aligned_alloc(_Alignof(access_ring), sizeof(access_ring));
+        if (claimed == NULL)
+            perror("malloc");
+        else {
+            atomic_init(&claimed->head, 0);
+            atomic_init(&claimed->tail, 0);
+            // published before the count the writer reads
+            atomic_store_explicit(&log->rings[num_rings], claimed, memory_order_relaxed);
+            atomic_store_explicit(&log->num_rings, num_rings + 1, memory_order_release);
+        }
+    }
+    if (claimed != NULL)
+        atomic_store_explicit(&claimed->owned, true, memory_order_relaxed);
+    pthread_mutex_unlock(&log->claim_lock);
+    pthread_setspecific(log->key, claimed != NULL ? (void*) claimed : (void*) &no_ring);
+    return claimed;
+}
+
+access_record* access_log_begin(access_log* log) {
+    access_ring* ring = thread_ring(log);
+    if (ring != NULL) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) < ACCESS_RING_RECORDS)
+            return &ring->records[tail & (ACCESS_RING_RECORDS - 1)];
+    }
+    atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+    return NULL;
+}
+
+void access_log_commit(access_log* log) {
+    access_ring* ring = (access_ring*) pthread_getspecific(log->key);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void access_log_get_stats(access_log* log, access_log_stats* stats) {
+    stats->written = atomic_load_explicit(&log->written, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&log->dropped, memory_order_relaxed);
+    stats->rotations = atomic_load_explicit(&log->rotations, memory_order_relaxed);
+}
+
+// append a JSON string of len bytes at str to out, escaping quotes, backslashes and bytes outside ASCII
+static char* append_escaped(char* out, const char* str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char) str[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char) c;
+        }
+        else if (c < 0x20 || c >= 0x7f) {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 15];
+            out += 6;
+        }
+        else
+            *out++ = (char) c;
+    }
+    return out;
+}
+
+// render a record as a line of the text format into out, which has ACCESS_TEXT_MAX bytes. returns its length.
+static size_t format_record(const access_record* record, char* out) {
+    char client[INET6_ADDRSTRLEN + 8] = "-";
+    char addr[INET6_ADDRSTRLEN];
+    if (record->family == AF_INET && inet_ntop(AF_INET, record->addr, addr, sizeof(addr)) != NULL)
+        snprintf(client, sizeof(client), "%s:%u", addr, record->port);
+    else if (record->family == AF_INET6 && inet_ntop(AF_INET6, record->addr, addr, sizeof(addr)) != NULL)
+        snprintf(client, sizeof(client), "[%s]:%u", addr, record->port);
+
+    time_t seconds = (time_t) (record->time_ns / 1000000000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    char* p = out;
+    p += sprintf(p, "{\"time\":\"%s.%06uZ\",\"client\":\"%s\",\"request\":\"", date,
+                 (unsigned) (record->time_ns % 1000000000 / 1000), client);
+    p = append_escaped(p, record->line, record->line_len);
+    p += sprintf(p, "\",\"status\":%u,\"bytes\":%llu,\"queue_us\":%u,\"service_us\":%u}\n", record->status,
+                 (unsigned long long) record->bytes, record->queue_us, record->service_us);
+    return p - out;
+}
+
+// writev all of iov, continuing after short writes. returns false on failure.
+static bool write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("writev access log");
+            return false;
+        }
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// write up to ACCESS_BATCH records, taken from the rings in order, with one writev. binary records
+// are written from the rings themselves, so a ring's head moves only after the write.
+// returns the records taken.
+static int write_batch(access_log* log) {
+    struct iovec iov[ACCESS_BATCH * 2];
+    size_t taken[ACCESS_LOG_MAX_THREADS];
+    int num_iov = 0;
+    int count = 0;
+    size_t bytes = 0;
+    char* text = log->text;
+    int num_rings = atomic_load_explicit(&log->num_rings, memory_order_acquire);
+    int visited = 0;
+    for (; visited < num_rings && count < ACCESS_BATCH; ++visited) {
+        access_ring* ring = atomic_load_explicit(&log->rings[visited], memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        taken[visited] = 0;
+        for (; head != tail && count < ACCESS_BATCH; ++head) {
+            access_record* record = &ring->records[head & (ACCESS_RING_RECORDS - 1)];
+            if (log->format == ACCESS_LOG_BINARY) {
+                iov[num_iov++] = (struct iovec) { record, offsetof(access_record, line) };
+                iov[num_iov++] = (struct iovec) { record->line, record->line_len };
+                bytes += offsetof(access_record, line) + record->line_len;
+            }
+            else {
+                size_t len = format_record(record, text);
+                iov[num_iov++] = (struct iovec) { text, len };
+                text += len;
+                bytes += len;
+            }
+            taken[visited]++;
+            count++;
+        }
+    }
+    if (count == 0)
+        return 0;
+
+    if (log->fd >= 0 && write_all(log->fd, iov, num_iov)) {
+        atomic_fetch_add_explicit(&log->written, count, memory_order_relaxed);
+        log->file_bytes += bytes;
+    }
+    else
+        atomic_fetch_add_explicit(&log->dropped, count, memory_order_relaxed);
+    for (int i = 0; i < visited; ++i) {
+        access_ring* ring = atomic_load_explicit(&log->rings[i], memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        atomic_store_explicit(&ring->head, head + taken[i], memory_order_release);
+    }
+    if (log->fd >= 0 && log->max_bytes > 0 && log->file_bytes >= log->max_bytes)
+        rotate(log);
+    return count;
+}
+
+// the writer thread: drain the rings, sleep while they are empty
+static void* run_writer(void* arg) {
+    access_log* log = (access_log*) arg;
+    struct timespec idle = { 0, ACCESS_IDLE_MS * 1000000L };
+    while (true) {
+        // read before draining: once stopping, a whole pass runs after the last record
+        bool stopping = atomic_load(&log->stopping);
+        int written = 0;
+        int batch;
+        while ((batch = write_batch(log)) > 0)
+            written += batch;
+        if (stopping)
+            break;
+        if (written == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+access_log* create_access_log(const char* path, access_log_format format, size_t max_bytes) {
+    access_log* log = (access_log*) calloc(1, sizeof(access_log));
+    if (log == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    log->path = strdup(path);
+    log->text = format == ACCESS_LOG_TEXT ? (char*) malloc(ACCESS_BATCH * ACCESS_TEXT_MAX) : NULL;
+    if (log->path == NULL || (format == ACCESS_LOG_TEXT && log->text == NULL)) {
+        perror("malloc");
+        free(log->path);
+        free(log->text);
+        free(log);
+        return NULL;
+    }
+    log->format = format;
+    log->max_bytes = max_bytes;
+    if (open_file(log) < 0) {
+        free(log->path);
+        free(log->text);
+        free(log);
+        return NULL;
+    }
+    pthread_mutex_init(&log->claim_lock, NULL);
+    if (pthread_key_create(&log->key, release_ring) != 0) {
+        perror("pthread_key_create");
+        pthread_mutex_destroy(&log->claim_lock);
+        close(log->fd);
+        free(log->path);
+        free(log->text);
+        free(log);
+        return NULL;
+    }
+    if (pthread_create(&log->writer, NULL, run_writer, log) != 0) {
+        perror("create thread");
+        pthread_key_delete(log->key);
+        pthread_mutex_destroy(&log->claim_lock);
+        close(log->fd);
+        free(log->path);
+        free(log->text);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+void access_log_stop(access_log* log) {
+    if (log->stopped)
+        return;
+    atomic_store(&log->stopping, 1);
+    pthread_join(log->writer, NULL);
+    log->stopped = true;
+}
+
+void destroy_access_log(access_log* log) {
+    access_log_stop(log);
+    int num_rings = atomic_load(&log->num_rings);
+    for (int i = 0; i < num_rings; ++i)
+        free(atomic_load(&log->rings[i]));
+    pthread_key_delete(log->key);
+    pthread_mutex_destroy(&log->claim_lock);
+    if (log->fd >= 0)
+        close(log->fd);
+    free(log->path);
+    free(log->text);
+    free(log);
+}
@@ -0,0 +1,136 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * access_log.h
+ *
+ * This file declares the asynchronous access log. a thread that logs
+ * fills records in a single-producer single-consumer ring of its
+ * own, without a lock or a system call, and drops the record (and
+ * counts it) when its ring is full. a writer thread drains all the
+ * rings in batches, writing each batch with one writev, and rotates
+ * the file once it reaches a size.
+ * the text format is a JSON object per line. the binary format is,
+ * after an 8 byte "ACCLOG01" magic at the start of every file, each
+ * record's fields up to line (offsetof(access_record, line) bytes,
+ * in the byte order of the host) followed by its line_len bytes of
+ * request line.
+ */
+
+#define ACCESS_LOG_MAX_THREADS 256  //rings at most, a thread that finds none free drops its records
+#define ACCESS_RING_RECORDS 1024    //records of a ring, a power of two
+#define ACCESS_LINE_MAX 210         //bytes of the request line kept
+#define ACCESS_BATCH 512            //records written by one writev
+#define ACCESS_IDLE_MS 10           //sleep of the writer when the rings are empty
+#define ACCESS_LOG_MAGIC "ACCLOG01"
+
+typedef enum {
+    ACCESS_LOG_TEXT,
+    ACCESS_LOG_BINARY
+} access_log_format;
+
+/**
+ * a logged request
+ */
+typedef struct access_record {
+    uint64_t time_ns;           //wall clock nanoseconds when the response was queued
+    uint64_t bytes;             //of the response, headers and body
+    uint32_t queue_us;          //from dispatch until a pool thread took the connection
+    uint32_t service_us;        //the pool thread's handling of the request
+    uint16_t status;
+    uint16_t port;              //of the client, host order
+    uint8_t family;             //AF_INET or AF_INET6, 0 if unknown
+    uint8_t line_len;
+    uint8_t addr[16];           //of the client, network order
+    char line[ACCESS_LINE_MAX]; //the request line, truncated, not terminated
+} access_record;
+
+/**
+ * counters of the log
+ */
+typedef struct access_log_stats {
+    uint64_t written;           //records written to the files
+    uint64_t dropped;           //records lost to a full ring or a failed write
+    uint64_t rotations;
+} access_log_stats;
+
+/**
+ * the ring of one thread. the producer only moves tail, the writer
+ * only moves head.
+ */
+typedef struct access_ring {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_bool owned;          //a running thread produces into the ring
+    access_record records[ACCESS_RING_RECORDS];
+} access_ring;
+
+/**
+ * the log
+ */
+typedef struct access_log {
+    char* path;
+    int fd;
+    access_log_format format;
+    size_t max_bytes;           //rotate at this size, 0 never rotates
+    size_t file_bytes;
+    _Atomic(access_ring*) rings[ACCESS_LOG_MAX_THREADS];
+    atomic_int num_rings;
+    pthread_mutex_t claim_lock; //taken by a thread looking for a ring, once
+    pthread_key_t key;          //the ring of the calling thread, released when it exits
+    pthread_t writer;
+    bool stopped;               //the writer was joined
+    atomic_int stopping;
+    char* text;                 //the writer's buffer of formatted lines
+    atomic_uint_fast64_t written;
+    atomic_uint_fast64_t dropped;
+    atomic_uint_fast64_t rotations;
+} access_log;
+
+/**
+ * create_access_log opens (appending to) the file at path and starts
+ * the writer thread. max_bytes 0 disables rotation, otherwise a file
+ * that reached max_bytes is renamed to path.1, replacing the one
+ * before, and a new one is started.
+ * returns NULL on failure.
+ */
+access_log* create_access_log(const char* path, access_log_format format, size_t max_bytes);
+
+/**
+ * access_log_begin returns the next free record of the calling
+ * thread's ring, to fill and then publish with access_log_commit.
+ * returns NULL, counting a dropped record, when the ring is full.
+ */
+access_record* access_log_begin(access_log* log);
+
+/**
+ * access_log_commit hands the record returned by access_log_begin
+ * to the writer.
+ */
+void access_log_commit(access_log* log);
+
+/**
+ * access_log_get_stats copies the counters of the log.
+ */
+void access_log_get_stats(access_log* log, access_log_stats* stats);
+
+/**
+ * access_log_stop writes the records still in the rings and stops
+ * the writer, after which the counters are final. nothing may log
+ * any more.
+ */
+void access_log_stop(access_log* log);
+
+/**
+ * destroy_access_log stops the log if it is running, closes the
+ * file and frees the rings.
+ */
+void destroy_access_log(access_log* log);
+
+#endif
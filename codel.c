@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "codel.h"
+
+#define NS_PER_MS 1000000ULL
+
+codel* create_codel(int target_ms, int interval_ms) {
+    if (target_ms <= 0 || interval_ms <= 0)
+        return NULL;
+    codel* shedder = (codel*) calloc(1, sizeof(codel));
+    if (shedder == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    pthread_mutex_init(&shedder->lock, NULL);
+    shedder->target = target_ms * NS_PER_MS;
+    shedder->interval = interval_ms * NS_PER_MS;
+    atomic_init(&shedder->shed, 0);
+    return shedder;
+}
+
+// integer square root, rounded down
+static uint32_t isqrt(uint32_t n) {
+    uint32_t root = 0;
+    for (uint32_t bit = 1u << 30; bit != 0; bit >>= 2) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+    }
+    return root;
+}
+
+// when the next job is shed: interval / sqrt(count) after t
+static uint64_t control_law(const codel* shedder, uint64_t t) {
+    return t + shedder->interval / isqrt(shedder->count);
+}
+
+bool codel_should_shed(codel* shedder, uint64_t sojourn, uint64_t now) {
+    bool shed = false;
+    pthread_mutex_lock(&shedder->lock);
+    bool ok_to_drop = false;
+    if (sojourn < shedder->target)
+        shedder->first_above = 0;
+    else if (shedder->first_above == 0)
+        shedder->first_above = now + shedder->interval;
+    else if (now >= shedder->first_above)
+        ok_to_drop = true;
+
+    if (shedder->dropping) {
+        if (!ok_to_drop)
+            shedder->dropping = false;
+        else if (now >= shedder->drop_next) {
+            shed = true;
+            shedder->count++;
+            shedder->drop_next = control_law(shedder, shedder->drop_next);
+        }
+    }
+    else if (ok_to_drop) {
+        shed = true;
+        shedder->dropping = true;
+        // a standing queue that comes back soon resumes at the drop rate it left
+        uint32_t delta = shedder->count - shedder->last_count;
+        shedder->count = delta > 1 && now - shedder->drop_next < 16 * shedder->interval ? delta : 1;
+        shedder->drop_next = control_law(shedder, now);
+        shedder->last_count = shedder->count;
+    }
+    pthread_mutex_unlock(&shedder->lock);
+    if (shed)
+        atomic_fetch_add_explicit(&shedder->shed, 1, memory_order_relaxed);
+    return shed;
+}
+
+uint64_t codel_shed_count(codel* shedder) {
+    return atomic_load_explicit(&shedder->shed, memory_order_relaxed);
+}
+
+void destroy_codel(codel* shedder) {
+    pthread_mutex_destroy(&shedder->lock);
+    free(shedder);
+}
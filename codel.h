@@ -0,0 +1,59 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * codel.h
+ *
+ * This file declares load shedding by queue delay, after CoDel
+ * (RFC 8289). every job taken from the queue reports how long it
+ * waited there. once the wait stayed above target for a whole
+ * interval the queue is a standing one, and jobs are shed: the
+ * first right away, the next ones at intervals shrinking with the
+ * square root of the drop count, until a job waits less than target.
+ * a short burst that drains within an interval is never shed.
+ */
+
+/**
+ * state of a shedder, shared by the threads that take jobs
+ */
+typedef struct codel {
+    pthread_mutex_t lock;
+    uint64_t target;            //nanoseconds of queue delay tolerated
+    uint64_t interval;          //nanoseconds the delay must stay above target
+    uint64_t first_above;       //when the delay above target becomes a standing queue, 0 if below
+    uint64_t drop_next;         //when the next job is shed while dropping
+    uint32_t count;             //jobs shed in this dropping state
+    uint32_t last_count;        //count of the previous dropping state
+    bool dropping;
+    atomic_uint_fast64_t shed;
+} codel;
+
+/**
+ * create_codel creates a shedder with target and interval in
+ * milliseconds. returns NULL on failure.
+ */
+codel* create_codel(int target_ms, int interval_ms);
+
+/**
+ * codel_should_shed tells whether a job that waited sojourn
+ * nanoseconds in the queue, and is taken at now (monotonic
+ * nanoseconds), must be shed.
+ */
+bool codel_should_shed(codel* shedder, uint64_t sojourn, uint64_t now);
+
+/**
+ * codel_shed_count returns the number of jobs shed so far.
+ */
+uint64_t codel_shed_count(codel* shedder);
+
+/**
+ * destroy_codel frees the shedder.
+ */
+void destroy_codel(codel* shedder);
+
+#endif
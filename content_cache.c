@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "content_cache.h"
+
+// entity headers are short, this bounds the rendering of one file
+#define MAX_ENTITY_HEADERS 512
+
+void content_cache_release(content_blob* blob) {
+    if (blob != NULL && atomic_fetch_sub(&blob->refs, 1) == 1)
+        free(blob);
+}
+
+content_cache* create_content_cache(size_t budget, size_t max_file, render_fn render) {
+    if (budget == 0 || render == NULL)
+        return NULL;
+    content_cache* cache = (content_cache*) calloc(1, sizeof(content_cache));
+    if (cache == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    size_t shard_budget = budget / CONTENT_CACHE_SHARDS;
+    cache->max_file = max_file < shard_budget ? max_file : shard_budget;
+    cache->render = render;
+
+    // about two counters per file that fits in the budget, at least 1024
+    size_t expected = budget / (cache->max_file / 4 + 1);
+    uint64_t width = 1024;
+    while (width < expected * 2)
+        width <<= 1;
+    cache->sketch_mask = width - 1;
+    cache->sketch_sample = width * 10;
+    cache->sketch = (_Atomic uint8_t*) calloc(SKETCH_ROWS * width, sizeof(uint8_t));
+    if (cache->sketch == NULL) {
+        perror("malloc");
+        free(cache);
+        return NULL;
+    }
+
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        content_cache_shard* shard = &cache->shards[i];
+        shard->budget = shard_budget;
+        shard->num_buckets = 256;
+        shard->buckets = (content_blob**) calloc(shard->num_buckets, sizeof(content_blob*));
+        if (shard->buckets == NULL) {
+            perror("malloc");
+            destroy_content_cache(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return cache;
+}
+
+// counter of the sketch row for a hash
+static _Atomic uint8_t* sketch_counter(content_cache* cache, uint64_t hash, int row) {
+    // a different 16 bits of the hash, mixed, per row
+    uint64_t h = (hash >> (row * 16)) * 0x9E3779B97F4A7C15ULL + row;
+    return &cache->sketch[row * (cache->sketch_mask + 1) + ((h >> 20) & cache->sketch_mask)];
+}
+
+// estimated number of recent requests of a hash
+static unsigned sketch_frequency(content_cache* cache, uint64_t hash) {
+    unsigned frequency = 255;
+    for (int row = 0; row < SKETCH_ROWS; ++row) {
+        unsigned count = atomic_load_explicit(sketch_counter(cache, hash, row), memory_order_relaxed);
+        if (count < frequency)
+            frequency = count;
+    }
+    return frequency;
+}
+
+// count a request of a hash. counters are halved periodically so old popularity fades.
+// increments may race, the sketch is an estimate anyway.
+static void sketch_record(content_cache* cache, uint64_t hash) {
+    for (int row = 0; row < SKETCH_ROWS; ++row) {
+        _Atomic uint8_t* counter = sketch_counter(cache, hash, row);
+        uint8_t count = atomic_load_explicit(counter, memory_order_relaxed);
+        if (count < 255)
+            atomic_store_explicit(counter, count + 1, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&cache->sketch_additions, 1, memory_order_relaxed) + 1 == cache->sketch_sample) {
+        for (uint64_t i = 0; i < SKETCH_ROWS * (cache->sketch_mask + 1); ++i) {
+            uint8_t count = atomic_load_explicit(&cache->sketch[i], memory_order_relaxed);
+            atomic_store_explicit(&cache->sketch[i], count >> 1, memory_order_relaxed);
+        }
+        atomic_store_explicit(&cache->sketch_additions, 0, memory_order_relaxed);
+    }
+}
+
+// hash chain of a hash in a shard. the low bits of the hash pick the shard, so skip them.
+static content_blob** bucket_of(content_cache_shard* shard, uint64_t hash) {
+    return &shard->buckets[(hash >> 16) & (shard->num_buckets - 1)];
+}
+
+// take a blob out of the lru list. the shard lock is held.
+static void lru_remove(content_cache_shard* shard, content_blob* blob) {
+    if (blob->lru_prev != NULL)
+        blob->lru_prev->lru_next = blob->lru_next;
+    else
+        shard->lru_head = blob->lru_next;
+    if (blob->lru_next != NULL)
+        blob->lru_next->lru_prev = blob->lru_prev;
+    else
+        shard->lru_tail = blob->lru_prev;
+}
+
+// unlink a blob from its shard. the shard lock is held.
+static void unlink_blob(content_cache_shard* shard, content_blob* blob) {
+    content_blob** link = bucket_of(shard, blob->hash);
+    while (*link != blob)
+        link = &(*link)->hnext;
+    *link = blob->hnext;
+    lru_remove(shard, blob);
+    shard->bytes -= blob->len;
+}
+
+// put a blob at the front of the lru list. the shard lock is held.
+static void lru_push_front(content_cache_shard* shard, content_blob* blob) {
+    blob->lru_prev = NULL;
+    blob->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+        shard->lru_head->lru_prev = blob;
+    else
+        shard->lru_tail = blob;
+    shard->lru_head = blob;
+}
+
+static content_blob* find_blob(content_cache_shard* shard, const char* path, uint64_t hash) {
+    content_blob* blob = *bucket_of(shard, hash);
+    while (blob != NULL && (blob->hash != hash || strcmp(blob->path, path) != 0))
+        blob = blob->hnext;
+    return blob;
+}
+
+// check whether a blob still matches the file of the entry
+static bool blob_is_current(const content_blob* blob, const file_entry* entry) {
+    return blob->mtime == entry->mtime && blob->mtime_nsec == entry->mtime_nsec && blob->size == entry->size &&
+           blob->ino == entry->ino && blob->dev == entry->dev;
+}
+
+// TinyLFU: admit a file needing len bytes if it fits, or if it is more popular than the lru victim.
+// the shard lock is held.
+static bool admit(content_cache* cache, content_cache_shard* shard, uint64_t hash, size_t len) {
+    if (shard->bytes + len <= shard->budget)
+        return true;
+    return shard->lru_tail != NULL && sketch_frequency(cache, hash) > sketch_frequency(cache, shard->lru_tail->hash);
+}
+
+// read the file of the entry into a new blob, outside any lock
+static content_blob* load_blob(content_cache* cache, const file_entry* entry, uint64_t hash) {
+    char headers[MAX_ENTITY_HEADERS];
+    int header_len = cache->render(headers, sizeof(headers), entry);
+    if (header_len < 0 || (size_t) header_len >= sizeof(headers))
+        return NULL;
+
+    size_t path_len = strlen(entry->resolved) + 1;
+    size_t len = header_len + entry->size;
+    content_blob* blob = (content_blob*) malloc(sizeof(content_blob) + len + path_len);
+    if (blob == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    blob->data = (char*) (blob + 1);
+    blob->len = len;
+    blob->path = blob->data + len;
+    memcpy(blob->path, entry->resolved, path_len);
+    blob->hash = hash;
+    blob->mtime = entry->mtime;
+    blob->mtime_nsec = entry->mtime_nsec;
+    blob->size = entry->size;
+    blob->ino = entry->ino;
+    blob->dev = entry->dev;
+    atomic_init(&blob->refs, 1);
+    blob->hnext = blob->lru_prev = blob->lru_next = NULL;
+    memcpy(blob->data, headers, header_len);
+
+    off_t done = 0;
+    while (done < entry->size) {
+        ssize_t bytes_read = pread(entry->fd, blob->data + header_len + done, entry->size - done, done);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0) {
+            if (bytes_read < 0)
+                perror("pread");
+            free(blob);
+            return NULL;
+        }
+        done += bytes_read;
+    }
+    return blob;
+}
+
+content_blob* content_cache_lookup(content_cache* cache, const file_entry* entry) {
+    if ((size_t) entry->size > cache->max_file)
+        return NULL;
+    uint64_t hash = hash_path(entry->resolved);
+    content_cache_shard* shard = &cache->shards[hash % CONTENT_CACHE_SHARDS];
+    sketch_record(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    content_blob* blob = find_blob(shard, entry->resolved, hash);
+    if (blob != NULL) {
+        if (blob_is_current(blob, entry)) {
+            atomic_fetch_add(&blob->refs, 1);
+            lru_remove(shard, blob);
+            lru_push_front(shard, blob);
+            pthread_mutex_unlock(&shard->lock);
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            return blob;
+        }
+        // the file changed
+        unlink_blob(shard, blob);
+        content_cache_release(blob);
+    }
+    bool admitted = admit(cache, shard, hash, MAX_ENTITY_HEADERS + entry->size);
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    if (!admitted) {
+        atomic_fetch_add_explicit(&cache->rejected, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    content_blob* loaded = load_blob(cache, entry, hash);
+    if (loaded == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    blob = find_blob(shard, entry->resolved, hash);
+    if (blob != NULL && blob_is_current(blob, entry)) {
+        // another thread loaded it meanwhile
+        atomic_fetch_add(&blob->refs, 1);
+        pthread_mutex_unlock(&shard->lock);
+        content_cache_release(loaded);
+        return blob;
+    }
+    if (blob != NULL) {
+        unlink_blob(shard, blob);
+        content_cache_release(blob);
+    }
+    while (shard->bytes + loaded->len > shard->budget && shard->lru_tail != NULL) {
+        content_blob* victim = shard->lru_tail;
+        unlink_blob(shard, victim);
+        content_cache_release(victim);
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    content_blob** bucket = bucket_of(shard, hash);
+    loaded->hnext = *bucket;
+    *bucket = loaded;
+    lru_push_front(shard, loaded);
+    shard->bytes += loaded->len;
+    atomic_fetch_add(&loaded->refs, 1);
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&cache->admitted, 1, memory_order_relaxed);
+    return loaded;
+}
+
+void content_cache_get_stats(content_cache* cache, content_cache_stats* stats) {
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->admitted = atomic_load_explicit(&cache->admitted, memory_order_relaxed);
+    stats->rejected = atomic_load_explicit(&cache->rejected, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    stats->bytes = 0;
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        stats->bytes += cache->shards[i].bytes;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+void destroy_content_cache(content_cache* cache) {
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        content_cache_shard* shard = &cache->shards[i];
+        if (shard->buckets == NULL)
+            continue;
+        while (shard->lru_head != NULL) {
+            content_blob* blob = shard->lru_head;
+            unlink_blob(shard, blob);
+            content_cache_release(blob);
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache->sketch);
+    free(cache);
+}
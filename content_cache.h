@@ -0,0 +1,128 @@
+#ifndef CONTENT_CACHE_H
+#define CONTENT_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "file_cache.h"
+
+/**
+ * content_cache.h
+ *
+ * This file declares an in-memory cache of small static files.
+ * a cached file is held fully rendered: its entity headers
+ * (Content-Type, Content-Length, Last-Modified and the empty line)
+ * followed by the body, so a hit is sent straight from memory.
+ * the cache is bounded by a byte budget and evicts in lru order.
+ * a file is admitted only if it is requested more often than the
+ * entry it would evict (TinyLFU), estimated with a count-min
+ * sketch, so a single crawl over many files can't flush the hot set.
+ */
+
+#define CONTENT_CACHE_SHARDS 16
+#define SKETCH_ROWS 4
+
+/**
+ * render_fn writes the entity headers of a 200 response for
+ * entry into buf (at most size bytes) and returns their length,
+ * like snprintf.
+ */
+typedef int (*render_fn)(char* buf, size_t size, const file_entry* entry);
+
+/**
+ * a cached file. reference counted like file_entry.
+ */
+typedef struct content_blob {
+    char* data;                 //entity headers followed by the body
+    size_t len;
+    char* path;                 //resolved path, the key
+    uint64_t hash;
+    time_t mtime;               //identity of the file the blob was read from
+    long mtime_nsec;
+    off_t size;
+    ino_t ino;
+    dev_t dev;
+    atomic_int refs;
+    struct content_blob* hnext;
+    struct content_blob* lru_prev;
+    struct content_blob* lru_next;
+} content_blob;
+
+typedef struct content_cache_shard {
+    pthread_mutex_t lock;
+    content_blob** buckets;
+    int num_buckets;
+    size_t bytes;
+    size_t budget;
+    content_blob* lru_head;     //most recently used
+    content_blob* lru_tail;
+} content_cache_shard;
+
+/**
+ * counters of the cache
+ */
+typedef struct content_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admitted;
+    uint64_t rejected;          //misses the admission policy kept out
+    uint64_t evictions;
+    size_t bytes;
+} content_cache_stats;
+
+/**
+ * The cache
+ */
+typedef struct content_cache {
+    content_cache_shard shards[CONTENT_CACHE_SHARDS];
+    size_t max_file;            //larger files are never cached
+    render_fn render;
+    _Atomic uint8_t* sketch;    //SKETCH_ROWS rows of sketch_mask + 1 counters
+    uint64_t sketch_mask;
+    atomic_uint_fast64_t sketch_additions; //halve all counters every sketch_sample additions
+    uint64_t sketch_sample;
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t admitted;
+    atomic_uint_fast64_t rejected;
+    atomic_uint_fast64_t evictions;
+} content_cache;
+
+/**
+ * create_content_cache creates a cache holding at most budget
+ * bytes of files no larger than max_file bytes.
+ * render formats the cached entity headers.
+ * returns NULL on failure.
+ */
+content_cache* create_content_cache(size_t budget, size_t max_file, render_fn render);
+
+/**
+ * content_cache_lookup returns the cached rendering of the 200
+ * regular file entry, loading it from entry->fd if the admission
+ * policy lets it in. a blob whose file changed (mtime, to the
+ * nanosecond, size or inode) is dropped and reloaded.
+ * returns NULL when the file is not (and won't be) cached, the
+ * caller then sends it from the file. a returned blob must be
+ * released with content_cache_release.
+ */
+content_blob* content_cache_lookup(content_cache* cache, const file_entry* entry);
+
+/**
+ * content_cache_release drops a reference returned by
+ * content_cache_lookup.
+ */
+void content_cache_release(content_blob* blob);
+
+/**
+ * content_cache_get_stats copies the counters of the cache.
+ */
+void content_cache_get_stats(content_cache* cache, content_cache_stats* stats);
+
+/**
+ * destroy_content_cache frees the cache. blobs still referenced
+ * are freed with their last reference.
+ */
+void destroy_content_cache(content_cache* cache);
+
+#endif
@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dir_cache.h"
+#include "file_cache.h"
+
+// everything that changes a row of a listing
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                    IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+void dir_cache_release(dir_listing* listing) {
+    if (listing != NULL && atomic_fetch_sub(&listing->refs, 1) == 1) {
+        free(listing->data);
+        free(listing);
+    }
+}
+
+// the directory of a request path, relative to the server root
+static const char* dir_path(const char* path) {
+    path += strspn(path, "/");
+    return *path == '\0' ? "." : path;
+}
+
+// chain of a hash in the table. the buckets are a power of two.
+static dir_listing** bucket_of(dir_cache* cache, uint64_t hash) {
+    return &cache->buckets[hash & (cache->num_buckets - 1)];
+}
+
+static dir_listing** wd_bucket_of(dir_cache* cache, int wd) {
+    return &cache->wd_buckets[wd & (cache->num_buckets - 1)];
+}
+
+// watch the directory of a listing about to be rendered, or take another use of its watch.
+// returns the watch, or -1 to check the listing by mtime. the lock is held.
+static int acquire_watch(dir_cache* cache, const char* dir) {
+    int wd = inotify_add_watch(cache->inotify_fd, dir, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0)
+        return -1;
+    dir_watch** link = &cache->watches[wd & (cache->num_buckets - 1)];
+    dir_watch* watch = *link;
+    while (watch != NULL && watch->wd != wd)
+        watch = watch->next;
+    if (watch == NULL) {
+        watch = (dir_watch*) malloc(sizeof(dir_watch));
+        if (watch == NULL) {
+            perror("malloc");
+            inotify_rm_watch(cache->inotify_fd, wd);
+            return -1;
+        }
+        watch->wd = wd;
+        watch->users = 0;
+        watch->next = *link;
+        *link = watch;
+    }
+    watch->users++;
+    return wd;
+}
+
+// drop a use of a watch, and the watch with its last use. the kernel may have removed it
+// already, with its directory. the lock is held.
+static void release_watch(dir_cache* cache, int wd) {
+    if (wd < 0)
+        return;
+    dir_watch** link = &cache->watches[wd & (cache->num_buckets - 1)];
+    while ((*link)->wd != wd)
+        link = &(*link)->next;
+    dir_watch* watch = *link;
+    if (--watch->users > 0)
+        return;
+    *link = watch->next;
+    free(watch);
+    inotify_rm_watch(cache->inotify_fd, wd);
+}
+
+// take a listing out of the lru list. the lock is held.
+static void lru_remove(dir_cache* cache, dir_listing* listing) {
+    if (listing->lru_prev != NULL)
+        listing->lru_prev->lru_next = listing->lru_next;
+    else
+        cache->lru_head = listing->lru_next;
+    if (listing->lru_next != NULL)
+        listing->lru_next->lru_prev = listing->lru_prev;
+    else
+        cache->lru_tail = listing->lru_prev;
+}
+
+// put a listing at the front of the lru list. the lock is held.
+static void lru_push_front(dir_cache* cache, dir_listing* listing) {
+    listing->lru_prev = NULL;
+    listing->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = listing;
+    else
+        cache->lru_tail = listing;
+    cache->lru_head = listing;
+}
+
+// unlink a listing from the table and drop the cache's reference. the lock is held.
+static void drop_listing(dir_cache* cache, dir_listing* listing) {
+    dir_listing** link = bucket_of(cache, listing->hash);
+    while (*link != listing)
+        link = &(*link)->hnext;
+    *link = listing->hnext;
+    if (listing->wd >= 0) {
+        link = wd_bucket_of(cache, listing->wd);
+        while (*link != listing)
+            link = &(*link)->wd_next;
+        *link = listing->wd_next;
+        release_watch(cache, listing->wd);
+    }
+    lru_remove(cache, listing);
+    cache->count--;
+    dir_cache_release(listing);
+}
+
+// drop the listings of a watched directory. the lock is held.
+static void drop_watch(dir_cache* cache, int wd) {
+    dir_listing* listing = *wd_bucket_of(cache, wd);
+    while (listing != NULL) {
+        dir_listing* next = listing->wd_next;
+        if (listing->wd == wd) {
+            drop_listing(cache, listing);
+            atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+        }
+        listing = next;
+    }
+}
+
+// drop every listing. the lock is held.
+static void drop_all(dir_cache* cache) {
+    while (cache->lru_head != NULL) {
+        drop_listing(cache, cache->lru_head);
+        atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+    }
+}
+
+// watcher thread: drop the listing of every directory inotify reports a change in
+static void* watch_directories(void* arg) {
+    dir_cache* cache = (dir_cache*) arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = cache->inotify_fd, .events = POLLIN },
+        { .fd = cache->stop_fd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+        ssize_t len = read(cache->inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            continue;
+
+        // a listing being rendered right now must not be inserted
+        atomic_fetch_add(&cache->generation, 1);
+        pthread_mutex_lock(&cache->lock);
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            if (event->mask & IN_Q_OVERFLOW)
+                drop_all(cache);
+            else
+                drop_watch(cache, event->wd);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return NULL;
+}
+
+dir_cache* create_dir_cache(int capacity, listing_fn render) {
+    if (capacity <= 0 || render == NULL)
+        return NULL;
+    dir_cache* cache = (dir_cache*) calloc(1, sizeof(dir_cache));
+    if (cache == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    cache->capacity = capacity;
+    cache->render = render;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < capacity * 2)
+        cache->num_buckets <<= 1;
+    cache->buckets = (dir_listing**) calloc(cache->num_buckets, sizeof(dir_listing*));
+    cache->wd_buckets = (dir_listing**) calloc(cache->num_buckets, sizeof(dir_listing*));
+    cache->watches = (dir_watch**) calloc(cache->num_buckets, sizeof(dir_watch*));
+    if (cache->buckets == NULL || cache->wd_buckets == NULL || cache->watches == NULL) {
+        perror("malloc");
+        free(cache->buckets);
+        free(cache->wd_buckets);
+        free(cache->watches);
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+
+    // without inotify every hit checks the directory's mtime
+    cache->stop_fd = -1;
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd < 0)
+        perror("inotify_init1");
+    else if ((cache->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+             pthread_create(&cache->watcher, NULL, watch_directories, cache) != 0) {
+        perror("dir cache watcher");
+        if (cache->stop_fd >= 0)
+            close(cache->stop_fd);
+        close(cache->inotify_fd);
+        cache->stop_fd = cache->inotify_fd = -1;
+    }
+    return cache;
+}
+
+static dir_listing* find_listing(dir_cache* cache, const char* path, uint64_t hash) {
+    dir_listing* listing = *bucket_of(cache, hash);
+    while (listing != NULL && (listing->hash != hash || strcmp(listing->path, path) != 0))
+        listing = listing->hnext;
+    return listing;
+}
+
+// check an unwatched listing against its directory. a watched listing is current while it is in the table.
+static bool listing_is_current(const dir_listing* listing, int dir_fd) {
+    struct stat stat_buf;
+    if (listing->wd >= 0)
+        return true;
+    if (fstat(dir_fd, &stat_buf) < 0)
+        return false;
+    return stat_buf.st_ino == listing->ino &&
+           stat_buf.st_mtim.tv_sec == listing->mtime.tv_sec &&
+           stat_buf.st_mtim.tv_nsec == listing->mtime.tv_nsec;
+}
+
+dir_listing* dir_cache_lookup(dir_cache* cache, const char* path, int dir_fd) {
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&cache->lock);
+    dir_listing* listing = find_listing(cache, path, hash);
+    if (listing != NULL) {
+        atomic_fetch_add(&listing->refs, 1);
+        lru_remove(cache, listing);
+        lru_push_front(cache, listing);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (listing != NULL) {
+        if (listing_is_current(listing, dir_fd)) {
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            return listing;
+        }
+        pthread_mutex_lock(&cache->lock);
+        if (find_listing(cache, path, hash) == listing) {
+            drop_listing(cache, listing);
+            atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        dir_cache_release(listing);
+    }
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    // watch before reading, so a change during the rendering is reported
+    struct stat stat_buf;
+    int wd = -1;
+    if (cache->inotify_fd >= 0) {
+        pthread_mutex_lock(&cache->lock);
+        wd = acquire_watch(cache, dir_path(path));
+        pthread_mutex_unlock(&cache->lock);
+    }
+    uint64_t generation = atomic_load(&cache->generation);
+    size_t path_len = strlen(path) + 1;
+    dir_listing* built = NULL;
+    if (fstat(dir_fd, &stat_buf) < 0)
+        goto fail;
+    built = (dir_listing*) calloc(1, sizeof(dir_listing) + path_len);
+    if (built == NULL) {
+        perror("malloc");
+        goto fail;
+    }
+    built->data = cache->render(path, dir_fd, &built->len);
+    if (built->data == NULL)
+        goto fail;
+    built->path = (char*) (built + 1);
+    memcpy(built->path, path, path_len);
+    built->hash = hash;
+    built->wd = wd;
+    built->mtime = stat_buf.st_mtim;
+    built->ino = stat_buf.st_ino;
+    built->serial = atomic_fetch_add(&cache->serials, 1) + 1;
+    atomic_init(&built->refs, 1);
+
+    pthread_mutex_lock(&cache->lock);
+    // a change was reported while rendering: serve the listing once, uncached
+    if (wd >= 0 && atomic_load(&cache->generation) != generation) {
+        release_watch(cache, wd);
+        built->wd = -1;
+        pthread_mutex_unlock(&cache->lock);
+        return built;
+    }
+    listing = find_listing(cache, path, hash);
+    if (listing != NULL)
+        drop_listing(cache, listing);
+    dir_listing** bucket = bucket_of(cache, hash);
+    built->hnext = *bucket;
+    *bucket = built;
+    if (built->wd >= 0) {
+        built->wd_next = *wd_bucket_of(cache, built->wd);
+        *wd_bucket_of(cache, built->wd) = built;
+    }
+    lru_push_front(cache, built);
+    cache->count++;
+    atomic_fetch_add(&built->refs, 1);
+    while (cache->count > cache->capacity) {
+        drop_listing(cache, cache->lru_tail);
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return built;
+
+fail:
+    free(built);
+    pthread_mutex_lock(&cache->lock);
+    release_watch(cache, wd);
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+void dir_cache_get_stats(dir_cache* cache, dir_cache_stats* stats) {
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->invalidations = atomic_load_explicit(&cache->invalidations, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    pthread_mutex_lock(&cache->lock);
+    stats->entries = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void destroy_dir_cache(dir_cache* cache) {
+    if (cache->inotify_fd >= 0) {
+        uint64_t one = 1;
+        if (write(cache->stop_fd, &one, sizeof(one)) != sizeof(one))
+            perror("write");
+        pthread_join(cache->watcher, NULL);
+    }
+    while (cache->lru_head != NULL)
+        drop_listing(cache, cache->lru_head);
+    if (cache->inotify_fd >= 0) {
+        close(cache->stop_fd);
+        close(cache->inotify_fd);
+    }
+    free(cache->buckets);
+    free(cache->wd_buckets);
+    free(cache->watches);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
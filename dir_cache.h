@@ -0,0 +1,130 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * dir_cache.h
+ *
+ * This file declares a cache of rendered directory listings.
+ * a listing is built once and served from memory until the
+ * directory changes. changes are reported by inotify: a watcher
+ * thread drops the listing of a directory as soon as an entry is
+ * created, removed, renamed or modified in it. when inotify is not
+ * available (or out of watches) a listing is checked against the
+ * mtime of its directory instead, which catches added, removed and
+ * renamed entries but not a file that changed in place.
+ */
+
+/**
+ * listing_fn renders the listing of the directory dir_fd (an O_PATH
+ * descriptor) at the request path (which starts and ends with '/').
+ * it returns a malloced body and stores its length in len, or
+ * returns NULL on failure.
+ */
+typedef char* (*listing_fn)(const char* path, int dir_fd, size_t* len);
+
+/**
+ * a cached listing. reference counted: the cache holds a reference
+ * while the listing is in the table and every lookup returns
+ * another one, released with dir_cache_release.
+ */
+typedef struct dir_listing {
+    char* data;                 //the html body
+    size_t len;
+    char* path;                 //request path, the key
+    uint64_t hash;
+    int wd;                     //inotify watch of the directory, -1 when checked by mtime
+    struct timespec mtime;      //of the directory when the listing was built
+    ino_t ino;
+    uint64_t serial;            //differs between the listings rendered for a path
+    atomic_int refs;
+    struct dir_listing* hnext;  //hash chain by path
+    struct dir_listing* wd_next;    //hash chain by watch
+    struct dir_listing* lru_prev;
+    struct dir_listing* lru_next;
+} dir_listing;
+
+/**
+ * an inotify watch and the listings that rely on it, cached or being
+ * rendered. the watch is removed with the last of them.
+ */
+typedef struct dir_watch {
+    int wd;
+    int users;
+    struct dir_watch* next;     //hash chain by watch
+} dir_watch;
+
+/**
+ * counters of the cache
+ */
+typedef struct dir_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;     //listings dropped because their directory changed
+    uint64_t evictions;
+    int entries;
+} dir_cache_stats;
+
+/**
+ * The cache
+ */
+typedef struct dir_cache {
+    pthread_mutex_t lock;
+    dir_listing** buckets;
+    dir_listing** wd_buckets;
+    dir_watch** watches;
+    int num_buckets;
+    int count;
+    int capacity;
+    dir_listing* lru_head;      //most recently used
+    dir_listing* lru_tail;
+    listing_fn render;
+    int inotify_fd;             //-1 when the mtime check is used
+    int stop_fd;                //eventfd that stops the watcher
+    pthread_t watcher;
+    atomic_uint_fast64_t generation;    //bumped on every batch of inotify events
+    atomic_uint_fast64_t serials;       //last serial given to a listing
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t invalidations;
+    atomic_uint_fast64_t evictions;
+} dir_cache;
+
+/**
+ * create_dir_cache creates a cache of at most capacity listings
+ * rendered by render, and starts its inotify watcher.
+ * returns NULL on failure.
+ */
+dir_cache* create_dir_cache(int capacity, listing_fn render);
+
+/**
+ * dir_cache_lookup returns the listing of the directory dir_fd at the
+ * request path, rendering it on a miss. the caller must release it
+ * with dir_cache_release. returns NULL if the listing could not be
+ * rendered.
+ */
+dir_listing* dir_cache_lookup(dir_cache* cache, const char* path, int dir_fd);
+
+/**
+ * dir_cache_release drops a reference returned by dir_cache_lookup.
+ */
+void dir_cache_release(dir_listing* listing);
+
+/**
+ * dir_cache_get_stats copies the counters of the cache.
+ */
+void dir_cache_get_stats(dir_cache* cache, dir_cache_stats* stats);
+
+/**
+ * destroy_dir_cache stops the watcher and frees the cache. listings
+ * still referenced are freed with their last reference.
+ */
+void destroy_dir_cache(dir_cache* cache);
+
+#endif
@@ -0,0 +1,983 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "event_loop.h"
+#include "metrics.h"
+#include "server.h"
+
+// epoll tags of the two non-connection descriptors of a loop
+static char listener_tag;
+static char wake_tag;
+
+static void close_connection(connection* conn);
+static void flush_connection(connection* conn);
+static void uring_flush(connection* conn);
+static void uring_resume_accept(event_loop* loop);
+
+// monotonic time in seconds
+static time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// remove a connection from the timeout list of its loop
+static void idle_remove(connection* conn) {
+    event_loop* loop = conn->loop;
+    if (conn->idle_prev != NULL)
+        conn->idle_prev->idle_next = conn->idle_next;
+    else if (loop->idle_head == conn)
+        loop->idle_head = conn->idle_next;
+    else
+        return;
+    if (conn->idle_next != NULL)
+        conn->idle_next->idle_prev = conn->idle_prev;
+    else
+        loop->idle_tail = conn->idle_prev;
+    conn->idle_prev = conn->idle_next = NULL;
+}
+
+// check whether a connection is on the timeout list of its loop
+static bool idle_listed(const connection* conn) {
+    return conn->idle_prev != NULL || conn->loop->idle_head == conn;
+}
+
+// mark progress on a connection, moving it to the end of the timeout list
+static void idle_touch(connection* conn) {
+    event_loop* loop = conn->loop;
+    idle_remove(conn);
+    conn->last_active = loop->now;
+    conn->idle_prev = loop->idle_tail;
+    if (loop->idle_tail != NULL)
+        loop->idle_tail->idle_next = conn;
+    else
+        loop->idle_head = conn;
+    loop->idle_tail = conn;
+}
+
+// close the connections that made no progress for keepalive_timeout seconds
+static void expire_idle(event_loop* loop) {
+    while (loop->idle_head != NULL && loop->now - loop->idle_head->last_active >= loop->engine->keepalive_timeout) {
+        DEBUG_PRINT("idle timeout: %d\n", loop->idle_head->fd);
+        close_connection(loop->idle_head);
+    }
+    // a second after the accept ran out of descriptors, try again
+    if (loop->accept_paused && loop->now > loop->accept_paused_at)
+        uring_resume_accept(loop);
+}
+
+// wake a loop thread
+static void wake_loop(event_loop* loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write eventfd");
+}
+
+// tell all loops to exit once the last connection is closed
+static void stop_engine(event_engine* engine) {
+    atomic_store(&engine->stopping, 1);
+    for (int i = 0; i < engine->num_loops; ++i)
+        wake_loop(&engine->loops[i]);
+}
+
+event_engine* create_event_engine(const int* listen_fds, int num_listeners, int num_loops,
+                                  threadpool** pools, int num_pools, dispatch_fn handler, int max_connections) {
+    if (num_loops <= 0 || num_listeners <= 0 || num_listeners > num_loops || num_pools <= 0 || handler == NULL)
+        return NULL;
+    event_engine* engine = (event_engine*) calloc(1, sizeof(event_engine));
+    if (engine == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    engine->loops = (event_loop*) calloc(num_loops, sizeof(event_loop));
+    if (engine->loops == NULL) {
+        perror("malloc");
+        free(engine);
+        return NULL;
+    }
+    engine->num_loops = num_loops;
+    engine->num_listeners = num_listeners;
+    engine->handler = handler;
+    engine->max_connections = max_connections;
+    engine->keepalive_timeout = 5;
+    engine->max_keepalive_requests = 100;
+    engine->backend = IO_EPOLL;
+    // connections beyond those the pool can hold (queued or being answered) come from malloc
+    int conn_capacity = 0;
+    for (int i = 0; i < num_pools; ++i)
+        conn_capacity += pools[i]->max_qsize + pools[i]->max_threads;
+    engine->conn_slab = create_slab(sizeof(connection), conn_capacity);
+    if (engine->conn_slab == NULL) {
+        free(engine->loops);
+        free(engine);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_loops; ++i) {
+        event_loop* loop = &engine->loops[i];
+        loop->engine = engine;
+        loop->listen_fd = i < num_listeners ? listen_fds[i] : -1;
+        loop->pool = pools[i % num_pools];
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epfd < 0 || loop->wake_fd < 0) {
+            perror("epoll_create");
+            engine->num_loops = i + 1;
+            destroy_event_engine(engine);
+            return NULL;
+        }
+        pthread_mutex_init(&loop->done_lock, NULL);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wake_tag };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            engine->num_loops = i + 1;
+            destroy_event_engine(engine);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < num_listeners; ++i) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listener_tag };
+        if (epoll_ctl(engine->loops[i].epfd, EPOLL_CTL_ADD, listen_fds[i], &ev) < 0) {
+            perror("epoll_ctl");
+            destroy_event_engine(engine);
+            return NULL;
+        }
+    }
+    return engine;
+}
+
+// count a socket accepted by loop and set up its connection. with a single listener
+// the connections are spread over the loops, with several each loop keeps the ones it
+// accepted. returns NULL, with the socket closed, past max_connections or without memory.
+static connection* open_connection(event_loop* loop, int client_sock) {
+    event_engine* engine = loop->engine;
+    DEBUG_PRINT("socket = %d\n", client_sock);
+
+    // other loops accept too: the connection counts only if it is within max_connections.
+    // active is raised first, so the last close can't stop the engine while this one opens.
+    atomic_fetch_add(&engine->active, 1);
+    if (atomic_fetch_add(&engine->accepted, 1) >= engine->max_connections) {
+        close(client_sock);
+        if (atomic_fetch_sub(&engine->active, 1) == 1)
+            stop_engine(engine);
+        return NULL;
+    }
+
+    connection* conn = (connection*) slab_alloc(engine->conn_slab);
+    if (conn == NULL) {
+        close(client_sock);
+        if (atomic_fetch_sub(&engine->active, 1) == 1 && atomic_load(&engine->accepted) >= engine->max_connections)
+            stop_engine(engine);
+        return NULL;
+    }
+    conn->fd = client_sock;
+    conn->state = CONN_READING;
+    conn->loop = engine->num_listeners > 1 ? loop : &engine->loops[engine->next_loop++ % engine->num_loops];
+    conn->in[0] = '\0';
+    conn->in_len = 0;
+    http_parser_init(&conn->parser);
+    conn->body_left = 0;
+    conn->out_head = conn->out_count = 0;
+    conn->requests = 0;
+    conn->http11 = false;
+    conn->peer_closed = conn->close_after = conn->corked = false;
+    conn->status = 0;
+    conn->peer_known = false;
+    conn->last_active = 0;
+    conn->idle_prev = conn->idle_next = NULL;
+    conn->next = NULL;
+    conn->inflight = 0;
+    conn->closing = conn->chain_failed = false;
+    conn->chunk = NULL;
+    return conn;
+}
+
+// accept all pending connections of the loop's listener
+static void accept_connections(event_loop* loop) {
+    event_engine* engine = loop->engine;
+    while (atomic_load(&engine->accepted) < engine->max_connections) {
+        int client_sock = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        connection* conn = open_connection(loop, client_sock);
+        if (conn == NULL)
+            continue;
+
+        // edge triggered, registered once for the whole life of the connection
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            perror("epoll_ctl");
+            close_connection(conn);
+        }
+    }
+    // served enough connections, stop accepting
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+}
+
+// drop the buffered bytes of the body of the last request, the next request starts after them
+static void skip_body(connection* conn) {
+    size_t skip = conn->body_left < conn->in_len ? conn->body_left : conn->in_len;
+    if (skip == 0)
+        return;
+    memmove(conn->in, conn->in + skip, conn->in_len - skip + 1);
+    conn->in_len -= skip;
+    conn->body_left -= skip;
+}
+
+bool request_ready(connection* conn) {
+    skip_body(conn);
+    if (conn->body_left > 0)
+        return false;
+    if (http_parse(&conn->parser, conn->in, conn->in_len) != HTTP_PARSE_AGAIN)
+        return true;
+    if (conn->in_len == sizeof(conn->in) - 1)
+        return true;
+    return conn->peer_closed && conn->in_len > 0;
+}
+
+// hand the connection to the pool to answer its buffered requests. when the pool's
+// queue is full the loop doesn't wait: reject queues an answer and it is sent right away.
+static void process_requests(connection* conn) {
+    event_engine* engine = conn->loop->engine;
+    idle_remove(conn);
+    conn->state = CONN_PROCESSING;
+    conn->dispatched_at = monotonic_ns();
+    if (engine->reject == NULL) {
+        dispatch(conn->loop->pool, engine->handler, conn);
+        return;
+    }
+    if (try_dispatch(conn->loop->pool, engine->handler, conn) == 0)
+        return;
+    atomic_fetch_add_explicit(&engine->rejected, 1, memory_order_relaxed);
+    engine->reject(conn);
+    conn->state = CONN_WRITING;
+    if (engine->backend == IO_URING)
+        uring_flush(conn);
+    else
+        flush_connection(conn);
+}
+
+// read from the client until a complete request is buffered
+static void read_request(connection* conn) {
+    bool progress = false;
+    while (!conn->peer_closed && conn->in_len < sizeof(conn->in) - 1) {
+        ssize_t bytes_read = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - 1 - conn->in_len);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("read");
+            close_connection(conn);
+            return;
+        }
+        if (bytes_read == 0) {
+            conn->peer_closed = true;
+            break;
+        }
+        progress = true;
+        conn->in_len += bytes_read;
+        conn->in[conn->in_len] = '\0';
+        skip_body(conn);
+        if (conn->body_left == 0 && http_parse(&conn->parser, conn->in, conn->in_len) != HTTP_PARSE_AGAIN)
+            break;
+    }
+
+    if (request_ready(conn)) {
+        process_requests(conn);
+        return;
+    }
+    // nothing more will arrive
+    if (conn->peer_closed) {
+        close_connection(conn);
+        return;
+    }
+    // a new connection starts its timeout on the first event of its loop
+    if (progress || !idle_listed(conn))
+        idle_touch(conn);
+}
+
+void complete_connection(connection* conn) {
+    event_loop* loop = conn->loop;
+    conn->next = NULL;
+    pthread_mutex_lock(&loop->done_lock);
+    bool was_empty = loop->done_head == NULL;
+    if (was_empty)
+        loop->done_head = conn;
+    else
+        loop->done_tail->next = conn;
+    loop->done_tail = conn;
+    pthread_mutex_unlock(&loop->done_lock);
+    // the loop drains the whole list on each wake up
+    if (was_empty)
+        wake_loop(loop);
+}
+
+// take the completion list of a loop
+static connection* take_completions(event_loop* loop) {
+    pthread_mutex_lock(&loop->done_lock);
+    connection* conn = loop->done_head;
+    loop->done_head = loop->done_tail = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+    return conn;
+}
+
+// take back the connections completed by the pool and start writing
+static void drain_completions(event_loop* loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read eventfd");
+
+    connection* conn = take_completions(loop);
+
+    while (conn != NULL) {
+        connection* next = conn->next;
+        conn->state = CONN_WRITING;
+        flush_connection(conn);
+        conn = next;
+    }
+}
+
+bool queue_data(connection* conn, const char* data, size_t len, release_fn release, void* arg) {
+    if (conn->out_count == CONN_MAX_SEGS)
+        return false;
+    out_seg* seg = &conn->out[(conn->out_head + conn->out_count) % CONN_MAX_SEGS];
+    seg->data = data;
+    seg->len = len;
+    seg->release = release;
+    seg->release_arg = arg;
+    seg->fd = -1;
+    seg->pipe_fds[0] = seg->pipe_fds[1] = -1;
+    seg->piped = 0;
+    conn->out_count++;
+    return true;
+}
+
+bool queue_file(connection* conn, int fd, off_t off, off_t end, release_fn release, void* arg) {
+    if (conn->out_count == CONN_MAX_SEGS)
+        return false;
+    out_seg* seg = &conn->out[(conn->out_head + conn->out_count) % CONN_MAX_SEGS];
+    seg->data = NULL;
+    seg->len = 0;
+    seg->release = release;
+    seg->release_arg = arg;
+    seg->fd = fd;
+    seg->off = off;
+    seg->end = end;
+    seg->mode = SEND_SENDFILE;
+    seg->pipe_fds[0] = seg->pipe_fds[1] = -1;
+    seg->piped = 0;
+    conn->out_count++;
+    return true;
+}
+
+// release the first queued segment
+static void pop_segment(connection* conn) {
+    out_seg* seg = &conn->out[conn->out_head];
+    if (seg->release != NULL)
+        seg->release(seg->release_arg);
+    if (seg->pipe_fds[0] >= 0) {
+        close(seg->pipe_fds[0]);
+        close(seg->pipe_fds[1]);
+    }
+    conn->out_head = (conn->out_head + 1) % CONN_MAX_SEGS;
+    conn->out_count--;
+}
+
+// write the consecutive memory segments at the head of the queue with one sendmsg
+static int write_memory_segments(connection* conn) {
+    struct iovec iov[CONN_MAX_SEGS];
+    int count = 0;
+    bool file_follows = false;
+    while (count < conn->out_count) {
+        out_seg* seg = &conn->out[(conn->out_head + count) % CONN_MAX_SEGS];
+        if (seg->fd >= 0) {
+            file_follows = true;
+            break;
+        }
+        iov[count].iov_base = (void*) seg->data;
+        iov[count].iov_len = seg->len;
+        count++;
+    }
+
+    // headers followed by a file body: let the kernel put them in the body's first packet
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+    ssize_t bytes_written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (file_follows ? MSG_MORE : 0));
+    if (bytes_written < 0) {
+        if (errno == EINTR)
+            return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        perror("sendmsg");
+        return -1;
+    }
+    metrics_add_bytes_sent(bytes_written);
+    while (bytes_written > 0) {
+        out_seg* seg = &conn->out[conn->out_head];
+        if ((size_t) bytes_written < seg->len) {
+            seg->data += bytes_written;
+            seg->len -= bytes_written;
+            break;
+        }
+        bytes_written -= seg->len;
+        pop_segment(conn);
+    }
+    return 1;
+}
+
+// set or clear TCP_CORK on the connection
+static void set_cork(connection* conn, bool on) {
+    int value = on;
+    if (setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0)
+        conn->corked = on;
+}
+
+// check whether anything is queued after the first file segment
+static bool output_after_file(const connection* conn) {
+    for (int i = 0; i < conn->out_count - 1; ++i) {
+        if (conn->out[(conn->out_head + i) % CONN_MAX_SEGS].fd >= 0)
+            return true;
+    }
+    return false;
+}
+
+// write as much of the queued responses as the socket accepts
+static void flush_connection(connection* conn) {
+    // MSG_MORE covers headers + one file. pipelined responses after a file body are
+    // corked so the end of each body shares packets with the next headers.
+    if (!conn->corked && output_after_file(conn))
+        set_cork(conn, true);
+
+    while (conn->out_count > 0) {
+        out_seg* seg = &conn->out[conn->out_head];
+        int sent;
+        if (seg->fd >= 0) {
+            sent = send_file_to_socket(seg, conn->fd);
+            if (sent == 1)
+                pop_segment(conn);
+        }
+        else
+            sent = write_memory_segments(conn);
+        if (sent == 0) {
+            idle_touch(conn);
+            return;
+        }
+        if (sent < 0) {
+            close_connection(conn);
+            return;
+        }
+    }
+    if (conn->corked)
+        set_cork(conn, false);
+
+    if (conn->close_after) {
+        close_connection(conn);
+        return;
+    }
+    // wait for the next request, which may already be buffered
+    conn->state = CONN_READING;
+    idle_touch(conn);
+    if (request_ready(conn))
+        process_requests(conn);
+    else
+        read_request(conn);
+}
+
+static void close_connection(connection* conn) {
+    event_engine* engine = conn->loop->engine;
+    // io_uring operations still refer to the connection and its buffers: shut the socket
+    // down so they complete, the last completion closes it
+    if (conn->inflight > 0) {
+        idle_remove(conn);
+        if (!conn->closing) {
+            conn->closing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    DEBUG_PRINT("CLOSING SOCKET: %d\n", conn->fd);
+    idle_remove(conn);
+    close(conn->fd);
+    while (conn->out_count > 0)
+        pop_segment(conn);
+    free(conn->chunk);
+    event_loop* loop = conn->loop;
+    slab_free(engine->conn_slab, conn);
+    // a descriptor was freed for the paused accept
+    if (loop->accept_paused)
+        uring_resume_accept(loop);
+    if (atomic_fetch_sub(&engine->active, 1) == 1 && atomic_load(&engine->accepted) >= engine->max_connections)
+        stop_engine(engine);
+}
+
+// the event-loop thread
+static void* run_loop(void* arg) {
+    event_loop* loop = (event_loop*) arg;
+    struct epoll_event events[MAX_EVENTS];
+    loop->now = monotonic_seconds();
+    while (!atomic_load(&loop->engine->stopping)) {
+        bool woken = false;
+        // wake up every second while there are connections to time out
+        int ready = epoll_wait(loop->epfd, events, MAX_EVENTS, loop->idle_head != NULL ? 1000 : -1);
+        loop->now = monotonic_seconds();
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < ready; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == &listener_tag) {
+                accept_connections(loop);
+                continue;
+            }
+            if (tag == &wake_tag) {
+                woken = true;
+                continue;
+            }
+            connection* conn = (connection*) tag;
+            // the pool owns the connection, the response write will see any error
+            if (conn->state == CONN_PROCESSING)
+                continue;
+            if (conn->state == CONN_READING)
+                read_request(conn);
+            else if (conn->state == CONN_WRITING && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+                flush_connection(conn);
+        }
+        // after the batch, so no event of this batch can refer to a connection closed here
+        if (woken)
+            drain_completions(loop);
+        expire_idle(loop);
+    }
+    return NULL;
+}
+
+// user_data of the io_uring operations: a connection's carry the connection with the
+// operation in the low bits, below its alignment. the loop's own are small numbers.
+enum { URING_ACCEPT = 1, URING_WAKE, URING_CANCEL };
+enum { OP_RECV = 1, OP_SENDMSG, OP_FILE_READ, OP_FILE_SEND };
+#define OP_MASK 7
+
+static uint64_t conn_op(connection* conn, int op) {
+    return (uint64_t) (uintptr_t) conn | op;
+}
+
+// arm the multishot accept of the loop's listener
+static void uring_accept(event_loop* loop) {
+    struct io_uring_sqe* sqe = io_ring_get_sqe(&loop->ring);
+    if (sqe == NULL)
+        return;
+    io_ring_prep(sqe, IORING_OP_ACCEPT, loop->listen_fd, NULL, 0, 0, URING_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    loop->accepting = true;
+}
+
+// re-arm the accept that was paused because the process ran out of descriptors
+static void uring_resume_accept(event_loop* loop) {
+    event_engine* engine = loop->engine;
+    loop->accept_paused = false;
+    if (!loop->accepting && atomic_load(&engine->accepted) < engine->max_connections)
+        uring_accept(loop);
+}
+
+// arm the read of the loop's eventfd
+static void uring_wait_wake(event_loop* loop) {
+    struct io_uring_sqe* sqe = io_ring_get_sqe(&loop->ring);
+    if (sqe != NULL)
+        io_ring_prep(sqe, IORING_OP_READ, loop->wake_fd, &loop->wake_count, sizeof(loop->wake_count), 0, URING_WAKE);
+}
+
+// receive into the connection: into a provided buffer of the loop, or with direct
+// straight into the request buffer
+static void uring_recv(connection* conn, bool direct) {
+    event_loop* loop = conn->loop;
+    struct io_uring_sqe* sqe = io_ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        close_connection(conn);
+        return;
+    }
+    size_t space = sizeof(conn->in) - 1 - conn->in_len;
+    if (direct)
+        io_ring_prep(sqe, IORING_OP_RECV, conn->fd, conn->in + conn->in_len, space, 0, conn_op(conn, OP_RECV));
+    else {
+        io_ring_prep(sqe, IORING_OP_RECV, conn->fd, NULL, space < URING_RECV_BUF_SIZE ? space : URING_RECV_BUF_SIZE,
+                     0, conn_op(conn, OP_RECV));
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = (uint16_t) loop->recv_bufs.bgid;
+    }
+    conn->inflight++;
+}
+
+// the uring counterpart of read_request, once bytes (or the end) arrived
+static void uring_received(connection* conn, int bytes_read) {
+    if (bytes_read == 0)
+        conn->peer_closed = true;
+    else {
+        conn->in_len += bytes_read;
+        conn->in[conn->in_len] = '\0';
+    }
+    if (request_ready(conn)) {
+        process_requests(conn);
+        return;
+    }
+    if (conn->peer_closed) {
+        close_connection(conn);
+        return;
+    }
+    idle_touch(conn);
+    uring_recv(conn, false);
+}
+
+// send the next queued segment: the consecutive memory segments at the head with one
+// sendmsg, or a chunk of a file with a read linked to a send of the same buffer
+static void uring_send_next(connection* conn) {
+    event_loop* loop = conn->loop;
+    out_seg* seg = &conn->out[conn->out_head];
+    struct io_uring_sqe* sqe;
+    if (seg->fd < 0) {
+        int count = 0;
+        bool file_follows = false;
+        while (count < conn->out_count) {
+            out_seg* next = &conn->out[(conn->out_head + count) % CONN_MAX_SEGS];
+            if (next->fd >= 0) {
+                file_follows = true;
+                break;
+            }
+            conn->iov[count].iov_base = (void*) next->data;
+            conn->iov[count].iov_len = next->len;
+            count++;
+        }
+        memset(&conn->msg, 0, sizeof(conn->msg));
+        conn->msg.msg_iov = conn->iov;
+        conn->msg.msg_iovlen = count;
+        if ((sqe = io_ring_get_sqe(&loop->ring)) == NULL) {
+            close_connection(conn);
+            return;
+        }
+        // the kernel retries short sends until all of it went out or the socket failed
+        io_ring_prep(sqe, IORING_OP_SENDMSG, conn->fd, &conn->msg, 1, 0, conn_op(conn, OP_SENDMSG));
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (file_follows ? MSG_MORE : 0);
+        conn->inflight++;
+        return;
+    }
+
+    if (conn->chunk == NULL && (conn->chunk = (char*) malloc(URING_FILE_CHUNK)) == NULL) {
+        perror("malloc");
+        close_connection(conn);
+        return;
+    }
+    off_t left = seg->end - seg->off;
+    conn->chunk_len = left < URING_FILE_CHUNK ? (size_t) left : URING_FILE_CHUNK;
+    bool more = (off_t) conn->chunk_len < left || conn->out_count > 1;
+    // both in the same submission, or the link would end at the first
+    if (!io_ring_reserve(&loop->ring, 2)) {
+        close_connection(conn);
+        return;
+    }
+    sqe = io_ring_get_sqe(&loop->ring);
+    io_ring_prep(sqe, IORING_OP_READ, seg->fd, conn->chunk, conn->chunk_len, seg->off, conn_op(conn, OP_FILE_READ));
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = io_ring_get_sqe(&loop->ring);
+    io_ring_prep(sqe, IORING_OP_SEND, conn->fd, conn->chunk, conn->chunk_len, 0, conn_op(conn, OP_FILE_SEND));
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+    conn->chain_failed = false;
+    conn->inflight += 2;
+}
+
+// the uring counterpart of flush_connection: send the queued responses one operation at a
+// time, then wait for the next request
+static void uring_flush(connection* conn) {
+    if (conn->out_count > 0) {
+        idle_touch(conn);
+        uring_send_next(conn);
+        return;
+    }
+    if (conn->close_after) {
+        close_connection(conn);
+        return;
+    }
+    conn->state = CONN_READING;
+    idle_touch(conn);
+    if (request_ready(conn))
+        process_requests(conn);
+    else
+        uring_recv(conn, false);
+}
+
+// a sendmsg of memory segments completed
+static void uring_sent(connection* conn, int bytes_written) {
+    size_t sent = bytes_written;
+    metrics_add_bytes_sent(sent);
+    while (sent > 0) {
+        out_seg* seg = &conn->out[conn->out_head];
+        if (sent < seg->len) {
+            seg->data += sent;
+            seg->len -= sent;
+            break;
+        }
+        sent -= seg->len;
+        pop_segment(conn);
+    }
+    uring_flush(conn);
+}
+
+// the send of a file chunk completed
+static void uring_chunk_sent(connection* conn, int bytes_written) {
+    out_seg* seg = &conn->out[conn->out_head];
+    seg->off += bytes_written;
+    metrics_add_bytes_sent(bytes_written);
+    if (seg->off >= seg->end)
+        pop_segment(conn);
+    uring_flush(conn);
+}
+
+// take back the connections completed by the pool, and the new ones another loop accepted
+static void uring_drain_completions(event_loop* loop) {
+    connection* conn = take_completions(loop);
+    while (conn != NULL) {
+        connection* next = conn->next;
+        if (conn->state == CONN_PROCESSING) {
+            conn->state = CONN_WRITING;
+            uring_flush(conn);
+        }
+        else {
+            idle_touch(conn);
+            uring_recv(conn, false);
+        }
+        conn = next;
+    }
+}
+
+// a completion of the multishot accept
+static void uring_accepted(event_loop* loop, const struct io_uring_cqe* cqe) {
+    event_engine* engine = loop->engine;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        loop->accepting = false;
+    if (cqe->res >= 0) {
+        connection* conn = open_connection(loop, cqe->res);
+        if (conn != NULL && conn->loop == loop) {
+            idle_touch(conn);
+            uring_recv(conn, false);
+        }
+        else if (conn != NULL)
+            // the other loop's ring is its own thread's: it arms the receive
+            complete_connection(conn);
+    }
+    else if (cqe->res != -ECANCELED && cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+        errno = -cqe->res;
+        perror("accept");
+    }
+
+    bool enough = atomic_load(&engine->accepted) >= engine->max_connections;
+    if (enough && loop->accepting) {
+        // served enough connections, stop accepting
+        struct io_uring_sqe* sqe = io_ring_get_sqe(&loop->ring);
+        if (sqe != NULL) {
+            io_ring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, (void*) (uintptr_t) URING_ACCEPT, 0, 0, URING_CANCEL);
+            loop->accepting = false;
+        }
+    }
+    else if (!enough && !loop->accepting) {
+        switch (-cqe->res) {
+        case ECANCELED:
+        case EINVAL:
+            // cancelled, or the listener can't accept: re-arming would fail the same way
+            break;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            // re-arming now would fail at once: wait for a close or the next second
+            loop->accept_paused = true;
+            loop->accept_paused_at = loop->now;
+            break;
+        default:
+            uring_accept(loop);
+        }
+    }
+}
+
+// dispatch a completion to its connection
+static void uring_complete(event_loop* loop, const struct io_uring_cqe* cqe) {
+    if (cqe->user_data == URING_ACCEPT) {
+        uring_accepted(loop, cqe);
+        return;
+    }
+    if (cqe->user_data == URING_WAKE) {
+        uring_wait_wake(loop);
+        uring_drain_completions(loop);
+        return;
+    }
+    if (cqe->user_data == URING_CANCEL)
+        return;
+
+    connection* conn = (connection*) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    int op = (int) (cqe->user_data & OP_MASK);
+    int res = cqe->res;
+    conn->inflight--;
+    if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !conn->closing)
+            memcpy(conn->in + conn->in_len, io_buf_ring_get(&loop->recv_bufs, bid), res);
+        io_buf_ring_recycle(&loop->recv_bufs, bid);
+    }
+    if (conn->closing) {
+        if (conn->inflight == 0)
+            close_connection(conn);
+        return;
+    }
+
+    switch (op) {
+    case OP_RECV:
+        // all provided buffers are in use: receive straight into the connection
+        if (res == -ENOBUFS)
+            uring_recv(conn, true);
+        else if (res < 0) {
+            if (res != -ECONNRESET) {
+                errno = -res;
+                perror("recv");
+            }
+            close_connection(conn);
+        }
+        else
+            uring_received(conn, res);
+        break;
+    case OP_SENDMSG:
+        if (res < 0) {
+            if (res != -EPIPE && res != -ECONNRESET) {
+                errno = -res;
+                perror("sendmsg");
+            }
+            close_connection(conn);
+        }
+        else
+            uring_sent(conn, res);
+        break;
+    case OP_FILE_READ:
+        // short: the file shrank after its entry was built. the linked send is cancelled.
+        if (res != (int) conn->chunk_len) {
+            if (res < 0) {
+                errno = -res;
+                perror("read");
+            }
+            conn->chain_failed = true;
+        }
+        break;
+    case OP_FILE_SEND:
+        if (res < 0 || conn->chain_failed) {
+            if (res < 0 && res != -ECANCELED && res != -EPIPE && res != -ECONNRESET) {
+                errno = -res;
+                perror("send");
+            }
+            close_connection(conn);
+        }
+        else
+            uring_chunk_sent(conn, res);
+        break;
+    }
+}
+
+// the event-loop thread of the io_uring backend: each iteration submits what the last
+// one queued and waits for completions with a single io_uring_enter
+static void* run_uring_loop(void* arg) {
+    event_loop* loop = (event_loop*) arg;
+    event_engine* engine = loop->engine;
+    // the ring is created by the thread that submits to it
+    if (io_ring_init(&loop->ring, URING_SQ_ENTRIES, URING_CQ_ENTRIES) < 0) {
+        stop_engine(engine);
+        return NULL;
+    }
+    if (io_buf_ring_init(&loop->ring, &loop->recv_bufs, URING_RECV_BUFS, URING_RECV_BUF_SIZE, 0) < 0) {
+        io_ring_exit(&loop->ring);
+        stop_engine(engine);
+        return NULL;
+    }
+    loop->now = monotonic_seconds();
+    uring_wait_wake(loop);
+    if (loop->listen_fd >= 0 && atomic_load(&engine->accepted) < engine->max_connections)
+        uring_accept(loop);
+
+    while (!atomic_load(&engine->stopping)) {
+        // wake up every second while there are connections to time out or a paused accept
+        if (io_ring_submit_and_wait(&loop->ring, loop->idle_head != NULL || loop->accept_paused ? 1000 : -1) < 0)
+            break;
+        loop->now = monotonic_seconds();
+        struct io_uring_cqe* cqe;
+        while ((cqe = io_ring_peek_cqe(&loop->ring)) != NULL) {
+            // handlers queue new sqes, the slot is given back first
+            struct io_uring_cqe done = *cqe;
+            io_ring_cqe_seen(&loop->ring);
+            uring_complete(loop, &done);
+        }
+        expire_idle(loop);
+    }
+
+    atomic_fetch_add(&engine->ring_enters, loop->ring.enters);
+    atomic_fetch_add(&engine->ring_sqes, loop->ring.submitted);
+    atomic_fetch_add(&engine->ring_cqes, loop->ring.completed);
+    io_buf_ring_exit(&loop->ring, &loop->recv_bufs);
+    io_ring_exit(&loop->ring);
+    return NULL;
+}
+
+int run_event_engine(event_engine* engine) {
+    if (engine->max_connections <= 0)
+        return 0;
+    if (engine->backend == IO_URING && !io_ring_supported()) {
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+        engine->backend = IO_EPOLL;
+    }
+    void* (*loop_routine)(void*) = engine->backend == IO_URING ? run_uring_loop : run_loop;
+    int started;
+    for (started = 0; started < engine->num_loops; ++started) {
+        if (pthread_create(&engine->loops[started].thread, NULL, loop_routine, &engine->loops[started]) != 0) {
+            perror("create thread");
+            break;
+        }
+    }
+    if (started < engine->num_loops)
+        stop_engine(engine);
+    for (int i = 0; i < started; ++i)
+        pthread_join(engine->loops[i].thread, NULL);
+    return started == engine->num_loops ? 0 : -1;
+}
+
+void destroy_event_engine(event_engine* engine) {
+    for (int i = 0; i < engine->num_loops; ++i) {
+        event_loop* loop = &engine->loops[i];
+        if (loop->epfd >= 0)
+            close(loop->epfd);
+        if (loop->wake_fd >= 0)
+            close(loop->wake_fd);
+        pthread_mutex_destroy(&loop->done_lock);
+    }
+    destroy_slab(engine->conn_slab);
+    free(engine->loops);
+    free(engine);
+}
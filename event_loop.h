@@ -0,0 +1,246 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "http_parser.h"
+#include "io_ring.h"
+#include "slab.h"
+#include "threadpool.h"
+
+/**
+ * event_loop.h
+ *
+ * This file declares the connection engine.
+ * a few event-loop threads own all the (non-blocking) client
+ * sockets, and do their I/O either with epoll readiness and plain
+ * system calls, or with an io_uring per loop. a connection is handed to the threadpool only when a
+ * complete request was read, and the worker hands it back with
+ * complete_connection once the responses are queued.
+ * connections are persistent: after the responses were written
+ * the loop reads the next (possibly already pipelined) request.
+ */
+
+#define MAX_FIRST_LINE 4000
+#define MAX_REQUEST_SIZE 8192   //request line and headers
+#define MAX_EVENTS 256
+#define CONN_MAX_SEGS 32        //queued output segments per connection
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_RECV_BUFS 256     //provided receive buffers per loop
+#define URING_RECV_BUF_SIZE 4096
+#define URING_FILE_CHUNK (64 * 1024)    //file bytes read and sent per linked read + send
+
+/**
+ * state of a connection. a connection belongs to its loop while
+ * reading or writing, and to a pool thread while processing.
+ */
+typedef enum {
+    CONN_READING,
+    CONN_PROCESSING,
+    CONN_WRITING
+} conn_state;
+
+struct event_loop;
+
+/**
+ * how the loops do their I/O
+ */
+typedef enum {
+    IO_EPOLL,                   //readiness with epoll, then read, sendmsg and sendfile
+    IO_URING                    //accept, recv, sendmsg and file read + send submitted to an io_uring
+} io_backend;
+
+/**
+ * how a file segment is sent. a segment starts with sendfile and
+ * falls back when the filesystem does not support it.
+ */
+typedef enum {
+    SEND_SENDFILE,
+    SEND_SPLICE,                //file -> pipe -> socket
+    SEND_COPY                   //pread and send through a buffer
+} send_mode;
+
+/**
+ * called with release_arg once a segment was sent (or dropped)
+ */
+typedef void (*release_fn)(void*);
+
+/**
+ * a piece of queued output: either memory or a range of a file
+ */
+typedef struct out_seg {
+    const char* data;           //memory still to send
+    size_t len;
+    release_fn release;         //may be NULL
+    void* release_arg;
+    int fd;                     //file to send, -1 for a memory segment
+    off_t off;                  //next file offset to send
+    off_t end;
+    send_mode mode;
+    int pipe_fds[2];            //splice pipe, created on the first splice
+    size_t piped;               //bytes in the pipe not yet sent
+} out_seg;
+
+/**
+ * a client connection
+ */
+typedef struct connection {
+    int fd;                     //client socket
+    conn_state state;
+    struct event_loop* loop;    //the loop that owns the socket
+    char in[MAX_REQUEST_SIZE];  //request buffer, always NUL terminated
+    size_t in_len;
+    http_parser parser;         //state of the first request in the buffer
+    size_t body_left;           //bytes of the last request's body not received yet, skipped when they arrive
+    out_seg out[CONN_MAX_SEGS]; //ring of queued responses
+    int out_head;
+    int out_count;
+    int requests;               //requests served on this connection
+    bool http11;                //the request being answered is HTTP/1.1
+    bool peer_closed;           //the client shut down its side
+    bool close_after;           //close once the queued output was sent
+    bool corked;                //TCP_CORK is set while several file responses are queued
+    time_t last_active;         //last read or write progress, in seconds
+    uint64_t dispatched_at;     //monotonic nanoseconds when handed to the pool
+    int status;                 //of the last response queued, for the access log
+    bool peer_known;            //peer was read, on the first logged request
+    struct sockaddr_storage peer;
+    struct connection* idle_prev;   //links in the loop's timeout list
+    struct connection* idle_next;
+    struct connection* next;    //link in the loop's completion list
+    // io_uring backend only
+    int inflight;               //submitted operations not completed yet
+    bool closing;               //closed when the last operation completes
+    bool chain_failed;          //the file read of a linked read + send came up short
+    size_t chunk_len;           //bytes of the file chunk being read and sent
+    char* chunk;                //file chunk buffer, allocated on the first file segment
+    struct msghdr msg;          //the sendmsg in flight
+    struct iovec iov[CONN_MAX_SEGS];
+} connection;
+
+/**
+ * an event-loop thread
+ */
+typedef struct event_loop {
+    int epfd;
+    int wake_fd;                //eventfd, signaled on completions and shutdown
+    pthread_t thread;
+    pthread_mutex_t done_lock;  //lock on the completion list
+    connection* done_head;      //connections whose response is ready
+    connection* done_tail;
+    connection* idle_head;      //connections owned by the loop, least recently active first
+    connection* idle_tail;
+    time_t now;                 //monotonic seconds, updated every iteration
+    int listen_fd;              //listening socket this loop accepts on, -1 if none
+    threadpool* pool;           //the pool this loop's requests are dispatched to
+    struct event_engine* engine;
+    // io_uring backend only
+    io_ring ring;
+    io_buf_ring recv_bufs;
+    uint64_t wake_count;        //target of the eventfd read
+    bool accepting;             //a multishot accept is armed
+    bool accept_paused;         //the accept ran out of descriptors, re-armed after a close or a second
+    time_t accept_paused_at;
+} event_loop;
+
+/**
+ * the engine: the loops and the listening sockets they accept on.
+ */
+typedef struct event_engine {
+    event_loop* loops;
+    int num_loops;
+    int num_listeners;          //loops[0..num_listeners) accept
+    dispatch_fn handler;        //pool routine, called with the connection
+    dispatch_fn reject;         //called on the loop thread with a connection the pool had no room for, to
+                                //queue an answer; NULL waits for room instead
+    int max_connections;        //connections to accept before shutting down
+    int keepalive_timeout;      //seconds a connection may stay without progress
+    int max_keepalive_requests; //requests served on a connection before it is closed
+    io_backend backend;         //IO_URING falls back to IO_EPOLL where the kernel lacks it
+    int next_loop;              //round robin index for new connections
+    slab* conn_slab;            //the connection objects
+    atomic_int accepted;
+    atomic_int active;
+    atomic_int stopping;
+    atomic_uint_fast64_t rejected;      //connections given to reject
+    atomic_uint_fast64_t ring_enters;   //io_uring totals of the loops, added as they exit
+    atomic_uint_fast64_t ring_sqes;
+    atomic_uint_fast64_t ring_cqes;
+} event_engine;
+
+/**
+ * create_event_engine creates num_loops epoll instances.
+ * listen_fds are num_listeners bound, listening sockets; loop i
+ * accepts on listen_fds[i], so num_listeners must not exceed
+ * num_loops. a single listener spreads its connections over all the
+ * loops, several listeners (SO_REUSEPORT) keep every connection on
+ * the loop that accepted it.
+ * loop i dispatches its requests to pools[i % num_pools].
+ * keepalive_timeout, max_keepalive_requests, backend and reject are
+ * set to their defaults and may be changed before run_event_engine.
+ * returns NULL on failure.
+ */
+event_engine* create_event_engine(const int* listen_fds, int num_listeners, int num_loops,
+                                  threadpool** pools, int num_pools, dispatch_fn handler, int max_connections);
+
+/**
+ * run_event_engine starts the loop threads and blocks until
+ * max_connections connections were accepted and all of them
+ * were closed. with IO_URING each loop creates its ring first; if
+ * the kernel does not support the operations the engine uses epoll.
+ * returns 0 on success and -1 if the threads could not start.
+ */
+int run_event_engine(event_engine* engine);
+
+/**
+ * destroy_event_engine frees the engine. the listening sockets
+ * and the pools belong to the caller.
+ */
+void destroy_event_engine(event_engine* engine);
+
+/**
+ * monotonic_ns returns the monotonic clock in nanoseconds, the clock
+ * of dispatched_at.
+ */
+uint64_t monotonic_ns(void);
+
+/**
+ * complete_connection is called by a pool thread when the
+ * responses of conn are queued. the connection's loop takes it
+ * back and sends them.
+ */
+void complete_connection(connection* conn);
+
+/**
+ * queue_data appends len bytes of data to the output of conn.
+ * release (if not NULL) is called with arg after the data was sent,
+ * e.g. free for a malloced buffer.
+ * returns false if the output queue is full.
+ */
+bool queue_data(connection* conn, const char* data, size_t len, release_fn release, void* arg);
+
+/**
+ * queue_file appends the bytes [off, end) of the file fd to the
+ * output of conn. release (if not NULL) is called with arg after
+ * the bytes were sent; fd is not closed by the connection.
+ * returns false if the output queue is full.
+ */
+bool queue_file(connection* conn, int fd, off_t off, off_t end, release_fn release, void* arg);
+
+/**
+ * request_ready checks whether the input buffer of conn holds a
+ * request the handler can answer: a complete (or malformed) header
+ * block, a full buffer, or anything at all when the client shut
+ * down. the parser resumes where the last call stopped, after
+ * dropping the buffered bytes of the body of the request before.
+ */
+bool request_ready(connection* conn);
+
+#endif
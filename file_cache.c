@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "file_cache.h"
+#include "server.h"
+
+// monotonic time in seconds, from the vdso
+static time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*) path; *p != '\0'; ++p) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void free_entry(file_entry* entry) {
+    for (int i = 0; i < NUM_ENCODINGS; ++i)
+        file_cache_release(entry->variants[i]);
+    if (entry->fd >= 0)
+        close(entry->fd);
+    free(entry->path);
+    free(entry->resolved);
+    free(entry);
+}
+
+void file_cache_retain(file_entry* entry) {
+    atomic_fetch_add(&entry->refs, 1);
+}
+
+void file_cache_release(file_entry* entry) {
+    if (entry != NULL && atomic_fetch_sub(&entry->refs, 1) == 1)
+        free_entry(entry);
+}
+
+file_cache* create_file_cache(int capacity, int ttl) {
+    if (capacity <= 0 || ttl < 0)
+        return NULL;
+    file_cache* cache = (file_cache*) calloc(1, sizeof(file_cache));
+    if (cache == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    cache->ttl = ttl;
+    cache->resolver = create_path_resolver(capacity, ttl);
+    if (cache->resolver == NULL) {
+        free(cache);
+        return NULL;
+    }
+    int per_shard = (capacity + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        file_cache_shard* shard = &cache->shards[i];
+        shard->capacity = per_shard;
+        // power of two, about two buckets per entry
+        shard->num_buckets = 1;
+        while (shard->num_buckets < per_shard * 2)
+            shard->num_buckets <<= 1;
+        shard->buckets = (file_entry**) calloc(shard->num_buckets, sizeof(file_entry*));
+        if (shard->buckets == NULL) {
+            perror("malloc");
+            destroy_file_cache(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return cache;
+}
+
+static file_entry* build_entry(file_cache* cache, const char* path, uint64_t hash, bool with_variants);
+
+// media types worth compressing. images, audio and video are compressed already.
+static bool is_compressible(const char* mime) {
+    return mime == NULL || strncmp(mime, "text/", 5) == 0;
+}
+
+// look for the precompressed siblings of a regular file. a sibling older than the file is stale and ignored.
+static void find_variants(file_cache* cache, file_entry* entry) {
+    static const char* const suffixes[NUM_ENCODINGS] = { ".br", ".gz" };
+    static const char* const encodings[NUM_ENCODINGS] = { "br", "gzip" };
+    size_t len = strlen(entry->resolved);
+    if (len + 3 > MAX_FIRST_LINE)
+        return;
+    char sibling[MAX_FIRST_LINE + 1];
+    for (int i = 0; i < NUM_ENCODINGS; ++i) {
+        memcpy(sibling, entry->resolved, len);
+        strcpy(sibling + len, suffixes[i]);
+        file_entry* variant = build_entry(cache, sibling, 0, false);
+        if (variant == NULL)
+            continue;
+        if (variant->status != 200 || variant->is_dir || variant->mtime < entry->mtime) {
+            file_cache_release(variant);
+            continue;
+        }
+        variant->mime = entry->mime;
+        variant->encoding = encodings[i];
+        variant->vary = true;
+        entry->variants[i] = variant;
+        entry->vary = true;
+    }
+}
+
+// build the entry of a path: the syscalls a miss costs
+static file_entry* build_entry(file_cache* cache, const char* path, uint64_t hash, bool with_variants) {
+    file_entry* entry = (file_entry*) calloc(1, sizeof(file_entry));
+    if (entry == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    // room for the index.html that resolve_path appends to directories
+    char resolved[MAX_FIRST_LINE + sizeof("index.html")];
+    strncpy(resolved, path, MAX_FIRST_LINE);
+    resolved[MAX_FIRST_LINE] = '\0';
+
+    resolved_file file;
+    entry->status = resolve_path(cache->resolver, resolved, &file);
+    entry->path = strdup(path);
+    entry->resolved = strdup(resolved);
+    entry->fd = file.fd;
+    entry->hash = hash;
+    entry->checked_at = monotonic_seconds();
+    atomic_init(&entry->refs, 1);
+    if (entry->path == NULL || entry->resolved == NULL) {
+        perror("strdup");
+        free_entry(entry);
+        return NULL;
+    }
+
+    if (entry->status == 200) {
+        entry->is_dir = file.is_dir;
+        if (!entry->is_dir)
+            entry->mime = get_mime_type(resolved);
+        entry->size = file.st.st_size;
+        entry->mtime = file.st.st_mtime;
+        entry->mtime_nsec = file.st.st_mtim.tv_nsec;
+        entry->ino = file.st.st_ino;
+        entry->dev = file.st.st_dev;
+        struct tm tm_time;
+        gmtime_r(&entry->mtime, &tm_time);
+        strftime(entry->last_modified, sizeof(entry->last_modified), RFC1123FMT, &tm_time);
+        // a listing changes with the files in the directory, which its own mtime doesn't follow
+        if (!entry->is_dir)
+            snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx-%llx.%lx\"",
+                     (unsigned long long)entry->ino, (unsigned long long)entry->size,
+                     (unsigned long long)entry->mtime, entry->mtime_nsec);
+        if (with_variants && !entry->is_dir && is_compressible(entry->mime))
+            find_variants(cache, entry);
+    }
+    return entry;
+}
+
+// hash chain of a hash in a shard. the low bits of the hash pick the shard, so skip them.
+static file_entry** bucket_of(file_cache_shard* shard, uint64_t hash) {
+    return &shard->buckets[(hash >> 16) & (shard->num_buckets - 1)];
+}
+
+// take an entry out of the lru list. the shard lock is held.
+static void lru_remove(file_cache_shard* shard, file_entry* entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+}
+
+// unlink an entry from the shard's table and lru list. the shard lock is held.
+static void unlink_entry(file_cache_shard* shard, file_entry* entry) {
+    file_entry** link = bucket_of(shard, entry->hash);
+    while (*link != entry)
+        link = &(*link)->hnext;
+    *link = entry->hnext;
+    lru_remove(shard, entry);
+    shard->count--;
+}
+
+// put an entry at the front of the lru list. the shard lock is held.
+static void lru_push_front(file_cache_shard* shard, file_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+        shard->lru_head->lru_prev = entry;
+    else
+        shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+// find the entry of a path in the shard. the shard lock is held.
+static file_entry* find_entry(file_cache_shard* shard, const char* path, uint64_t hash) {
+    file_entry* entry = *bucket_of(shard, hash);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0))
+        entry = entry->hnext;
+    return entry;
+}
+
+file_entry* file_cache_lookup(file_cache* cache, const char* path) {
+    uint64_t hash = hash_path(path);
+    file_cache_shard* shard = &cache->shards[hash % FILE_CACHE_SHARDS];
+    time_t now = monotonic_seconds();
+
+    pthread_mutex_lock(&shard->lock);
+    file_entry* entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        if (now - entry->checked_at < cache->ttl) {
+            atomic_fetch_add(&entry->refs, 1);
+            lru_remove(shard, entry);
+            lru_push_front(shard, entry);
+            pthread_mutex_unlock(&shard->lock);
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            return entry;
+        }
+        // too old, the file may have changed: rebuild it
+        unlink_entry(shard, entry);
+        file_cache_release(entry);
+        atomic_fetch_add_explicit(&cache->expired, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    // the filesystem work is done without the lock
+    file_entry* built = build_entry(cache, path, hash, true);
+    if (built == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        // another thread built it meanwhile
+        atomic_fetch_add(&entry->refs, 1);
+        pthread_mutex_unlock(&shard->lock);
+        file_cache_release(built);
+        return entry;
+    }
+    file_entry** bucket = bucket_of(shard, hash);
+    built->hnext = *bucket;
+    *bucket = built;
+    lru_push_front(shard, built);
+    shard->count++;
+    atomic_fetch_add(&built->refs, 1);
+    while (shard->count > shard->capacity) {
+        file_entry* victim = shard->lru_tail;
+        unlink_entry(shard, victim);
+        file_cache_release(victim);
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return built;
+}
+
+void file_cache_get_stats(file_cache* cache, file_cache_stats* stats) {
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->expired = atomic_load_explicit(&cache->expired, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    stats->entries = 0;
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        stats->entries += cache->shards[i].count;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+void destroy_file_cache(file_cache* cache) {
+    for (int i = 0; i < FILE_CACHE_SHARDS; ++i) {
+        file_cache_shard* shard = &cache->shards[i];
+        if (shard->buckets == NULL)
+            continue;
+        while (shard->lru_head != NULL) {
+            file_entry* entry = shard->lru_head;
+            unlink_entry(shard, entry);
+            file_cache_release(entry);
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    destroy_path_resolver(cache->resolver);
+    free(cache);
+}
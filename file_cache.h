@@ -0,0 +1,146 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "path_resolver.h"
+
+/**
+ * file_cache.h
+ *
+ * This file declares a bounded cache of path metadata shared by
+ * all the pool threads. an entry holds the verdict of resolve_path
+ * for a request path and, for a readable file, an open descriptor
+ * with its size, mtime and mime type. a hot file is served without
+ * any metadata syscall until its entry is older than the ttl.
+ * the precompressed siblings of a text file (file.ext.br and
+ * file.ext.gz) are looked up when its entry is built, and kept with
+ * it, so choosing an encoding costs no syscall either.
+ */
+
+#define FILE_CACHE_SHARDS 16
+
+/**
+ * the content codings of precompressed siblings, in order of preference
+ */
+typedef enum {
+    ENCODING_BR,                //file.ext.br
+    ENCODING_GZIP,              //file.ext.gz
+    NUM_ENCODINGS
+} content_encoding;
+
+/**
+ * a cached path. entries are reference counted: the cache holds a
+ * reference while the entry is in the table and every lookup
+ * returns another one, released with file_cache_release.
+ * entries are read-only once published.
+ */
+typedef struct file_entry {
+    char* path;                 //request path, the key
+    char* resolved;             //path to serve, with index.html for directories that have one
+    int status;                 //verdict of resolve_path: 200, 302, 403, 404 or 500
+    bool is_dir;                //200 directory listing
+    int fd;                     //open file for a 200 regular file, O_PATH descriptor of a 200 directory, -1 otherwise
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;            //nanoseconds of mtime, a rewrite within the same second changes only these
+    ino_t ino;
+    dev_t dev;
+    const char* mime;           //NULL when unknown, a sibling has the mime type of its file
+    const char* encoding;       //Content-Encoding of a precompressed sibling, NULL otherwise
+    bool vary;                  //the file has precompressed siblings, its responses vary on Accept-Encoding
+    struct file_entry* variants[NUM_ENCODINGS]; //the siblings, NULL where there is none; owned by the entry
+    char last_modified[32];     //mtime in RFC1123 format
+    char etag[72];              //strong entity tag of a regular file, from its inode, size and mtime
+    time_t checked_at;          //monotonic seconds when the entry was built
+    uint64_t hash;
+    atomic_int refs;
+    struct file_entry* hnext;   //hash chain
+    struct file_entry* lru_prev;
+    struct file_entry* lru_next;
+} file_entry;
+
+/**
+ * a shard of the cache, with its own lock, table and lru list
+ */
+typedef struct file_cache_shard {
+    pthread_mutex_t lock;
+    file_entry** buckets;
+    int num_buckets;
+    int count;
+    int capacity;
+    file_entry* lru_head;       //most recently used
+    file_entry* lru_tail;
+} file_cache_shard;
+
+/**
+ * counters of the cache, for sizing it
+ */
+typedef struct file_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expired;           //misses because the entry outlived the ttl
+    uint64_t evictions;
+    int entries;
+} file_cache_stats;
+
+/**
+ * The cache
+ */
+typedef struct file_cache {
+    file_cache_shard shards[FILE_CACHE_SHARDS];
+    int ttl;                    //seconds an entry is trusted
+    path_resolver* resolver;    //resolves the paths of missed entries
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t expired;
+    atomic_uint_fast64_t evictions;
+} file_cache;
+
+/**
+ * create_file_cache creates a cache of at most capacity entries
+ * whose entries are rebuilt after ttl seconds.
+ * returns NULL on failure.
+ */
+file_cache* create_file_cache(int capacity, int ttl);
+
+/**
+ * file_cache_lookup returns the entry of the request path (which
+ * starts with '/'), building it on a miss. the caller must release
+ * it with file_cache_release. returns NULL if out of memory.
+ */
+file_entry* file_cache_lookup(file_cache* cache, const char* path);
+
+/**
+ * file_cache_retain takes another reference of an entry.
+ */
+void file_cache_retain(file_entry* entry);
+
+/**
+ * file_cache_release drops a reference returned by
+ * file_cache_lookup. the descriptor of an evicted entry is closed
+ * with its last reference.
+ */
+void file_cache_release(file_entry* entry);
+
+/**
+ * hash_path returns the FNV-1a hash of a path.
+ */
+uint64_t hash_path(const char* path);
+
+/**
+ * file_cache_get_stats copies the counters of the cache.
+ */
+void file_cache_get_stats(file_cache* cache, file_cache_stats* stats);
+
+/**
+ * destroy_file_cache drops the cache's references of all entries
+ * and frees the cache.
+ */
+void destroy_file_cache(file_cache* cache);
+
+#endif
@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "gzip_cache.h"
+#include "file_cache.h"
+
+#define READ_CHUNK (64 * 1024)
+
+void gzip_cache_release(gzip_blob* blob) {
+    if (blob != NULL && atomic_fetch_sub(&blob->refs, 1) == 1) {
+        free(blob->data);
+        free(blob);
+    }
+}
+
+gzip_cache* create_gzip_cache(size_t budget) {
+    if (budget == 0)
+        return NULL;
+    gzip_cache* cache = (gzip_cache*) calloc(1, sizeof(gzip_cache));
+    if (cache == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    cache->budget = budget;
+    cache->max_source = budget / 4 < GZIP_MAX_SOURCE ? budget / 4 : GZIP_MAX_SOURCE;
+    // power of two, about one bucket per 8KB of budget
+    cache->num_buckets = 64;
+    while (cache->num_buckets < (int)(budget / 8192) && cache->num_buckets < (1 << 16))
+        cache->num_buckets <<= 1;
+    cache->buckets = (gzip_blob**) calloc(cache->num_buckets, sizeof(gzip_blob*));
+    if (cache->buckets == NULL) {
+        perror("malloc");
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+// compress len bytes, from data or (data NULL) read from fd, into a new blob
+static gzip_blob* compress_source(const char* path, int fd, const char* data, size_t len) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 + window bits: a gzip header and trailer instead of zlib's
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return NULL;
+    }
+    size_t path_len = strlen(path) + 1;
+    gzip_blob* blob = (gzip_blob*) calloc(1, sizeof(gzip_blob) + path_len);
+    size_t bound = deflateBound(&stream, len);
+    char* out = (char*) malloc(bound);
+    char* in = data == NULL ? (char*) malloc(READ_CHUNK) : NULL;
+    if (blob == NULL || out == NULL || (data == NULL && in == NULL)) {
+        perror("malloc");
+        goto fail;
+    }
+
+    stream.next_out = (Bytef*) out;
+    stream.avail_out = bound;
+    size_t done = 0;
+    int result = Z_OK;
+    while (result == Z_OK) {
+        if (stream.avail_in == 0 && done < len) {
+            size_t want = len - done;
+            if (data != NULL) {
+                stream.next_in = (Bytef*) (data + done);
+            }
+            else {
+                if (want > READ_CHUNK)
+                    want = READ_CHUNK;
+                ssize_t bytes_read = pread(fd, in, want, done);
+                if (bytes_read < 0 && errno == EINTR)
+                    continue;
+                if (bytes_read < 0) {
+                    perror("pread");
+                    goto fail;
+                }
+                // the file shrank after its entry was built
+                if (bytes_read == 0)
+                    goto fail;
+                want = bytes_read;
+                stream.next_in = (Bytef*) in;
+            }
+            stream.avail_in = want;
+            done += want;
+        }
+        result = deflate(&stream, done == len ? Z_FINISH : Z_NO_FLUSH);
+        // the output buffer holds the bound, so it never runs out before the end
+        if (result == Z_BUF_ERROR && stream.avail_out == 0)
+            goto fail;
+        if (result == Z_BUF_ERROR)
+            result = Z_OK;
+    }
+    if (result != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed\n");
+        goto fail;
+    }
+    deflateEnd(&stream);
+    free(in);
+
+    blob->len = stream.total_out;
+    char* shrunk = (char*) realloc(out, blob->len);
+    blob->data = shrunk != NULL ? shrunk : out;
+    blob->path = (char*) (blob + 1);
+    memcpy(blob->path, path, path_len);
+    atomic_init(&blob->refs, 1);
+    return blob;
+
+fail:
+    deflateEnd(&stream);
+    free(in);
+    free(out);
+    free(blob);
+    return NULL;
+}
+
+// hash chain of a hash
+static gzip_blob** bucket_of(gzip_cache* cache, uint64_t hash) {
+    return &cache->buckets[hash & (cache->num_buckets - 1)];
+}
+
+// take a blob out of the lru list. the lock is held.
+static void lru_remove(gzip_cache* cache, gzip_blob* blob) {
+    if (blob->lru_prev != NULL)
+        blob->lru_prev->lru_next = blob->lru_next;
+    else
+        cache->lru_head = blob->lru_next;
+    if (blob->lru_next != NULL)
+        blob->lru_next->lru_prev = blob->lru_prev;
+    else
+        cache->lru_tail = blob->lru_prev;
+}
+
+// unlink a blob from the cache and drop the cache's reference. the lock is held.
+static void drop_blob(gzip_cache* cache, gzip_blob* blob) {
+    gzip_blob** link = bucket_of(cache, blob->hash);
+    while (*link != blob)
+        link = &(*link)->hnext;
+    *link = blob->hnext;
+    lru_remove(cache, blob);
+    cache->bytes -= blob->len;
+    gzip_cache_release(blob);
+}
+
+// put a blob at the front of the lru list. the lock is held.
+static void lru_push_front(gzip_cache* cache, gzip_blob* blob) {
+    blob->lru_prev = NULL;
+    blob->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = blob;
+    else
+        cache->lru_tail = blob;
+    cache->lru_head = blob;
+}
+
+static gzip_blob* find_blob(gzip_cache* cache, const char* path, uint64_t hash) {
+    gzip_blob* blob = *bucket_of(cache, hash);
+    while (blob != NULL && (blob->hash != hash || strcmp(blob->path, path) != 0))
+        blob = blob->hnext;
+    return blob;
+}
+
+static gzip_blob* lookup(gzip_cache* cache, const char* path, uint64_t version, int fd, const char* data, size_t len) {
+    if (len > cache->max_source)
+        return NULL;
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&cache->lock);
+    gzip_blob* blob = find_blob(cache, path, hash);
+    if (blob != NULL && blob->version == version) {
+        atomic_fetch_add(&blob->refs, 1);
+        lru_remove(cache, blob);
+        lru_push_front(cache, blob);
+        pthread_mutex_unlock(&cache->lock);
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return blob;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    // compress without the lock, two threads may race on a new version, the second one's output is dropped
+    gzip_blob* compressed = compress_source(path, fd, data, len);
+    if (compressed == NULL)
+        return NULL;
+    compressed->hash = hash;
+    compressed->version = version;
+    atomic_fetch_add_explicit(&cache->bytes_in, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->bytes_out, compressed->len, memory_order_relaxed);
+
+    pthread_mutex_lock(&cache->lock);
+    blob = find_blob(cache, path, hash);
+    if (blob != NULL && blob->version == version) {
+        atomic_fetch_add(&blob->refs, 1);
+        pthread_mutex_unlock(&cache->lock);
+        gzip_cache_release(compressed);
+        return blob;
+    }
+    if (blob != NULL)
+        drop_blob(cache, blob);
+    while (cache->bytes + compressed->len > cache->budget && cache->lru_tail != NULL) {
+        drop_blob(cache, cache->lru_tail);
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    gzip_blob** bucket = bucket_of(cache, hash);
+    compressed->hnext = *bucket;
+    *bucket = compressed;
+    lru_push_front(cache, compressed);
+    cache->bytes += compressed->len;
+    atomic_fetch_add(&compressed->refs, 1);
+    pthread_mutex_unlock(&cache->lock);
+    return compressed;
+}
+
+gzip_blob* gzip_cache_lookup_file(gzip_cache* cache, const char* path, uint64_t version, int fd, off_t size) {
+    return lookup(cache, path, version, fd, NULL, size);
+}
+
+gzip_blob* gzip_cache_lookup_data(gzip_cache* cache, const char* path, uint64_t version, const char* data, size_t len) {
+    return lookup(cache, path, version, -1, data, len);
+}
+
+gzip_blob* gzip_compress(gzip_cache* cache, const char* data, size_t len) {
+    if (len > cache->max_source)
+        return NULL;
+    gzip_blob* blob = compress_source("", -1, data, len);
+    if (blob != NULL) {
+        atomic_fetch_add_explicit(&cache->bytes_in, len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache->bytes_out, blob->len, memory_order_relaxed);
+    }
+    return blob;
+}
+
+void gzip_cache_get_stats(gzip_cache* cache, gzip_cache_stats* stats) {
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    stats->bytes_in = atomic_load_explicit(&cache->bytes_in, memory_order_relaxed);
+    stats->bytes_out = atomic_load_explicit(&cache->bytes_out, memory_order_relaxed);
+    pthread_mutex_lock(&cache->lock);
+    stats->bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void destroy_gzip_cache(gzip_cache* cache) {
+    while (cache->lru_head != NULL)
+        drop_blob(cache, cache->lru_head);
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
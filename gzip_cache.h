@@ -0,0 +1,119 @@
+#ifndef GZIP_CACHE_H
+#define GZIP_CACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * gzip_cache.h
+ *
+ * This file declares the compression of responses on the fly and a
+ * cache of the compressed output. a source (a text file or a
+ * rendered directory listing) is gzip compressed by the pool thread
+ * that first sends it to a client accepting gzip, and the output is
+ * kept under the path of the source and a version that changes with
+ * its content (the file's entity tag, the listing's serial), so each
+ * version is compressed once. the cache is bounded by a byte budget
+ * and evicts in lru order.
+ */
+
+#define GZIP_MAX_SOURCE (1024 * 1024)   //larger sources are sent uncompressed
+#define GZIP_LEVEL 6
+
+/**
+ * compressed output. reference counted like content_blob.
+ */
+typedef struct gzip_blob {
+    char* data;                 //the gzip stream
+    size_t len;
+    char* path;                 //path of the source, the key
+    uint64_t hash;
+    uint64_t version;           //of the source the output was compressed from
+    atomic_int refs;
+    struct gzip_blob* hnext;
+    struct gzip_blob* lru_prev;
+    struct gzip_blob* lru_next;
+} gzip_blob;
+
+/**
+ * counters of the cache
+ */
+typedef struct gzip_cache_stats {
+    uint64_t hits;
+    uint64_t misses;            //sources compressed
+    uint64_t evictions;
+    uint64_t bytes_in;          //of the sources compressed
+    uint64_t bytes_out;         //of their output
+    size_t bytes;
+} gzip_cache_stats;
+
+/**
+ * The cache
+ */
+typedef struct gzip_cache {
+    pthread_mutex_t lock;
+    gzip_blob** buckets;
+    int num_buckets;
+    size_t bytes;
+    size_t budget;
+    size_t max_source;          //largest source compressed
+    gzip_blob* lru_head;        //most recently used
+    gzip_blob* lru_tail;
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t evictions;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+} gzip_cache;
+
+/**
+ * create_gzip_cache creates a cache holding at most budget bytes of
+ * compressed output. sources larger than GZIP_MAX_SOURCE, or than a
+ * quarter of the budget, are not compressed.
+ * returns NULL on failure.
+ */
+gzip_cache* create_gzip_cache(size_t budget);
+
+/**
+ * gzip_cache_lookup_file returns the compressed size bytes of the
+ * file fd, at the request path, of the given version, compressing
+ * them on a miss. a blob of another version is dropped.
+ * returns NULL if the file is too large or could not be read or
+ * compressed. a returned blob must be released with
+ * gzip_cache_release.
+ */
+gzip_blob* gzip_cache_lookup_file(gzip_cache* cache, const char* path, uint64_t version, int fd, off_t size);
+
+/**
+ * gzip_cache_lookup_data is gzip_cache_lookup_file for a source in
+ * memory, len bytes at data.
+ */
+gzip_blob* gzip_cache_lookup_data(gzip_cache* cache, const char* path, uint64_t version, const char* data, size_t len);
+
+/**
+ * gzip_compress compresses len bytes at data without caching the
+ * output, for a source that has no version. returns NULL on failure,
+ * the blob is released with gzip_cache_release.
+ */
+gzip_blob* gzip_compress(gzip_cache* cache, const char* data, size_t len);
+
+/**
+ * gzip_cache_release drops a reference returned by the functions
+ * above.
+ */
+void gzip_cache_release(gzip_blob* blob);
+
+/**
+ * gzip_cache_get_stats copies the counters of the cache.
+ */
+void gzip_cache_get_stats(gzip_cache* cache, gzip_cache_stats* stats);
+
+/**
+ * destroy_gzip_cache frees the cache. blobs still referenced are
+ * freed with their last reference.
+ */
+void destroy_gzip_cache(gzip_cache* cache);
+
+#endif
@@ -0,0 +1,353 @@
+#include <string.h>
+#include <strings.h>
+#include "http_parser.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+enum {
+    S_LINE_START,               //before the request line, empty lines are skipped
+    S_SKIP_LF,                  //CR of an empty line before the request line
+    S_METHOD,
+    S_TARGET,
+    S_VERSION,
+    S_LINE_TAIL,                //spaces after the version
+    S_LINE_LF,                  //CR that ends the request line or a header
+    S_HEADER_START,
+    S_HEADER_NAME,
+    S_HEADER_VALUE,
+    S_HEAD_LF,                  //CR of the empty line that ends the head
+    S_DONE,
+    S_ERROR
+};
+
+// the delimiters a state scans for. a NUL byte is never valid in a request head.
+static const char request_line_delims[4] = { ' ', '\r', '\n', '\0' };
+static const char header_name_delims[4] = { ':', '\r', '\n', '\0' };
+static const char header_value_delims[4] = { '\r', '\n', '\0', '\0' };
+
+// the first byte of [p, end) that is one of delims, or end
+static const char* scan_scalar(const char* p, const char* end, const char* delims) {
+    for (; p < end; ++p)
+        if (*p == delims[0] || *p == delims[1] || *p == delims[2] || *p == delims[3])
+            return p;
+    return end;
+}
+
+#if defined(__SSE2__)
+static const char* scan_sse2(const char* p, const char* end, const char* delims) {
+    const __m128i d0 = _mm_set1_epi8(delims[0]);
+    const __m128i d1 = _mm_set1_epi8(delims[1]);
+    const __m128i d2 = _mm_set1_epi8(delims[2]);
+    const __m128i d3 = _mm_set1_epi8(delims[3]);
+    for (; end - p >= 16; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, d0), _mm_cmpeq_epi8(bytes, d1)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(bytes, d2), _mm_cmpeq_epi8(bytes, d3)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return scan_scalar(p, end, delims);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_avx2(const char* p, const char* end, const char* delims) {
+    const __m256i d0 = _mm256_set1_epi8(delims[0]);
+    const __m256i d1 = _mm256_set1_epi8(delims[1]);
+    const __m256i d2 = _mm256_set1_epi8(delims[2]);
+    const __m256i d3 = _mm256_set1_epi8(delims[3]);
+    for (; end - p >= 32; p += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) p);
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, d0), _mm256_cmpeq_epi8(bytes, d1)),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(bytes, d2), _mm256_cmpeq_epi8(bytes, d3)));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    // the rest with 128 bit compares, still vex encoded: calling the sse2 code from here would stall on
+    // the switch between the two encodings
+    if (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm256_castsi256_si128(d0)), _mm_cmpeq_epi8(bytes, _mm256_castsi256_si128(d1))),
+                                    _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm256_castsi256_si128(d2)), _mm_cmpeq_epi8(bytes, _mm256_castsi256_si128(d3))));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_scalar(p, end, delims);
+}
+
+static const char* (*scan)(const char*, const char*, const char*) = scan_sse2;
+
+// pick the widest scanner the cpu runs, before any thread parses
+__attribute__((constructor))
+static void pick_scanner(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan = scan_avx2;
+}
+#else
+#define scan scan_scalar
+#endif
+
+void http_parser_init(http_parser* parser) {
+    parser->state = S_LINE_START;
+    parser->pos = 0;
+    parser->mark = 0;
+    parser->colon = 0;
+    parser->method = parser->target = parser->version = (http_slice) { 0, 0 };
+    parser->num_headers = 0;
+}
+
+static http_slice make_slice(size_t start, size_t end) {
+    return (http_slice) { (uint32_t) start, (uint32_t) (end - start) };
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// record the header of the line [mark, end)
+static bool add_header(http_parser* parser, const char* request, size_t end) {
+    if (parser->num_headers == HTTP_MAX_HEADERS)
+        return false;
+    size_t colon = parser->colon;
+    size_t value = colon + 1;
+    while (value < end && is_space(request[value]))
+        value++;
+    while (end > value && is_space(request[end - 1]))
+        end--;
+    http_header* header = &parser->headers[parser->num_headers++];
+    header->name = make_slice(parser->mark, colon);
+    header->value = make_slice(value, end);
+    return true;
+}
+
+http_parse_status http_parse(http_parser* parser, const char* request, size_t len) {
+    const char* end = request + len;
+    size_t pos = parser->pos;
+
+    while (pos < len) {
+        const char* p;
+        char c = request[pos];
+        switch (parser->state) {
+        case S_LINE_START:
+            if (c == '\r')
+                parser->state = S_SKIP_LF;
+            else if (c == '\n')
+                ;
+            else if (c == ' ' || c == '\0')
+                parser->state = S_ERROR;
+            else {
+                parser->mark = pos;
+                parser->state = S_METHOD;
+                continue;
+            }
+            pos++;
+            break;
+
+        case S_SKIP_LF:
+        case S_LINE_LF:
+        case S_HEAD_LF:
+            if (c != '\n') {
+                parser->state = S_ERROR;
+                break;
+            }
+            pos++;
+            parser->state = parser->state == S_SKIP_LF ? S_LINE_START :
+                            parser->state == S_LINE_LF ? S_HEADER_START : S_DONE;
+            if (parser->state == S_DONE) {
+                parser->pos = pos;
+                return HTTP_PARSE_DONE;
+            }
+            break;
+
+        case S_METHOD:
+        case S_TARGET:
+            // runs of spaces between the tokens are one separator
+            if (c == ' ' && pos == parser->mark) {
+                parser->mark = ++pos;
+                break;
+            }
+            p = scan(request + pos, end, request_line_delims);
+            pos = p - request;
+            if (p == end)
+                break;
+            if (*p != ' ') {
+                // a line of fewer than three tokens
+                parser->state = S_ERROR;
+                break;
+            }
+            if (parser->state == S_METHOD) {
+                parser->method = make_slice(parser->mark, pos);
+                parser->state = S_TARGET;
+            }
+            else {
+                parser->target = make_slice(parser->mark, pos);
+                parser->state = S_VERSION;
+            }
+            parser->mark = ++pos;
+            break;
+
+        case S_VERSION:
+            if (c == ' ' && pos == parser->mark) {
+                parser->mark = ++pos;
+                break;
+            }
+            p = scan(request + pos, end, request_line_delims);
+            pos = p - request;
+            if (p == end)
+                break;
+            if (*p == '\0' || pos == parser->mark) {
+                parser->state = S_ERROR;
+                break;
+            }
+            parser->version = make_slice(parser->mark, pos);
+            parser->state = S_LINE_TAIL;
+            break;
+
+        case S_LINE_TAIL:
+            if (c == ' ')
+                pos++;
+            else if (c == '\r') {
+                pos++;
+                parser->state = S_LINE_LF;
+            }
+            else if (c == '\n') {
+                pos++;
+                parser->state = S_HEADER_START;
+            }
+            else
+                // a fourth token
+                parser->state = S_ERROR;
+            break;
+
+        case S_HEADER_START:
+            if (c == '\r') {
+                pos++;
+                parser->state = S_HEAD_LF;
+            }
+            else if (c == '\n') {
+                parser->pos = ++pos;
+                parser->state = S_DONE;
+                return HTTP_PARSE_DONE;
+            }
+            else if (is_space(c) || c == ':')
+                // obsolete line folding, or a header without a name
+                parser->state = S_ERROR;
+            else {
+                parser->mark = pos;
+                parser->state = S_HEADER_NAME;
+            }
+            break;
+
+        case S_HEADER_NAME:
+            p = scan(request + pos, end, header_name_delims);
+            pos = p - request;
+            if (p == end)
+                break;
+            // a line without a colon, or whitespace between the name and the colon
+            if (*p != ':' || is_space(p[-1])) {
+                parser->state = S_ERROR;
+                break;
+            }
+            parser->colon = pos;
+            parser->state = S_HEADER_VALUE;
+            pos++;
+            break;
+
+        case S_HEADER_VALUE:
+            p = scan(request + pos, end, header_value_delims);
+            pos = p - request;
+            if (p == end)
+                break;
+            if (*p == '\0' || !add_header(parser, request, pos)) {
+                parser->state = S_ERROR;
+                break;
+            }
+            pos++;
+            parser->state = *p == '\r' ? S_LINE_LF : S_HEADER_START;
+            break;
+
+        case S_DONE:
+            return HTTP_PARSE_DONE;
+
+        default:
+            parser->pos = pos;
+            return HTTP_PARSE_ERROR;
+        }
+        if (parser->state == S_ERROR) {
+            parser->pos = pos;
+            return HTTP_PARSE_ERROR;
+        }
+    }
+    parser->pos = pos;
+    return parser->state == S_DONE ? HTTP_PARSE_DONE : parser->state == S_ERROR ? HTTP_PARSE_ERROR : HTTP_PARSE_AGAIN;
+}
+
+http_parse_status http_parse_eof(http_parser* parser, size_t len) {
+    if (parser->state == S_DONE)
+        return HTTP_PARSE_DONE;
+    parser->pos = len;
+    if (parser->state <= S_LINE_TAIL || parser->state == S_ERROR) {
+        parser->state = S_ERROR;
+        return HTTP_PARSE_ERROR;
+    }
+    parser->state = S_DONE;
+    return HTTP_PARSE_DONE;
+}
+
+bool http_parse_done(const http_parser* parser) {
+    return parser->state == S_DONE;
+}
+
+bool http_slice_equals(const char* request, http_slice slice, const char* str) {
+    return strlen(str) == slice.len && memcmp(request + slice.off, str, slice.len) == 0;
+}
+
+const char* http_find_header(const http_parser* parser, const char* request, const char* name, size_t* len) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < parser->num_headers; ++i) {
+        const http_header* header = &parser->headers[i];
+        if (header->name.len == name_len && strncasecmp(request + header->name.off, name, name_len) == 0) {
+            *len = header->value.len;
+            return request + header->value.off;
+        }
+    }
+    return NULL;
+}
+
+// the value of a Content-Length, only digits, or -1
+static long long parse_content_length(const char* value, size_t len) {
+    if (len == 0 || len > 18)
+        return -1;
+    long long length = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9')
+            return -1;
+        length = length * 10 + (value[i] - '0');
+    }
+    return length;
+}
+
+long long http_body_length(const http_parser* parser, const char* request) {
+    long long length = 0;
+    bool has_length = false;
+    for (int i = 0; i < parser->num_headers; ++i) {
+        const http_header* header = &parser->headers[i];
+        const char* name = request + header->name.off;
+        if (header->name.len == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0)
+            return HTTP_BODY_UNFRAMED;
+        if (header->name.len != 14 || strncasecmp(name, "Content-Length", 14) != 0)
+            continue;
+        long long value = parse_content_length(request + header->value.off, header->value.len);
+        if (value < 0 || (has_length && value != length))
+            return HTTP_BODY_INVALID;
+        length = value;
+        has_length = true;
+    }
+    return length;
+}
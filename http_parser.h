@@ -0,0 +1,113 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * http_parser.h
+ *
+ * This file declares an incremental parser of HTTP request heads.
+ * it is fed the bytes of a request as they arrive, and resumes
+ * where it stopped, so every byte is scanned once however the
+ * request is split over reads. the request line and the headers are
+ * recorded as slices (offset and length) of the request, nothing is
+ * copied or allocated. the delimiters are found with SSE2 (or AVX2
+ * where the cpu has it) compares of 16 (or 32) bytes at a time.
+ * empty lines before the request line are skipped, and a line may
+ * end with CRLF or a bare LF.
+ */
+
+#define HTTP_MAX_HEADERS 32
+
+/**
+ * a piece of the request: offset from the start of the request and length
+ */
+typedef struct http_slice {
+    uint32_t off;
+    uint32_t len;
+} http_slice;
+
+typedef struct http_header {
+    http_slice name;
+    http_slice value;           //without the surrounding whitespace
+} http_header;
+
+typedef enum {
+    HTTP_PARSE_AGAIN,           //the request head is not complete yet
+    HTTP_PARSE_DONE,            //the head was parsed, parser->pos is its length
+    HTTP_PARSE_ERROR            //the request is malformed
+} http_parse_status;
+
+/**
+ * the state of parsing one request, and what was found so far
+ */
+typedef struct http_parser {
+    int state;
+    size_t pos;                 //bytes of the request scanned
+    size_t mark;                //start of the token being scanned
+    size_t colon;               //colon of the header being scanned
+    http_slice method;
+    http_slice target;
+    http_slice version;
+    http_header headers[HTTP_MAX_HEADERS];
+    int num_headers;
+} http_parser;
+
+/**
+ * http_parser_init prepares parser for a new request.
+ */
+void http_parser_init(http_parser* parser);
+
+/**
+ * http_parse continues parsing the request that starts at request,
+ * of which len bytes arrived so far. len must not shrink between
+ * calls, and the bytes already passed must not change (the request
+ * may move, the slices are relative to its start).
+ * returns HTTP_PARSE_DONE once the empty line that ends the head was
+ * seen, and keeps returning it until http_parser_init.
+ */
+http_parse_status http_parse(http_parser* parser, const char* request, size_t len);
+
+/**
+ * http_parse_eof ends a request whose client shut down before the
+ * empty line: it is complete (with the headers seen) if its request
+ * line ended, and malformed otherwise. parser->pos becomes len.
+ */
+http_parse_status http_parse_eof(http_parser* parser, size_t len);
+
+/**
+ * http_parse_done checks whether parser holds a complete request head,
+ * whose slices may be read.
+ */
+bool http_parse_done(const http_parser* parser);
+
+/**
+ * http_slice_equals compares a slice of request with str.
+ */
+bool http_slice_equals(const char* request, http_slice slice, const char* str);
+
+/**
+ * http_find_header returns the value of the header name (case
+ * insensitive) of a parsed request, or NULL. the length of the value
+ * is stored in len.
+ */
+const char* http_find_header(const http_parser* parser, const char* request, const char* name, size_t* len);
+
+/**
+ * the framing of a request body that is not a length, see http_body_length
+ */
+#define HTTP_BODY_UNFRAMED -1       //a Transfer-Encoding: the end of the body is not known
+#define HTTP_BODY_INVALID -2        //a malformed Content-Length, or several that differ
+
+/**
+ * http_body_length finds the length of the body that follows the head
+ * of a parsed request: its Content-Length, or 0 without one.
+ * returns HTTP_BODY_UNFRAMED or HTTP_BODY_INVALID when the body can't
+ * be delimited, and the bytes after the head can't be trusted to be
+ * the next request.
+ */
+long long http_body_length(const http_parser* parser, const char* request);
+
+#endif
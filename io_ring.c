@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "io_ring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t arg_size) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool io_ring_supported(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_io_uring_setup(4, &params);
+    if (fd < 0)
+        return false;
+    // the waits need a timeout argument, and the rest needs the operations below
+    bool supported = (params.features & IORING_FEAT_EXT_ARG) != 0;
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, probe_size);
+    if (probe == NULL || sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        supported = false;
+    else {
+        static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SEND,
+                                   IORING_OP_READ, IORING_OP_ASYNC_CANCEL };
+        for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                supported = false;
+    }
+    free(probe);
+    // provided buffer rings and multishot accept both came in 5.19, the opcodes above are older:
+    // register a small ring of buffers and unregister it
+    if (supported) {
+        size_t map_size = (size_t) sysconf(_SC_PAGESIZE);
+        void* br = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (br == MAP_FAILED)
+            supported = false;
+        else {
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = (uint64_t) (uintptr_t) br;
+            reg.ring_entries = 1;
+            if (sys_io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                supported = false;
+            else
+                sys_io_uring_register(fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            munmap(br, map_size);
+        }
+    }
+    close(fd);
+    return supported;
+}
+
+int io_ring_init(io_ring* ring, unsigned sq_entries, unsigned cq_entries) {
+    memset(ring, 0, sizeof(io_ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.cq_entries = cq_entries;
+    // only this thread submits, and completion work runs when it waits instead of interrupting it
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = sys_io_uring_setup(sq_entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // a kernel older than 6.1
+        params.flags = IORING_SETUP_CQSIZE;
+        ring->fd = sys_io_uring_setup(sq_entries, &params);
+    }
+    if (ring->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    ring->features = params.features;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        perror("mmap");
+        close(ring->fd);
+        return -1;
+    }
+    if (ring->features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_map = ring->sq_map;
+    else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            perror("mmap");
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        if (ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_map_size);
+        munmap(ring->sq_map, ring->sq_map_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = (char*) ring->sq_map;
+    char* cq = (char*) ring->cq_map;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    // slot i of the queue always holds sqe i
+    for (unsigned i = 0; i < ring->sq_entries; ++i)
+        ring->sq_array[i] = i;
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+// publish the handed out sqes to the kernel and return how many are pending
+static unsigned flush_sq(io_ring* ring) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// enter the kernel to submit the pending sqes, and wait for a completion if wait
+static int enter(io_ring* ring, bool wait, int timeout_ms) {
+    unsigned pending = flush_sq(ring);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    const void* argp = NULL;
+    size_t arg_size = 0;
+    if (wait && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        argp = &arg;
+        arg_size = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    ring->enters++;
+    int submitted = sys_io_uring_enter(ring->fd, pending, wait ? 1 : 0, flags, argp, arg_size);
+    if (submitted < 0) {
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return 0;
+        perror("io_uring_enter");
+        return -1;
+    }
+    ring->submitted += submitted;
+    return 0;
+}
+
+bool io_ring_reserve(io_ring* ring, unsigned count) {
+    while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_entries) {
+        if (enter(ring, false, 0) < 0)
+            return false;
+    }
+    return true;
+}
+
+struct io_uring_sqe* io_ring_get_sqe(io_ring* ring) {
+    if (!io_ring_reserve(ring, 1))
+        return NULL;
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void io_ring_prep(struct io_uring_sqe* sqe, int op, int fd, const void* addr, unsigned len, uint64_t off, uint64_t user_data) {
+    sqe->opcode = (uint8_t) op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+}
+
+int io_ring_submit_and_wait(io_ring* ring, int timeout_ms) {
+    // completions are waiting already: only submit
+    if (io_ring_peek_cqe(ring) != NULL)
+        return flush_sq(ring) > 0 ? enter(ring, false, 0) : 0;
+    return enter(ring, true, timeout_ms);
+}
+
+struct io_uring_cqe* io_ring_peek_cqe(io_ring* ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void io_ring_cqe_seen(io_ring* ring) {
+    ring->completed++;
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void io_ring_exit(io_ring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+int io_buf_ring_init(io_ring* ring, io_buf_ring* bufs, unsigned entries, unsigned buf_size, int bgid) {
+    memset(bufs, 0, sizeof(io_buf_ring));
+    // the ring of buffer descriptors must be page aligned
+    bufs->map_size = entries * sizeof(struct io_uring_buf);
+    bufs->br = (struct io_uring_buf_ring*) mmap(NULL, bufs->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->br == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    bufs->bufs = (char*) malloc((size_t) entries * buf_size);
+    if (bufs->bufs == NULL) {
+        perror("malloc");
+        munmap(bufs->br, bufs->map_size);
+        return -1;
+    }
+    bufs->entries = entries;
+    bufs->buf_size = buf_size;
+    bufs->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) bufs->br;
+    reg.ring_entries = entries;
+    reg.bgid = (uint16_t) bgid;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        free(bufs->bufs);
+        munmap(bufs->br, bufs->map_size);
+        return -1;
+    }
+    bufs->br->tail = 0;
+    for (unsigned bid = 0; bid < entries; ++bid)
+        io_buf_ring_recycle(bufs, bid);
+    return 0;
+}
+
+char* io_buf_ring_get(io_buf_ring* bufs, unsigned bid) {
+    return bufs->bufs + (size_t) bid * bufs->buf_size;
+}
+
+void io_buf_ring_recycle(io_buf_ring* bufs, unsigned bid) {
+    struct io_uring_buf* buf = &bufs->br->bufs[bufs->tail & (bufs->entries - 1)];
+    buf->addr = (uint64_t) (uintptr_t) io_buf_ring_get(bufs, bid);
+    buf->len = bufs->buf_size;
+    buf->bid = (uint16_t) bid;
+    bufs->tail++;
+    __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+void io_buf_ring_exit(io_ring* ring, io_buf_ring* bufs) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = (uint16_t) bufs->bgid;
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    free(bufs->bufs);
+    munmap(bufs->br, bufs->map_size);
+}
@@ -0,0 +1,142 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+ * io_ring.h
+ *
+ * This file declares a minimal io_uring interface made directly on
+ * the io_uring_setup, io_uring_enter and io_uring_register system
+ * calls, without liburing: the mapped submission and completion
+ * rings of one thread, and a ring of provided buffers that the
+ * kernel picks receive buffers from.
+ * a ring is used by the thread that created it only.
+ */
+
+/**
+ * a submission and completion queue pair
+ */
+typedef struct io_ring {
+    int fd;
+    unsigned* sq_head;          //shared with the kernel
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_tail;          //sqes handed out, published to sq_tail on submit
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;               //the same as sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned features;
+    uint64_t enters;            //io_uring_enter calls
+    uint64_t submitted;         //sqes submitted
+    uint64_t completed;         //cqes reaped
+} io_ring;
+
+/**
+ * a ring of buffers provided to the kernel for receives of the
+ * buffer group bgid. a completion names the buffer it filled, which
+ * goes back to the ring with io_buf_ring_recycle.
+ */
+typedef struct io_buf_ring {
+    struct io_uring_buf_ring* br;
+    size_t map_size;
+    char* bufs;                 //entries buffers of buf_size bytes
+    unsigned entries;
+    unsigned buf_size;
+    unsigned short tail;
+    int bgid;
+} io_buf_ring;
+
+/**
+ * io_ring_supported checks whether the kernel lets this process
+ * create rings and supports the operations the server uses,
+ * including provided buffer rings.
+ */
+bool io_ring_supported(void);
+
+/**
+ * io_ring_init creates a ring with sq_entries submission and
+ * cq_entries completion slots (powers of two).
+ * returns 0 on success and -1 on failure.
+ */
+int io_ring_init(io_ring* ring, unsigned sq_entries, unsigned cq_entries);
+
+/**
+ * io_ring_reserve makes room for count sqes, submitting the queued
+ * ones if needed, so that a linked chain is submitted together.
+ * returns false if the submission failed.
+ */
+bool io_ring_reserve(io_ring* ring, unsigned count);
+
+/**
+ * io_ring_get_sqe returns a cleared submission slot, submitting the
+ * queued ones first if the queue is full. returns NULL if the
+ * submission failed.
+ */
+struct io_uring_sqe* io_ring_get_sqe(io_ring* ring);
+
+/**
+ * io_ring_prep fills a submission slot.
+ */
+void io_ring_prep(struct io_uring_sqe* sqe, int op, int fd, const void* addr, unsigned len, uint64_t off, uint64_t user_data);
+
+/**
+ * io_ring_submit_and_wait submits the queued sqes and, with one
+ * io_uring_enter, waits until a completion is ready or timeout_ms
+ * passed (-1 waits without a timeout).
+ * returns 0 on success (also on a timeout or a signal) and -1 on
+ * failure.
+ */
+int io_ring_submit_and_wait(io_ring* ring, int timeout_ms);
+
+/**
+ * io_ring_peek_cqe returns the next completion, or NULL. it stays
+ * in the queue until io_ring_cqe_seen.
+ */
+struct io_uring_cqe* io_ring_peek_cqe(io_ring* ring);
+
+/**
+ * io_ring_cqe_seen frees the completion returned by io_ring_peek_cqe.
+ */
+void io_ring_cqe_seen(io_ring* ring);
+
+/**
+ * io_ring_exit unmaps and closes the ring. pending operations are
+ * cancelled by the kernel.
+ */
+void io_ring_exit(io_ring* ring);
+
+/**
+ * io_buf_ring_init registers entries (a power of two) buffers of
+ * buf_size bytes as the buffer group bgid of ring.
+ * returns 0 on success and -1 on failure.
+ */
+int io_buf_ring_init(io_ring* ring, io_buf_ring* bufs, unsigned entries, unsigned buf_size, int bgid);
+
+/**
+ * io_buf_ring_get returns the buffer with id bid.
+ */
+char* io_buf_ring_get(io_buf_ring* bufs, unsigned bid);
+
+/**
+ * io_buf_ring_recycle gives the buffer bid back to the kernel.
+ */
+void io_buf_ring_recycle(io_buf_ring* bufs, unsigned bid);
+
+/**
+ * io_buf_ring_exit unregisters and frees the buffers.
+ */
+void io_buf_ring_exit(io_ring* ring, io_buf_ring* bufs);
+
+#endif
@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "metrics.h"
+
+// the shards, zeroed as statics
+static metrics_shard shards[METRICS_MAX_THREADS];
+// shards [0, next_shard) were ever claimed, stored under claim_lock and read by a scrape without it
+static atomic_int next_shard;
+
+// the indices of shards whose thread exited, under claim_lock. a shard keeps its counts
+// for the totals, the next thread that claims it adds to them.
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int free_shards[METRICS_MAX_THREADS];
+static int num_free;
+static pthread_key_t shard_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+// the shard of this thread, claimed on its first record
+static __thread metrics_shard* thread_shard;
+
+static const int status_codes[NUM_METRIC_STATUSES - 1] = { 200, 206, 302, 304, 400, 403, 404, 416, 500, 501, 503 };
+
+// destructor of shard_key: an exiting thread gives its shard back
+static void release_shard(void* arg) {
+    pthread_mutex_lock(&claim_lock);
+    free_shards[num_free++] = (int) (intptr_t) arg - 1;
+    pthread_mutex_unlock(&claim_lock);
+}
+
+static void create_shard_key(void) {
+    if (pthread_key_create(&shard_key, release_shard) != 0)
+        perror("pthread_key_create");
+}
+
+// claim a shard given back by an exited thread, or a new one. while all of them are
+// claimed the thread shares the last one, without giving it back.
+static void claim_shard(void) {
+    pthread_once(&key_once, create_shard_key);
+    pthread_mutex_lock(&claim_lock);
+    int index = -1;
+    int claimed = atomic_load_explicit(&next_shard, memory_order_relaxed);
+    if (num_free > 0)
+        index = free_shards[--num_free];
+    else if (claimed < METRICS_MAX_THREADS) {
+        index = claimed;
+        atomic_store_explicit(&next_shard, claimed + 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&claim_lock);
+    // the key's value is never NULL, so the destructor runs
+    if (index >= 0 && pthread_setspecific(shard_key, (void*) (intptr_t) (index + 1)) != 0) {
+        perror("pthread_setspecific");
+        release_shard((void*) (intptr_t) (index + 1));
+        index = -1;
+    }
+    thread_shard = &shards[index >= 0 ? index : METRICS_MAX_THREADS - 1];
+}
+
+static metrics_shard* my_shard(void) {
+    if (thread_shard == NULL)
+        claim_shard();
+    return thread_shard;
+}
+
+static void add(atomic_uint_fast64_t* counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static uint64_t load(atomic_uint_fast64_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// values below HIST_SUB_BUCKETS have a bucket each, the rest HIST_SUB_BUCKETS per power of two
+static int bucket_of(uint64_t ns) {
+    if (ns < HIST_SUB_BUCKETS)
+        return (int) ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int index = (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + (int) ((ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+static void record(latency_histogram* hist, uint64_t ns) {
+    add(&hist->buckets[bucket_of(ns)], 1);
+    add(&hist->sum, ns);
+    add(&hist->count, 1);
+}
+
+void metrics_count_response(int status_code) {
+    int index = METRIC_STATUS_OTHER;
+    for (int i = 0; i < METRIC_STATUS_OTHER; ++i) {
+        if (status_codes[i] == status_code) {
+            index = i;
+            break;
+        }
+    }
+    add(&my_shard()->responses[index], 1);
+}
+
+void metrics_add_bytes_sent(size_t bytes) {
+    add(&my_shard()->bytes_sent, bytes);
+}
+
+void metrics_record_queue_wait(uint64_t ns) {
+    record(&my_shard()->queue_wait, ns);
+}
+
+void metrics_record_service(uint64_t ns) {
+    record(&my_shard()->service, ns);
+}
+
+// the shards in use: a scrape doesn't read the ones no thread claimed
+static int shards_used(void) {
+    return atomic_load_explicit(&next_shard, memory_order_relaxed);
+}
+
+// a histogram summed over the shards, with cumulative buckets at the powers of two from 1us
+static void write_histogram(FILE* out, const char* name, const char* help, size_t offset) {
+    uint64_t buckets[HIST_BUCKETS] = { 0 };
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    int used = shards_used();
+    for (int i = 0; i < used; ++i) {
+        latency_histogram* hist = (latency_histogram*) ((char*) &shards[i] + offset);
+        for (int b = 0; b < HIST_BUCKETS; ++b)
+            buckets[b] += load(&hist->buckets[b]);
+        sum += load(&hist->sum);
+        count += load(&hist->count);
+    }
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    // group g holds the values below 2^(g + HIST_SUB_BITS); the last one also holds everything above
+    int groups = HIST_BUCKETS / HIST_SUB_BUCKETS;
+    for (int g = 0; g < groups - 1; ++g) {
+        for (int b = 0; b < HIST_SUB_BUCKETS; ++b)
+            cumulative += buckets[g * HIST_SUB_BUCKETS + b];
+        uint64_t bound = 1ULL << (g + HIST_SUB_BITS);
+        if (bound >= 1024)
+            fprintf(out, "%s_bucket{le=\"%.12g\"} %llu\n", name, bound / 1e9, (unsigned long long) cumulative);
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, sum / 1e9, name, (unsigned long long) count);
+}
+
+void metrics_write(FILE* out) {
+    uint64_t responses[NUM_METRIC_STATUSES] = { 0 };
+    uint64_t bytes_sent = 0;
+    int used = shards_used();
+    for (int i = 0; i < used; ++i) {
+        for (int s = 0; s < NUM_METRIC_STATUSES; ++s)
+            responses[s] += load(&shards[i].responses[s]);
+        bytes_sent += load(&shards[i].bytes_sent);
+    }
+
+    fprintf(out, "# HELP http_responses_total Responses queued, by status code.\n"
+                 "# TYPE http_responses_total counter\n");
+    for (int s = 0; s < METRIC_STATUS_OTHER; ++s)
+        fprintf(out, "http_responses_total{code=\"%d\"} %llu\n", status_codes[s], (unsigned long long) responses[s]);
+    fprintf(out, "http_responses_total{code=\"other\"} %llu\n", (unsigned long long) responses[METRIC_STATUS_OTHER]);
+    fprintf(out, "# HELP http_sent_bytes_total Bytes written to clients, headers and bodies.\n"
+                 "# TYPE http_sent_bytes_total counter\n"
+                 "http_sent_bytes_total %llu\n", (unsigned long long) bytes_sent);
+    write_histogram(out, "http_queue_wait_seconds", "Time from dispatch until a pool thread took the connection.",
+                    offsetof(metrics_shard, queue_wait));
+    write_histogram(out, "http_service_seconds", "Time a pool thread spent on the requests of a connection.",
+                    offsetof(metrics_shard, service));
+}
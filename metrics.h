@@ -0,0 +1,94 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * metrics.h
+ *
+ * This file declares the counters and latency histograms of the
+ * server. every thread that records adds to a shard of its own, a
+ * cache line aligned block that no other thread writes, with
+ * relaxed atomic adds and no lock. an exiting thread gives its shard,
+ * with its counts, to the next thread that starts. a scrape sums the
+ * shards when it is rendered, in the Prometheus text format.
+ * a histogram has HIST_SUB_BUCKETS buckets in every power of two of
+ * nanoseconds, so a value is counted within 1/HIST_SUB_BUCKETS of it.
+ */
+
+#define METRICS_MAX_THREADS 256     //threads alive at once with a shard of their own, more share the last
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40             //values of 2^40 ns (18 minutes) and above share the last bucket
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/**
+ * the response statuses counted, anything else is METRIC_STATUS_OTHER
+ */
+typedef enum {
+    METRIC_STATUS_200,
+    METRIC_STATUS_206,
+    METRIC_STATUS_302,
+    METRIC_STATUS_304,
+    METRIC_STATUS_400,
+    METRIC_STATUS_403,
+    METRIC_STATUS_404,
+    METRIC_STATUS_416,
+    METRIC_STATUS_500,
+    METRIC_STATUS_501,
+    METRIC_STATUS_503,
+    METRIC_STATUS_OTHER,
+    NUM_METRIC_STATUSES
+} metric_status;
+
+/**
+ * a log bucketed histogram of nanoseconds
+ */
+typedef struct latency_histogram {
+    atomic_uint_fast64_t buckets[HIST_BUCKETS];
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t count;
+} latency_histogram;
+
+/**
+ * the counters of one thread
+ */
+typedef struct metrics_shard {
+    _Alignas(64) atomic_uint_fast64_t responses[NUM_METRIC_STATUSES];
+    atomic_uint_fast64_t bytes_sent;
+    latency_histogram queue_wait;   //from dispatch until a pool thread takes the connection
+    latency_histogram service;      //the pool thread's handling of the requests
+} metrics_shard;
+
+/**
+ * metrics_count_response counts a response of status_code.
+ */
+void metrics_count_response(int status_code);
+
+/**
+ * metrics_add_bytes_sent counts bytes written to clients.
+ */
+void metrics_add_bytes_sent(size_t bytes);
+
+/**
+ * metrics_record_queue_wait records the nanoseconds a connection
+ * waited in the pool's queue.
+ */
+void metrics_record_queue_wait(uint64_t ns);
+
+/**
+ * metrics_record_service records the nanoseconds a pool thread spent
+ * on a connection's requests.
+ */
+void metrics_record_service(uint64_t ns);
+
+/**
+ * metrics_write writes the counters and histograms, summed over the
+ * shards, to out in the Prometheus text format.
+ */
+void metrics_write(FILE* out);
+
+#endif
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "path_resolver.h"
+#include "event_loop.h"
+#include "file_cache.h"
+
+// a file is served only when everyone may read it
+#define READABLE(mode) (((mode) & S_IROTH) && ((mode) & S_IRUSR) && ((mode) & S_IRGRP))
+
+// monotonic time in seconds, from the vdso
+static time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void release_node(dir_node* node) {
+    if (node != NULL && atomic_fetch_sub(&node->refs, 1) == 1) {
+        close(node->fd);
+        free(node);
+    }
+}
+
+path_resolver* create_path_resolver(int capacity, int ttl) {
+    if (capacity <= 0 || ttl < 0)
+        return NULL;
+    path_resolver* resolver = (path_resolver*) calloc(1, sizeof(path_resolver));
+    if (resolver == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    resolver->capacity = capacity;
+    resolver->ttl = ttl;
+    resolver->num_buckets = 1;
+    while (resolver->num_buckets < capacity * 2)
+        resolver->num_buckets <<= 1;
+    resolver->buckets = (dir_node**) calloc(resolver->num_buckets, sizeof(dir_node*));
+    if (resolver->buckets == NULL) {
+        perror("malloc");
+        free(resolver);
+        return NULL;
+    }
+    resolver->root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (resolver->root_fd < 0) {
+        perror("open root");
+        free(resolver->buckets);
+        free(resolver);
+        return NULL;
+    }
+    pthread_mutex_init(&resolver->lock, NULL);
+    return resolver;
+}
+
+// take a node out of the lru list. the lock is held.
+static void lru_remove(path_resolver* resolver, dir_node* node) {
+    if (node->lru_prev != NULL)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        resolver->lru_head = node->lru_next;
+    if (node->lru_next != NULL)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        resolver->lru_tail = node->lru_prev;
+}
+
+// put a node at the front of the lru list. the lock is held.
+static void lru_push_front(path_resolver* resolver, dir_node* node) {
+    node->lru_prev = NULL;
+    node->lru_next = resolver->lru_head;
+    if (resolver->lru_head != NULL)
+        resolver->lru_head->lru_prev = node;
+    else
+        resolver->lru_tail = node;
+    resolver->lru_head = node;
+}
+
+// unlink a node and drop the resolver's reference. the lock is held.
+static void drop_node(path_resolver* resolver, dir_node* node) {
+    dir_node** link = &resolver->buckets[node->hash & (resolver->num_buckets - 1)];
+    while (*link != node)
+        link = &(*link)->hnext;
+    *link = node->hnext;
+    lru_remove(resolver, node);
+    resolver->count--;
+    release_node(node);
+}
+
+static dir_node* find_node(path_resolver* resolver, const char* rel, uint64_t hash) {
+    dir_node* node = resolver->buckets[hash & (resolver->num_buckets - 1)];
+    while (node != NULL && (node->hash != hash || strcmp(node->rel, rel) != 0))
+        node = node->hnext;
+    return node;
+}
+
+// the status of a failed lookup: a missing path is 404, running out of descriptors is ours
+static int lookup_status(int error) {
+    return error == EMFILE || error == ENFILE || error == ENOMEM ? 500 : 404;
+}
+
+// return a reference to the cached directory rel if it hasn't expired, dropping it if it has
+static dir_node* cached_dir(path_resolver* resolver, const char* rel, time_t now) {
+    uint64_t hash = hash_path(rel);
+    pthread_mutex_lock(&resolver->lock);
+    dir_node* node = find_node(resolver, rel, hash);
+    if (node != NULL) {
+        if (now < node->expires_at) {
+            atomic_fetch_add(&node->refs, 1);
+            lru_remove(resolver, node);
+            lru_push_front(resolver, node);
+            pthread_mutex_unlock(&resolver->lock);
+            return node;
+        }
+        // the directory may have been replaced or its mode changed
+        drop_node(resolver, node);
+    }
+    pthread_mutex_unlock(&resolver->lock);
+    return NULL;
+}
+
+// cache the directory rel open at fd, replacing a node built meanwhile by another thread.
+// returns a reference to it, or NULL (closing fd) and sets status on failure.
+static dir_node* add_dir(path_resolver* resolver, const char* rel, int fd, bool searchable,
+                         bool parent_searchable, time_t expires_at, int* status) {
+    size_t rel_len = strlen(rel) + 1;
+    dir_node* built = (dir_node*) malloc(sizeof(dir_node) + rel_len);
+    if (built == NULL) {
+        perror("malloc");
+        close(fd);
+        *status = 500;
+        return NULL;
+    }
+    built->rel = (char*) (built + 1);
+    memcpy(built->rel, rel, rel_len);
+    built->hash = hash_path(rel);
+    built->fd = fd;
+    built->searchable = searchable;
+    built->parent_searchable = parent_searchable;
+    built->expires_at = expires_at;
+    atomic_init(&built->refs, 2);
+
+    pthread_mutex_lock(&resolver->lock);
+    dir_node* node = find_node(resolver, rel, built->hash);
+    if (node != NULL)
+        drop_node(resolver, node);
+    dir_node** bucket = &resolver->buckets[built->hash & (resolver->num_buckets - 1)];
+    built->hnext = *bucket;
+    *bucket = built;
+    lru_push_front(resolver, built);
+    resolver->count++;
+    while (resolver->count > resolver->capacity)
+        drop_node(resolver, resolver->lru_tail);
+    pthread_mutex_unlock(&resolver->lock);
+    return built;
+}
+
+// return a reference to the directory rel (normalized, relative to the root). on a miss it finds
+// the deepest cached ancestor and opens the components after it one at a time, so the depth of
+// the path costs no stack. rel is restored before returning.
+// returns NULL and sets status on failure.
+static dir_node* get_dir(path_resolver* resolver, char* rel, time_t now, int* status) {
+    size_t len = strlen(rel);
+    size_t end = len;
+    dir_node* dir;
+    for (;;) {
+        char cut = rel[end];
+        rel[end] = '\0';
+        dir = cached_dir(resolver, rel, now);
+        rel[end] = cut;
+        if (dir != NULL || end == 0)
+            break;
+        do
+            end--;
+        while (end > 0 && rel[end] != '/');
+    }
+
+    if (dir == NULL) {
+        struct stat stat_buf;
+        int fd = openat(resolver->root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &stat_buf) < 0) {
+            perror("open root");
+            if (fd >= 0)
+                close(fd);
+            *status = 500;
+            return NULL;
+        }
+        bool searchable = stat_buf.st_mode & S_IXOTH;
+        dir = add_dir(resolver, "", fd, searchable, searchable, now + resolver->ttl, status);
+        if (dir == NULL)
+            return NULL;
+    }
+
+    while (end < len) {
+        // end is 0 at the root, else it is at the slash before the next component
+        char* name = end == 0 ? rel : rel + end + 1;
+        char* slash = strchr(name, '/');
+        end = slash != NULL ? (size_t) (slash - rel) : len;
+        rel[end] = '\0';
+
+        struct stat stat_buf;
+        int fd = openat(dir->fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &stat_buf) < 0) {
+            *status = lookup_status(errno);
+            if (fd >= 0)
+                close(fd);
+            if (slash != NULL)
+                *slash = '/';
+            release_node(dir);
+            return NULL;
+        }
+        bool searchable = dir->searchable && (stat_buf.st_mode & S_IXOTH);
+        time_t expires_at = now + resolver->ttl;
+        // a verdict can't outlive the one it was derived from
+        if (dir->expires_at < expires_at)
+            expires_at = dir->expires_at;
+        dir_node* child = add_dir(resolver, rel, fd, searchable, dir->searchable, expires_at, status);
+        if (slash != NULL)
+            *slash = '/';
+        release_node(dir);
+        if (child == NULL)
+            return NULL;
+        dir = child;
+    }
+    return dir;
+}
+
+// open a readable regular file in dir. returns 200, or 500 if it can't be opened.
+static int open_file(int dir_fd, const char* name, resolved_file* file) {
+    // O_NONBLOCK so a fifo swapped in since the check can't block the thread. it is ignored for regular files.
+    file->fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (file->fd < 0 || fstat(file->fd, &file->st) < 0 || !S_ISREG(file->st.st_mode)) {
+        perror("Failed to open file");
+        if (file->fd >= 0)
+            close(file->fd);
+        file->fd = -1;
+        return 500;
+    }
+    return 200;
+}
+
+// check the structure of the path and normalize its directory part into rel:
+// empty and "." components are skipped, ".." is refused.
+// leaf is set to the last component of a path that doesn't end with '/', NULL otherwise.
+static bool split_path(const char* path, char* rel, size_t rel_size, const char** leaf) {
+    size_t rel_len = 0;
+    *leaf = NULL;
+    rel[0] = '\0';
+    const char* component = path;
+    while (*component != '\0') {
+        while (*component == '/')
+            component++;
+        if (*component == '\0')
+            break;
+        size_t len = strcspn(component, "/");
+        if (len == 2 && component[0] == '.' && component[1] == '.')
+            return false;
+        if (component[len] == '\0') {
+            *leaf = component;
+            break;
+        }
+        if (!(len == 1 && component[0] == '.')) {
+            if (rel_len + len + 2 > rel_size)
+                return false;
+            if (rel_len > 0)
+                rel[rel_len++] = '/';
+            memcpy(rel + rel_len, component, len);
+            rel_len += len;
+            rel[rel_len] = '\0';
+        }
+        component += len;
+    }
+    return true;
+}
+
+int resolve_path(path_resolver* resolver, char* path, resolved_file* file) {
+    char rel[MAX_FIRST_LINE];
+    const char* leaf;
+    file->fd = -1;
+    file->is_dir = false;
+
+    // ".." never resolves, wherever it appears, so nothing above the root can be named
+    if (!split_path(path, rel, sizeof(rel), &leaf))
+        return file->status = 403;
+
+    dir_node* dir = get_dir(resolver, rel, monotonic_seconds(), &file->status);
+    if (dir == NULL)
+        return file->status;
+
+    if (leaf != NULL) {
+        if (fstatat(dir->fd, leaf, &file->st, 0) < 0)
+            file->status = lookup_status(errno);
+        else if (S_ISDIR(file->st.st_mode))
+            file->status = 302;
+        else if (!S_ISREG(file->st.st_mode) || !READABLE(file->st.st_mode) || !dir->searchable)
+            file->status = 403;
+        else
+            file->status = open_file(dir->fd, leaf, file);
+        release_node(dir);
+        return file->status;
+    }
+
+    // a directory: its index.html, or a listing
+    if (fstatat(dir->fd, "index.html", &file->st, 0) == 0) {
+        strcat(path, "index.html");
+        if (!READABLE(file->st.st_mode) || !dir->searchable)
+            file->status = 403;
+        else
+            file->status = open_file(dir->fd, "index.html", file);
+    }
+    else if (!dir->parent_searchable)
+        file->status = 403;
+    else if (fstat(dir->fd, &file->st) < 0) {
+        perror("fstat");
+        file->status = 500;
+    }
+    // the listing reads the directory through its own descriptor, not by its path
+    else if ((file->fd = openat(dir->fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror("openat");
+        file->status = 500;
+    }
+    else {
+        file->is_dir = true;
+        file->status = 200;
+    }
+    release_node(dir);
+    return file->status;
+}
+
+void destroy_path_resolver(path_resolver* resolver) {
+    while (resolver->lru_head != NULL)
+        drop_node(resolver, resolver->lru_head);
+    close(resolver->root_fd);
+    free(resolver->buckets);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver);
+}
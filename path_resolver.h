@@ -0,0 +1,87 @@
+#ifndef PATH_RESOLVER_H
+#define PATH_RESOLVER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/**
+ * path_resolver.h
+ *
+ * This file declares the resolution of request paths against the
+ * server root. the resolver holds an O_PATH descriptor of the root
+ * and of recently used directories below it, each with the memoized
+ * verdict "this directory and all its ancestors are searchable by
+ * others (S_IXOTH)". a request is resolved with one openat/fstatat
+ * relative to its cached parent directory instead of a walk of the
+ * whole path per check. a path with a ".." component is rejected
+ * before anything is looked up, so nothing above the root can be
+ * named. symbolic links are followed.
+ */
+
+/**
+ * a directory below the root. reference counted; the descriptor is
+ * closed with the last reference.
+ */
+typedef struct dir_node {
+    char* rel;                  //path relative to the root, "" for the root itself
+    uint64_t hash;
+    int fd;                     //O_PATH descriptor of the directory
+    bool searchable;            //this directory and all its ancestors have S_IXOTH
+    bool parent_searchable;     //the same verdict for the parent, the root's own for the root
+    time_t expires_at;          //monotonic seconds, never later than the parent's
+    atomic_int refs;
+    struct dir_node* hnext;
+    struct dir_node* lru_prev;
+    struct dir_node* lru_next;
+} dir_node;
+
+/**
+ * The resolver
+ */
+typedef struct path_resolver {
+    pthread_mutex_t lock;
+    dir_node** buckets;
+    int num_buckets;
+    int count;
+    int capacity;
+    dir_node* lru_head;         //most recently used
+    dir_node* lru_tail;
+    int root_fd;                //O_PATH descriptor of the server root
+    int ttl;                    //seconds a directory verdict is trusted
+} path_resolver;
+
+/**
+ * the result of resolving a request path
+ */
+typedef struct resolved_file {
+    int status;                 //200, 302, 403, 404 or 500, as check_path used to answer
+    bool is_dir;                //200 directory listing
+    int fd;                     //open file for a 200 regular file, O_PATH descriptor of a 200 directory, -1 otherwise
+    struct stat st;             //of the file or directory served
+} resolved_file;
+
+/**
+ * create_path_resolver opens the current directory as the root and
+ * caches at most capacity directories for ttl seconds.
+ * returns NULL on failure.
+ */
+path_resolver* create_path_resolver(int capacity, int ttl);
+
+/**
+ * resolve_path resolves the request path (which starts with '/').
+ * like check_path it appends "index.html" to a directory path that
+ * has one, so path needs room for it. the caller owns file->fd.
+ * returns file->status.
+ */
+int resolve_path(path_resolver* resolver, char* path, resolved_file* file);
+
+/**
+ * destroy_path_resolver closes the cached directories and the root.
+ */
+void destroy_path_resolver(path_resolver* resolver);
+
+#endif
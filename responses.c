@@ -0,0 +1,239 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "responses.h"
+#include "server.h"
+
+/**
+ * a response rendered ahead of time. the date is a placeholder at
+ * date_offset, and a 302's location, a 416's file size or a 503's
+ * retry delay is inserted at split.
+ */
+typedef struct response_template {
+    char* data;
+    size_t len;
+    size_t date_offset;
+    size_t split;               //len when nothing is inserted
+} response_template;
+
+typedef enum {
+    STATUS_200,
+    STATUS_206,
+    STATUS_302,
+    STATUS_304,
+    STATUS_400,
+    STATUS_403,
+    STATUS_404,
+    STATUS_416,
+    STATUS_500,
+    STATUS_501,
+    STATUS_503,
+    NUM_STATUSES
+} status_index;
+
+static const struct {
+    int code;
+    const char* status;
+    const char* body;           //NULL for 200, 206 and 304, whose headers vary
+    const char* insert_header;  //the header whose value the caller inserts, or NULL
+    const char* insert_end;     //what follows the inserted value
+} statuses[NUM_STATUSES] = {
+    { 200, "200 OK", NULL, NULL, NULL },
+    { 206, "206 Partial Content", NULL, NULL, NULL },
+    { 302, "302 Found",
+      "<HTML><HEAD><TITLE>302 Found</TITLE></HEAD>\r\n"
+      "<BODY><H4>302 Found</H4>\r\n"
+      "Directories must end with a slash.\r\n"
+      "</BODY></HTML>\r\n",
+      "Location: ", "/\r\n" },
+    { 304, "304 Not Modified", NULL, NULL, NULL },
+    { 400, "400 Bad Request",
+      "<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\r\n"
+      "<BODY><H4>400 Bad request</H4>\r\n"
+      "Bad Request.\r\n"
+      "</BODY></HTML>\r\n",
+      NULL, NULL },
+    { 403, "403 Forbidden",
+      "<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\r\n"
+      "<BODY><H4>403 Forbidden</H4>\r\n"
+      "Access denied.\r\n"
+      "</BODY></HTML>\r\n",
+      NULL, NULL },
+    { 404, "404 Not Found",
+      "<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\r\n"
+      "<BODY><H4>404 Not Found</H4>\r\n"
+      "File not found.\r\n"
+      "</BODY></HTML>\r\n",
+      NULL, NULL },
+    { 416, "416 Range Not Satisfiable",
+      "<HTML><HEAD><TITLE>416 Range Not Satisfiable</TITLE></HEAD>\r\n"
+      "<BODY><H4>416 Range Not Satisfiable</H4>\r\n"
+      "None of the requested ranges is in the file.\r\n"
+      "</BODY></HTML>\r\n",
+      "Content-Range: bytes */", "\r\n" },
+    { 500, "500 Internal Server Error",
+      "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\r\n"
+      "<BODY><H4>500 Internal Server Error</H4>\r\n"
+      "Some server side error.\r\n"
+      "</BODY></HTML>\r\n",
+      NULL, NULL },
+    { 501, "501 Not supported",
+      "<HTML><HEAD><TITLE>501 Not supported</TITLE></HEAD>\r\n"
+      "<BODY><H4>501 Not supported</H4>\r\n"
+      "Method is not supported.\r\n"
+      "</BODY></HTML>\r\n",
+      NULL, NULL },
+    { 503, "503 Service Unavailable",
+      "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\r\n"
+      "<BODY><H4>503 Service Unavailable</H4>\r\n"
+      "The server is overloaded, try again later.\r\n"
+      "</BODY></HTML>\r\n",
+      "Retry-After: ", "\r\n" }
+};
+
+// [status][http11][keep_alive]
+static response_template templates[NUM_STATUSES][2][2];
+
+/**
+ * the shared clock. the date is formatted into the slot that is not
+ * current and then published, so readers never see a half written
+ * date unless a copy of 29 bytes takes longer than a second.
+ */
+static struct {
+    pthread_mutex_t lock;
+    atomic_llong second;
+    atomic_int current;
+    char text[2][HTTP_DATE_LEN + 1];
+} date_clock = { .lock = PTHREAD_MUTEX_INITIALIZER, .second = -1 };
+
+void http_date(char* buf) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != atomic_load_explicit(&date_clock.second, memory_order_acquire)) {
+        pthread_mutex_lock(&date_clock.lock);
+        if (ts.tv_sec != atomic_load_explicit(&date_clock.second, memory_order_relaxed)) {
+            int next = 1 - atomic_load_explicit(&date_clock.current, memory_order_relaxed);
+            struct tm tm_now;
+            time_t now = ts.tv_sec;
+            strftime(date_clock.text[next], sizeof(date_clock.text[next]), RFC1123FMT, gmtime_r(&now, &tm_now));
+            atomic_store_explicit(&date_clock.current, next, memory_order_release);
+            atomic_store_explicit(&date_clock.second, ts.tv_sec, memory_order_release);
+        }
+        pthread_mutex_unlock(&date_clock.lock);
+    }
+    memcpy(buf, date_clock.text[atomic_load_explicit(&date_clock.current, memory_order_acquire)], HTTP_DATE_LEN);
+}
+
+// render the template of a status. the date is left blank.
+static int build_template(response_template* template, int status, bool http11, bool keep_alive) {
+    char head[256];
+    int head_len = snprintf(
+        head, sizeof(head),
+        "%s %s\r\n"
+        "Server: webserver/1.0\r\n"
+        "Date: %*s\r\n"
+        "Connection: %s\r\n",
+        http11 ? "HTTP/1.1" : "HTTP/1.0", statuses[status].status, HTTP_DATE_LEN, "",
+        keep_alive ? "keep-alive" : "close");
+
+    const char* body = statuses[status].body;
+    const char* location = statuses[status].insert_header != NULL ? statuses[status].insert_header : "";
+    size_t body_len = body != NULL ? strlen(body) : 0;
+    char entity[128] = "";
+    if (body != NULL)
+        snprintf(entity, sizeof(entity),
+                 "%sContent-Type: text/html\r\n"
+                 "Content-Length: %zu\r\n"
+                 "\r\n",
+                 statuses[status].insert_end != NULL ? statuses[status].insert_end : "", body_len);
+
+    size_t location_len = strlen(location);
+    size_t entity_len = strlen(entity);
+    template->len = head_len + location_len + entity_len + body_len;
+    template->data = (char*) malloc(template->len + 1);
+    if (template->data == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(template->data, head, head_len);
+    memcpy(template->data + head_len, location, location_len);
+    memcpy(template->data + head_len + location_len, entity, entity_len);
+    memcpy(template->data + head_len + location_len + entity_len, body != NULL ? body : "", body_len);
+    template->data[template->len] = '\0';
+    template->date_offset = strstr(template->data, "Date: ") + 6 - template->data;
+    template->split = statuses[status].insert_header != NULL ? head_len + location_len : template->len;
+    return 0;
+}
+
+int init_responses(void) {
+    for (int status = 0; status < NUM_STATUSES; ++status)
+        for (int http11 = 0; http11 < 2; ++http11)
+            for (int keep_alive = 0; keep_alive < 2; ++keep_alive)
+                if (build_template(&templates[status][http11][keep_alive], status, http11, keep_alive) < 0) {
+                    free_responses();
+                    return -1;
+                }
+    return 0;
+}
+
+// copy a template with insert_len bytes of insert at its split, extra spare bytes and the current date
+static char* instantiate(const response_template* template, const char* insert, size_t insert_len, size_t extra, size_t* len) {
+    char* response = (char*) malloc(template->len + insert_len + extra + 1);
+    if (response == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(response, template->data, template->split);
+    memcpy(response + template->split, insert, insert_len);
+    memcpy(response + template->split + insert_len, template->data + template->split, template->len - template->split + 1);
+    http_date(response + template->date_offset);
+    *len = template->len + insert_len;
+    return response;
+}
+
+char* fixed_response(int status_code, bool http11, bool keep_alive, size_t* len) {
+    for (int status = STATUS_400; status < NUM_STATUSES; ++status)
+        if (statuses[status].code == status_code && statuses[status].insert_header == NULL)
+            return instantiate(&templates[status][http11][keep_alive], "", 0, 0, len);
+    return NULL;
+}
+
+char* redirect_response(const char* path, bool http11, bool keep_alive, size_t* len) {
+    return instantiate(&templates[STATUS_302][http11][keep_alive], path, strlen(path), 0, len);
+}
+
+char* response_head(bool http11, bool keep_alive, size_t extra, size_t* len) {
+    return instantiate(&templates[STATUS_200][http11][keep_alive], "", 0, extra, len);
+}
+
+char* partial_content_head(bool http11, bool keep_alive, size_t extra, size_t* len) {
+    return instantiate(&templates[STATUS_206][http11][keep_alive], "", 0, extra, len);
+}
+
+char* range_not_satisfiable_response(long long size, bool http11, bool keep_alive, size_t* len) {
+    char complete_length[24];
+    int length_len = snprintf(complete_length, sizeof(complete_length), "%lld", size);
+    return instantiate(&templates[STATUS_416][http11][keep_alive], complete_length, length_len, 0, len);
+}
+
+char* not_modified_head(bool http11, bool keep_alive, size_t extra, size_t* len) {
+    return instantiate(&templates[STATUS_304][http11][keep_alive], "", 0, extra, len);
+}
+
+char* service_unavailable_response(int retry_after, bool http11, bool keep_alive, size_t* len) {
+    char seconds[12];
+    int seconds_len = snprintf(seconds, sizeof(seconds), "%d", retry_after);
+    return instantiate(&templates[STATUS_503][http11][keep_alive], seconds, seconds_len, 0, len);
+}
+
+void free_responses(void) {
+    for (int status = 0; status < NUM_STATUSES; ++status)
+        for (int http11 = 0; http11 < 2; ++http11)
+            for (int keep_alive = 0; keep_alive < 2; ++keep_alive) {
+                free(templates[status][http11][keep_alive].data);
+                templates[status][http11][keep_alive].data = NULL;
+            }
+}
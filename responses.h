@@ -0,0 +1,88 @@
+#ifndef RESPONSES_H
+#define RESPONSES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * responses.h
+ *
+ * This file declares the responses the server can render ahead of
+ * time. every error, redirect and overload response, and the head of a 200,
+ * 206 and 304 response, is built once by init_responses. answering then costs
+ * one copy of the ready bytes with the variable fields (the date,
+ * the redirect location) patched in.
+ * the Date value comes from a clock shared by all threads that is
+ * formatted at most once per second.
+ */
+
+#define HTTP_DATE_LEN 29            //"Sun, 06 Nov 1994 08:49:37 GMT"
+
+/**
+ * init_responses builds the response templates. it must be called
+ * once before any other function of this file.
+ * returns 0 on success and -1 if out of memory.
+ */
+int init_responses(void);
+
+/**
+ * http_date copies the current date in RFC1123 format to buf
+ * (HTTP_DATE_LEN bytes, not NUL terminated).
+ */
+void http_date(char* buf);
+
+/**
+ * fixed_response returns a malloced copy of the complete response
+ * of status_code (400, 403, 404, 500 or 501) and stores its length
+ * in len. returns NULL for another code or if out of memory.
+ */
+char* fixed_response(int status_code, bool http11, bool keep_alive, size_t* len);
+
+/**
+ * redirect_response returns a malloced 302 response that sends the
+ * client to path with a slash appended, and stores its length in len.
+ * returns NULL if out of memory.
+ */
+char* redirect_response(const char* path, bool http11, bool keep_alive, size_t* len);
+
+/**
+ * response_head returns a malloced status line and general headers
+ * of a 200 response, with room for extra more bytes after them, and
+ * stores the length of the head in len. the caller appends the
+ * entity headers. returns NULL if out of memory.
+ */
+char* response_head(bool http11, bool keep_alive, size_t extra, size_t* len);
+
+/**
+ * partial_content_head is response_head for a 206 response. the
+ * caller appends the Content-Range (or multipart Content-Type) and
+ * the entity headers.
+ */
+char* partial_content_head(bool http11, bool keep_alive, size_t extra, size_t* len);
+
+/**
+ * range_not_satisfiable_response returns a malloced 416 response
+ * whose Content-Range gives size, the length of the file, and stores
+ * its length in len. returns NULL if out of memory.
+ */
+char* range_not_satisfiable_response(long long size, bool http11, bool keep_alive, size_t* len);
+
+/**
+ * not_modified_head is response_head for a 304 response. the caller
+ * appends the validators and the empty line; a 304 has no body.
+ */
+char* not_modified_head(bool http11, bool keep_alive, size_t extra, size_t* len);
+
+/**
+ * service_unavailable_response returns a malloced 503 response that
+ * asks the client to retry after retry_after seconds, and stores its
+ * length in len. returns NULL if out of memory.
+ */
+char* service_unavailable_response(int retry_after, bool http11, bool keep_alive, size_t* len);
+
+/**
+ * free_responses frees the templates.
+ */
+void free_responses(void);
+
+#endif
@@ -1,268 +1,1478 @@
 //323071043
 
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <errno.h>
-#include <libgen.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <strings.h>
 #include <unistd.h>
 #include "threadpool.h"
+#include "server.h"
+#include "file_cache.h"
+#include "content_cache.h"
+#include "dir_cache.h"
+#include "gzip_cache.h"
+#include "codel.h"
+#include "metrics.h"
+#include "responses.h"
+
+#define DEFAULT_SENDFILE_CHUNK (512 * 1024)
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define MAX_LISTENERS 64
+#define MAX_POOLS 64
+
+static size_t sendfile_chunk = DEFAULT_SENDFILE_CHUNK;
+static file_cache* cache;
+static content_cache* body_cache;
+static dir_cache* listing_cache;
+static gzip_cache* compressed_cache;
+static size_t gzip_min_size;
+static codel* shedder;
+static int retry_after = 1;
+static const char* metrics_path;
+static threadpool* pools[MAX_POOLS];
+static int num_pools;
+static access_log* access_logger;
+
+// parse the optional --name=value flags that follow the positional arguments
+static int parse_options(int argc, char *argv[], server_config *config) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    config->num_loops = cores < 1 ? 1 : cores > 4 ? 4 : (int)cores;
+    config->keepalive_timeout = 5;
+    config->max_keepalive_requests = 100;
+    config->sendfile_chunk = DEFAULT_SENDFILE_CHUNK;
+    config->file_cache_entries = 1024;
+    config->file_cache_ttl = 2;
+    config->content_cache_bytes = 32 * 1024 * 1024;
+    config->content_cache_max_file = 64 * 1024;
+    config->dir_cache_entries = 64;
+    config->gzip_cache_bytes = 16 * 1024 * 1024;
+    config->gzip_min_size = 1024;
+    config->queue = QUEUE_MUTEX;
+    config->listeners = 1;
+    config->backlog = SOMAXCONN;
+    config->pools = 1;
+    config->io = IO_EPOLL;
+    config->min_threads = 0;
+    config->grow_threshold = 1;
+    config->thread_idle_timeout = 30000;
+    config->thread_stack_size = 0;
+    config->retry_after = 1;
+    config->codel_target = 20;
+    config->codel_interval = 100;
+    config->metrics_path = NULL;
+    config->access_log_path = NULL;
+    config->access_log_max_bytes = 64 * 1024 * 1024;
+    config->access_log_format = ACCESS_LOG_TEXT;
+
+    for (int i = 5; i < argc; ++i) {
+        if (strncmp(argv[i], "--loops=", 8) == 0)
+            config->num_loops = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--keepalive-timeout=", 20) == 0)
+            config->keepalive_timeout = atoi(argv[i] + 20);
+        else if (strncmp(argv[i], "--max-keepalive-requests=", 25) == 0)
+            config->max_keepalive_requests = atoi(argv[i] + 25);
+        else if (strncmp(argv[i], "--sendfile-chunk=", 17) == 0)
+            config->sendfile_chunk = strtoul(argv[i] + 17, NULL, 10);
+        else if (strncmp(argv[i], "--file-cache-entries=", 21) == 0)
+            config->file_cache_entries = atoi(argv[i] + 21);
+        else if (strncmp(argv[i], "--file-cache-ttl=", 17) == 0)
+            config->file_cache_ttl = atoi(argv[i] + 17);
+        else if (strncmp(argv[i], "--content-cache-bytes=", 22) == 0)
+            config->content_cache_bytes = strtoul(argv[i] + 22, NULL, 10);
+        else if (strncmp(argv[i], "--content-cache-max-file=", 25) == 0)
+            config->content_cache_max_file = strtoul(argv[i] + 25, NULL, 10);
+        else if (strncmp(argv[i], "--dir-cache-entries=", 20) == 0)
+            config->dir_cache_entries = atoi(argv[i] + 20);
+        else if (strncmp(argv[i], "--gzip-cache-bytes=", 19) == 0)
+            config->gzip_cache_bytes = strtoul(argv[i] + 19, NULL, 10);
+        else if (strncmp(argv[i], "--gzip-min-size=", 16) == 0)
+            config->gzip_min_size = strtoul(argv[i] + 16, NULL, 10);
+        else if (strcmp(argv[i], "--queue=mutex") == 0)
+            config->queue = QUEUE_MUTEX;
+        else if (strcmp(argv[i], "--queue=ring") == 0)
+            config->queue = QUEUE_RING;
+        else if (strcmp(argv[i], "--queue=stealing") == 0)
+            config->queue = QUEUE_STEALING;
+        else if (strncmp(argv[i], "--listeners=", 12) == 0)
+            config->listeners = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--backlog=", 10) == 0)
+            config->backlog = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--pools=", 8) == 0)
+            config->pools = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--min-threads=", 14) == 0)
+            config->min_threads = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--grow-threshold=", 17) == 0)
+            config->grow_threshold = atoi(argv[i] + 17);
+        else if (strncmp(argv[i], "--thread-idle-timeout=", 22) == 0)
+            config->thread_idle_timeout = atoi(argv[i] + 22);
+        else if (strncmp(argv[i], "--thread-stack-size=", 20) == 0)
+            config->thread_stack_size = strtoul(argv[i] + 20, NULL, 10);
+        else if (strncmp(argv[i], "--retry-after=", 14) == 0)
+            config->retry_after = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--codel-target=", 15) == 0)
+            config->codel_target = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--codel-interval=", 17) == 0)
+            config->codel_interval = atoi(argv[i] + 17);
+        else if (strncmp(argv[i], "--metrics-path=", 15) == 0)
+            config->metrics_path = argv[i] + 15;
+        else if (strncmp(argv[i], "--access-log=", 13) == 0)
+            config->access_log_path = argv[i] + 13;
+        else if (strncmp(argv[i], "--access-log-max-bytes=", 23) == 0)
+            config->access_log_max_bytes = strtoul(argv[i] + 23, NULL, 10);
+        else if (strcmp(argv[i], "--access-log-format=text") == 0)
+            config->access_log_format = ACCESS_LOG_TEXT;
+        else if (strcmp(argv[i], "--access-log-format=binary") == 0)
+            config->access_log_format = ACCESS_LOG_BINARY;
+        else if (strcmp(argv[i], "--io=epoll") == 0)
+            config->io = IO_EPOLL;
+        else if (strcmp(argv[i], "--io=uring") == 0)
+            config->io = IO_URING;
+        else
+            return -1;
+    }
+    if (config->num_loops <= 0 || config->keepalive_timeout <= 0 || config->max_keepalive_requests <= 0 || config->sendfile_chunk == 0)
+        return -1;
+    if (config->file_cache_entries <= 0 || config->file_cache_ttl < 0)
+        return -1;
+    if (config->listeners <= 0 || config->listeners > MAX_LISTENERS || config->backlog <= 0 ||
+        config->pools <= 0 || config->pools > MAX_POOLS)
+        return -1;
+    if (config->min_threads < 0 || config->grow_threshold <= 0 || config->thread_idle_timeout < 0)
+        return -1;
+    if (config->retry_after < 0 || config->codel_target < 0 || config->codel_interval <= 0)
+        return -1;
+    if (config->metrics_path != NULL && config->metrics_path[0] != '/')
+        return -1;
+    // every listener has a loop of its own
+    if (config->num_loops < config->listeners)
+        config->num_loops = config->listeners;
+    return 0;
+}
+
+// open a non-blocking socket listening on port. with reuseport other
+// sockets may listen on the same port, and the kernel spreads the connections.
+static int open_listener(int port, int backlog, bool reuseport) {
+    int sock;
+    struct sockaddr_in srv;
+
+    if ((sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
 
-#define DEBUG 0
-#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
-#define MAX_FIRST_LINE 4000
-
-#if DEBUG
-#define DEBUG_PRINT(fmt, ...) \
-        fprintf(stderr, "DEBUG: " fmt, ##__VA_ARGS__)
-#else
-#define DEBUG_PRINT(fmt, ...) \
-        do { } while (0)
-#endif
-
-int handle_client(void* arg);
-int check_bad_request(const char *request, char **path);
-bool isValidHttpVersion(const char *version);
-int check_path(char *path);
-void send_response(int client_sock, char* status, int status_code, char* path);
-char *get_mime_type(const char *name);
-bool does_file_exist(const char *path, struct stat *stat_buf);
-bool check_permission(const char *path);
-int is_index_html_in_directory(char *directory_path);
-char* create_response(char* status, int status_code, char* path, char* body, size_t body_size, size_t* total_size);
-char* get_response_body(int status_code, char* path, size_t* bytes_read);
-bool is_directory(const char* path);
-int send_file_to_socket(const char *path, int client_socket);
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_addr.s_addr = htonl(INADDR_ANY);
+    srv.sin_port = htons(port);
+
+    if(bind(sock, (struct sockaddr*) &srv, sizeof(srv)) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    if(listen(sock, backlog) < 0) {
+        perror("listen");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
 int main(int argc, char *argv[]) {
 
+    server_config config;
+
     // check user usage
-    if (argc != 5) {
-        printf("Usage: server <port> <pool-size> <max-queue-size> <max-number-of-request>\n");
+    if (argc < 5 || parse_options(argc, argv, &config) < 0) {
+        printf("Usage: server <port> <pool-size> <max-queue-size> <max-number-of-request> [options]\n"
+               "  --loops=<n>  --keepalive-timeout=<seconds>  --max-keepalive-requests=<n>\n"
+               "  --sendfile-chunk=<bytes>  --file-cache-entries=<n>  --file-cache-ttl=<seconds>\n"
+               "  --content-cache-bytes=<bytes>  --content-cache-max-file=<bytes>  --dir-cache-entries=<n>\n"
+               "  --gzip-cache-bytes=<bytes>  --gzip-min-size=<bytes>\n"
+               "  --queue=mutex|ring|stealing  --listeners=<n>  --backlog=<n>  --pools=<n>\n"
+               "  --io=epoll|uring  --min-threads=<n>  --grow-threshold=<n>  --thread-idle-timeout=<ms>\n"
+               "  --thread-stack-size=<bytes>  --retry-after=<seconds>  --codel-target=<ms>  --codel-interval=<ms>\n"
+               "  --metrics-path=<path>  --access-log=<path>  --access-log-max-bytes=<bytes>\n"
+               "  --access-log-format=text|binary\n");
         exit(1);
     }
 
     // init variables
-    int port = atoi(argv[1]);
-    int pool_size = atoi(argv[2]);
-    int max_queue_size = atoi(argv[3]);
-    int num_of_request = atoi(argv[4]);
+    config.port = atoi(argv[1]);
+    config.pool_size = atoi(argv[2]);
+    config.max_queue_size = atoi(argv[3]);
+    config.max_requests = atoi(argv[4]);
 
-    int server_sock;
-    struct sockaddr_in srv;
-    struct sockaddr_in cli;
-    socklen_t client_len = sizeof(cli);
+    int listen_fds[MAX_LISTENERS];
 
-    // Create socket
-    if ((server_sock = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
-        exit(1);
+    // a client that disconnects early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    set_sendfile_chunk(config.sendfile_chunk);
+
+    // Create the listening sockets
+    for (int i = 0; i < config.listeners; ++i) {
+        listen_fds[i] = open_listener(config.port, config.backlog, config.listeners > 1);
+        if (listen_fds[i] < 0)
+            exit(1);
     }
 
-    memset(&srv, 0, sizeof(srv));
-    srv.sin_family = AF_INET;
-    srv.sin_addr.s_addr = htonl(INADDR_ANY);
-    srv.sin_port = htons(port);
+    // every connection and every cached file holds a descriptor
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
 
-    if(bind(server_sock, (struct sockaddr*) &srv, sizeof(srv)) < 0) {
-        perror("bind");
+    if (init_responses() < 0) {
+        fprintf(stderr, "init_responses failed\n");
         exit(1);
     }
 
-    if(listen(server_sock, 5) < 0) {
-        perror("listen");
+    cache = create_file_cache(config.file_cache_entries, config.file_cache_ttl);
+    if (cache == NULL) {
+        fprintf(stderr, "create_file_cache failed\n");
         exit(1);
     }
 
-    int counter = 0;
+    // a zero budget disables the content cache
+    if (config.content_cache_bytes > 0) {
+        body_cache = create_content_cache(config.content_cache_bytes, config.content_cache_max_file, render_cached_headers);
+        if (body_cache == NULL) {
+            fprintf(stderr, "create_content_cache failed\n");
+            exit(1);
+        }
+    }
+
+    // zero entries disables the listing cache
+    if (config.dir_cache_entries > 0) {
+        listing_cache = create_dir_cache(config.dir_cache_entries, render_directory_listing);
+        if (listing_cache == NULL) {
+            fprintf(stderr, "create_dir_cache failed\n");
+            exit(1);
+        }
+    }
+
+    retry_after = config.retry_after;
+    metrics_path = config.metrics_path;
 
-    struct _threadpool_st* threadpool_st = create_threadpool(pool_size, max_queue_size);
+    // without a path there is no access log
+    if (config.access_log_path != NULL) {
+        access_logger = create_access_log(config.access_log_path, config.access_log_format, config.access_log_max_bytes);
+        if (access_logger == NULL) {
+            fprintf(stderr, "create_access_log failed\n");
+            exit(1);
+        }
+    }
 
-    while (counter++ < num_of_request) {
-        int* client_sock = malloc(sizeof(int));
-        if (client_sock == NULL) {
-            perror("malloc");
+    // a zero target disables shedding by queue delay
+    if (config.codel_target > 0) {
+        shedder = create_codel(config.codel_target, config.codel_interval);
+        if (shedder == NULL) {
+            fprintf(stderr, "create_codel failed\n");
             exit(1);
         }
-        *client_sock = accept(server_sock, (struct sockaddr *)&cli, &client_len);
-        DEBUG_PRINT("socket = %d\n", *client_sock);
-        if (*client_sock < 0) {
-            perror("accept");
-            free(client_sock);
+    }
+
+    // a zero budget disables compression on the fly
+    gzip_min_size = config.gzip_min_size;
+    if (config.gzip_cache_bytes > 0) {
+        compressed_cache = create_gzip_cache(config.gzip_cache_bytes);
+        if (compressed_cache == NULL) {
+            fprintf(stderr, "create_gzip_cache failed\n");
             exit(1);
         }
-        dispatch(threadpool_st, handle_client, client_sock);
-        DEBUG_PRINT("COUNTER: %d\n", counter);
     }
 
-    close(server_sock);
-    destroy_threadpool(threadpool_st);
+    // the threads are split over the pools, the first ones get the remainder. without
+    // --min-threads the pools keep all of them.
+    if (config.min_threads == 0 || config.min_threads > config.pool_size)
+        config.min_threads = config.pool_size;
+    num_pools = config.pools;
+    for (int i = 0; i < config.pools; ++i) {
+        int threads = config.pool_size / config.pools + (i < config.pool_size % config.pools);
+        int min_threads = config.min_threads / config.pools + (i < config.min_threads % config.pools);
+        threadpool_config pool_config = {
+            .min_threads = min_threads > 0 ? min_threads : 1,
+            .max_threads = threads,
+            .max_queue_size = config.max_queue_size,
+            .kind = config.queue,
+            .grow_threshold = config.grow_threshold,
+            .idle_timeout_ms = config.thread_idle_timeout,
+            .stack_size = config.thread_stack_size
+        };
+        pools[i] = create_threadpool_with_config(&pool_config);
+        if (pools[i] == NULL) {
+            fprintf(stderr, "create_threadpool failed\n");
+            exit(1);
+        }
+    }
+
+    event_engine* engine = create_event_engine(listen_fds, config.listeners, config.num_loops, pools, config.pools,
+                                               handle_client, config.max_requests);
+    if (engine == NULL) {
+        fprintf(stderr, "create_event_engine failed\n");
+        exit(1);
+    }
+    engine->keepalive_timeout = config.keepalive_timeout;
+    engine->max_keepalive_requests = config.max_keepalive_requests;
+    engine->backend = config.io;
+    engine->reject = reject_client;
+
+    run_event_engine(engine);
+    if (engine->backend == IO_URING)
+        fprintf(stderr, "io_uring: %llu enter calls, %llu submissions, %llu completions\n",
+                (unsigned long long)atomic_load(&engine->ring_enters), (unsigned long long)atomic_load(&engine->ring_sqes),
+                (unsigned long long)atomic_load(&engine->ring_cqes));
+
+    for (int i = 0; i < config.listeners; ++i)
+        close(listen_fds[i]);
+    fprintf(stderr, "overload: %llu rejected with a full queue, %llu shed by queue delay\n",
+            (unsigned long long)atomic_load(&engine->rejected),
+            (unsigned long long)(shedder != NULL ? codel_shed_count(shedder) : 0));
+    for (int i = 0; i < config.pools; ++i) {
+        threadpool_stats pool_stats;
+        threadpool_get_stats(pools[i], &pool_stats);
+        fprintf(stderr, "pool %d: %d threads (peak %d), %llu started, %llu retired\n", i, pool_stats.threads,
+                pool_stats.peak_threads, (unsigned long long)pool_stats.grown, (unsigned long long)pool_stats.retired);
+        destroy_threadpool(pools[i]);
+    }
+    if (shedder != NULL)
+        destroy_codel(shedder);
+    destroy_event_engine(engine);
+
+    // the pools and the loops are gone, so everything logged is in the rings
+    if (access_logger != NULL) {
+        access_log_stop(access_logger);
+        access_log_stats access_stats;
+        access_log_get_stats(access_logger, &access_stats);
+        fprintf(stderr, "access log: %llu records written, %llu dropped, %llu rotations\n",
+                (unsigned long long)access_stats.written, (unsigned long long)access_stats.dropped,
+                (unsigned long long)access_stats.rotations);
+        destroy_access_log(access_logger);
+    }
+
+    file_cache_stats stats;
+    file_cache_get_stats(cache, &stats);
+    fprintf(stderr, "file cache: %d entries, %llu hits, %llu misses (%llu expired), %llu evictions\n",
+            stats.entries, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.expired, (unsigned long long)stats.evictions);
+    destroy_file_cache(cache);
+
+    if (body_cache != NULL) {
+        content_cache_stats body_stats;
+        content_cache_get_stats(body_cache, &body_stats);
+        fprintf(stderr, "content cache: %zu bytes, %llu hits, %llu misses, %llu admitted, %llu rejected, %llu evictions\n",
+                body_stats.bytes, (unsigned long long)body_stats.hits, (unsigned long long)body_stats.misses,
+                (unsigned long long)body_stats.admitted, (unsigned long long)body_stats.rejected,
+                (unsigned long long)body_stats.evictions);
+        destroy_content_cache(body_cache);
+    }
+
+    if (listing_cache != NULL) {
+        dir_cache_stats dir_stats;
+        dir_cache_get_stats(listing_cache, &dir_stats);
+        fprintf(stderr, "dir cache: %d entries, %llu hits, %llu misses, %llu invalidations, %llu evictions\n",
+                dir_stats.entries, (unsigned long long)dir_stats.hits, (unsigned long long)dir_stats.misses,
+                (unsigned long long)dir_stats.invalidations, (unsigned long long)dir_stats.evictions);
+        destroy_dir_cache(listing_cache);
+    }
+
+    if (compressed_cache != NULL) {
+        gzip_cache_stats gzip_stats;
+        gzip_cache_get_stats(compressed_cache, &gzip_stats);
+        fprintf(stderr, "gzip cache: %zu bytes, %llu hits, %llu misses, %llu evictions, %llu bytes compressed to %llu\n",
+                gzip_stats.bytes, (unsigned long long)gzip_stats.hits, (unsigned long long)gzip_stats.misses,
+                (unsigned long long)gzip_stats.evictions, (unsigned long long)gzip_stats.bytes_in,
+                (unsigned long long)gzip_stats.bytes_out);
+        destroy_gzip_cache(compressed_cache);
+    }
+    free_responses();
     return 0;
 
 }
 
-// handle given request.
-int handle_client(void* arg) {
-    int* client_sock = (int*)arg;
-    DEBUG_PRINT("socket = %d\n", *client_sock);
-    char request[MAX_FIRST_LINE];
-    ssize_t bytes_read = read(*client_sock, request, MAX_FIRST_LINE);
+// check an entity tag list of If-None-Match against the entity tag of the file.
+// the comparison is weak (a W/ prefix is ignored), as RFC 9110 asks for this header.
+static bool etag_matches(const char* list, size_t len, const char* etag) {
+    const char* list_end = list + len;
+    size_t etag_len = strlen(etag);
+    while (list < list_end) {
+        const char* tag_end = memchr(list, ',', list_end - list);
+        if (tag_end == NULL)
+            tag_end = list_end;
+        const char* tag = list;
+        const char* tag_last = tag_end;
+        while (tag < tag_last && (*tag == ' ' || *tag == '\t'))
+            tag++;
+        while (tag_last > tag && (tag_last[-1] == ' ' || tag_last[-1] == '\t'))
+            tag_last--;
+        if (tag_last - tag == 1 && *tag == '*')
+            return true;
+        if (tag_last - tag > 2 && tag[0] == 'W' && tag[1] == '/')
+            tag += 2;
+        if ((size_t)(tag_last - tag) == etag_len && memcmp(tag, etag, etag_len) == 0)
+            return true;
+        list = tag_end + 1;
+    }
+    return false;
+}
+
+// parse an HTTP-date in any of the three formats of RFC 9110: IMF-fixdate, RFC 850 and asctime
+static bool parse_http_date(const char* value, size_t len, time_t* date) {
+    static const char* const formats[] = {
+        RFC1123FMT,
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y"
+    };
+    char text[64];
+    if (len >= sizeof(text))
+        return false;
+    memcpy(text, value, len);
+    text[len] = '\0';
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        struct tm tm_date;
+        memset(&tm_date, 0, sizeof(tm_date));
+        const char* end = strptime(text, formats[i], &tm_date);
+        if (end != NULL && *end == '\0') {
+            *date = timegm(&tm_date);
+            return true;
+        }
+    }
+    return false;
+}
+
+// evaluate the preconditions of a GET of a representation with the entity tag etag and
+// the modification time mtime (RFC 9110 13.2.2): If-None-Match, and If-Modified-Since only
+// when there is no If-None-Match.
+// returns true if the client's copy is current and a 304 answers it.
+static bool is_not_modified(const char* request, const http_parser* parser, const char* etag, time_t mtime) {
+    size_t len;
+    const char* value = http_find_header(parser, request, "If-None-Match", &len);
+    if (value != NULL)
+        return etag_matches(value, len, etag);
+    value = http_find_header(parser, request, "If-Modified-Since", &len);
+    time_t since;
+    // a date in the future is invalid, the file may change again within the second
+    if (value == NULL || !parse_http_date(value, len, &since) || since > time(NULL))
+        return false;
+    return mtime <= since;
+}
+
+// parse a byte position of a range. returns false if it is not a number or overflows off_t.
+static bool parse_byte_pos(const char* p, const char* end, off_t* pos) {
+    if (p == end)
+        return false;
+    unsigned long long value = 0;
+    for (; p < end; ++p) {
+        if (*p < '0' || *p > '9' || value > (unsigned long long)LLONG_MAX / 10)
+            return false;
+        value = value * 10 + (*p - '0');
+    }
+    if (value > (unsigned long long)LLONG_MAX)
+        return false;
+    *pos = (off_t)value;
+    return true;
+}
+
+// parse the value of a Range header (RFC 9110 14.1.2) for a file of size bytes.
+// the satisfiable ranges, clamped to the file, are stored in ranges.
+// returns their number, 0 if none is satisfiable (a 416), or -1 if the header
+// is malformed, not in bytes or lists more than MAX_RANGES ranges, and is ignored.
+static int parse_ranges(const char* value, size_t len, off_t size, byte_range* ranges) {
+    const char* value_end = value + len;
+    if (len < 6 || strncasecmp(value, "bytes=", 6) != 0)
+        return -1;
+    value += 6;
+    int count = 0;
+    int listed = 0;
+    while (value < value_end) {
+        const char* spec_end = memchr(value, ',', value_end - value);
+        if (spec_end == NULL)
+            spec_end = value_end;
+        const char* spec = value;
+        const char* spec_last = spec_end;
+        value = spec_end + 1;
+        while (spec < spec_last && (*spec == ' ' || *spec == '\t'))
+            spec++;
+        while (spec_last > spec && (spec_last[-1] == ' ' || spec_last[-1] == '\t'))
+            spec_last--;
+        // empty list elements are allowed
+        if (spec == spec_last)
+            continue;
+        if (++listed > MAX_RANGES)
+            return -1;
+        const char* dash = memchr(spec, '-', spec_last - spec);
+        if (dash == NULL)
+            return -1;
+        off_t first, last;
+        if (dash == spec) {
+            // the last n bytes
+            off_t suffix;
+            if (!parse_byte_pos(dash + 1, spec_last, &suffix))
+                return -1;
+            if (suffix == 0 || size == 0)
+                continue;
+            first = suffix < size ? size - suffix : 0;
+            last = size - 1;
+        }
+        else {
+            if (!parse_byte_pos(spec, dash, &first))
+                return -1;
+            if (dash + 1 == spec_last)
+                last = size - 1;
+            else if (!parse_byte_pos(dash + 1, spec_last, &last) || last < first)
+                return -1;
+            if (first >= size)
+                continue;
+            if (last >= size)
+                last = size - 1;
+        }
+        ranges[count].first = first;
+        ranges[count].last = last;
+        count++;
+    }
+    return listed == 0 ? -1 : count;
+}
+
+// the ranges of the file a request asks for, as parse_ranges returns them.
+// a Range whose If-Range does not match the file is ignored (-1): the client's
+// copy is stale and it needs the whole file.
+static int requested_ranges(const char* request, const http_parser* parser, const file_entry* entry, byte_range* ranges) {
+    size_t len;
+    const char* value = http_find_header(parser, request, "Range", &len);
+    if (value == NULL || entry->is_dir)
+        return -1;
+    size_t if_range_len;
+    const char* if_range = http_find_header(parser, request, "If-Range", &if_range_len);
+    if (if_range != NULL) {
+        // an entity tag must match strongly, a weak tag never does. a date must be the file's mtime.
+        if (if_range_len > 0 && (if_range[0] == '"' || if_range[0] == 'W')) {
+            if (if_range_len != strlen(entry->etag) || memcmp(if_range, entry->etag, if_range_len) != 0)
+                return -1;
+        }
+        else {
+            time_t date;
+            if (!parse_http_date(if_range, if_range_len, &date) || date != entry->mtime)
+                return -1;
+        }
+    }
+    return parse_ranges(value, len, entry->size, ranges);
+}
 
-    if (bytes_read <= 0) {
-        send_response(*client_sock, "500 Internal Server Error", 500, NULL);
-        perror("read");
-        goto end;
+// output segments the response to a request may need: a head and a body, or for a
+// multipart/byteranges response a head, and a part header and body for every range
+static int response_segments(const char* request, const http_parser* parser) {
+    size_t len;
+    const char* value = http_find_header(parser, request, "Range", &len);
+    if (value == NULL)
+        return 2;
+    int ranges = 1;
+    for (size_t i = 0; i < len; ++i)
+        if (value[i] == ',')
+            ranges++;
+    return ranges > MAX_RANGES ? 2 : 2 * ranges + 1;
+}
+
+// parse the weight of an Accept-Encoding element, "q=0.5", in thousandths. an invalid weight is 0.
+static int parse_qvalue(const char* p, const char* end) {
+    if (end - p < 3 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=')
+        return 0;
+    p += 2;
+    if (*p != '0' && *p != '1')
+        return 0;
+    int q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        p++;
+        for (int scale = 100; p < end && *p >= '0' && *p <= '9' && scale > 0; ++p, scale /= 10)
+            q += (*p - '0') * scale;
     }
+    return p == end && q <= 1000 ? q : 0;
+}
 
-    char* end_of_first_line = strstr(request, "\r\n");
-    if (end_of_first_line == NULL) {
-        send_response(*client_sock, "400 Bad Request", 400, NULL);
-        goto end;
+// the weights, in thousandths, that the request's Accept-Encoding (RFC 9110 12.5.3) gives the
+// codings: 0 for a coding the client doesn't accept. an unlisted identity weighs 0, it is the last choice.
+static void accepted_encodings(const char* request, const http_parser* parser, int* weights, int* identity_weight) {
+    size_t len;
+    int any_weight = 0;
+    *identity_weight = 0;
+    for (int i = 0; i < NUM_ENCODINGS; ++i)
+        weights[i] = -1;
+    const char* value = http_find_header(parser, request, "Accept-Encoding", &len);
+    if (value == NULL) {
+        value = "";
+        len = 0;
     }
-    end_of_first_line[0] = '\0';
-    DEBUG_PRINT("%s\n", request);
-    char* path;
+    const char* value_end = value + len;
+    while (value < value_end) {
+        const char* element_end = memchr(value, ',', value_end - value);
+        if (element_end == NULL)
+            element_end = value_end;
+        const char* coding = value;
+        value = element_end + 1;
+        while (coding < element_end && (*coding == ' ' || *coding == '\t'))
+            coding++;
+        const char* coding_end = coding;
+        while (coding_end < element_end && *coding_end != ';' && *coding_end != ' ' && *coding_end != '\t')
+            coding_end++;
+        int weight = 1000;
+        const char* param = memchr(coding_end, ';', element_end - coding_end);
+        if (param != NULL) {
+            const char* param_end = element_end;
+            param++;
+            while (param < param_end && (*param == ' ' || *param == '\t'))
+                param++;
+            while (param_end > param && (param_end[-1] == ' ' || param_end[-1] == '\t'))
+                param_end--;
+            weight = parse_qvalue(param, param_end);
+        }
+        size_t coding_len = coding_end - coding;
+        if (coding_len == 2 && strncasecmp(coding, "br", 2) == 0)
+            weights[ENCODING_BR] = weight;
+        else if ((coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+                 (coding_len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))
+            weights[ENCODING_GZIP] = weight;
+        else if (coding_len == 8 && strncasecmp(coding, "identity", 8) == 0)
+            *identity_weight = weight;
+        else if (coding_len == 1 && *coding == '*')
+            any_weight = weight;
+    }
+    for (int i = 0; i < NUM_ENCODINGS; ++i)
+        if (weights[i] < 0)
+            weights[i] = any_weight;
+}
 
-    const int check_req = check_bad_request(request, &path);
+// the entry to serve for the weights of accepted_encodings: the precompressed sibling the
+// client weighs highest, brotli on a tie, or the file itself. a sibling is served unless
+// identity is listed with a higher weight.
+static file_entry* negotiate_encoding(file_entry* entry, const int* weights, int identity_weight) {
+    file_entry* chosen = entry;
+    int chosen_weight = 0;
+    for (int i = 0; i < NUM_ENCODINGS; ++i) {
+        int weight = weights[i];
+        if (entry->variants[i] != NULL && weight > chosen_weight && weight >= identity_weight) {
+            chosen = entry->variants[i];
+            chosen_weight = weight;
+        }
+    }
+    return chosen;
+}
+
+// whether the 200 response of entry is gzip compressed on the fly for a client that accepts it:
+// a directory listing, or a text file in the size bounds that is not a precompressed sibling
+static bool compresses_on_the_fly(const file_entry* entry) {
+    if (compressed_cache == NULL || entry->encoding != NULL)
+        return false;
+    if (entry->is_dir)
+        return true;
+    return entry->mime != NULL && strncmp(entry->mime, "text/", 5) == 0 &&
+           (size_t)entry->size >= gzip_min_size && (size_t)entry->size <= compressed_cache->max_source;
+}
+
+// count a response queued on the connection, for the metrics and the access log
+static void count_response(connection* conn, int status_code) {
+    conn->status = status_code;
+    metrics_count_response(status_code);
+}
+
+// log the request at the start of request, answered by the output segments from first_seg on.
+// queued is how long the connection waited for a pool thread, started when this request's handling began.
+static void log_access(connection* conn, const char* request, const http_parser* parser, int first_seg,
+                       uint64_t queued, uint64_t started) {
+    access_record* record = access_log_begin(access_logger);
+    if (record == NULL)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->bytes = 0;
+    for (int i = first_seg; i < conn->out_count; ++i) {
+        const out_seg* seg = &conn->out[(conn->out_head + i) % CONN_MAX_SEGS];
+        record->bytes += seg->fd >= 0 ? (uint64_t)(seg->end - seg->off) : seg->len;
+    }
+    record->queue_us = queued / 1000 < UINT32_MAX ? (uint32_t)(queued / 1000) : UINT32_MAX;
+    uint64_t service = monotonic_ns() - started;
+    record->service_us = service / 1000 < UINT32_MAX ? (uint32_t)(service / 1000) : UINT32_MAX;
+    record->status = (uint16_t)conn->status;
+
+    // a multishot accept doesn't return the address, so it is asked for once per connection
+    if (!conn->peer_known) {
+        socklen_t len = sizeof(conn->peer);
+        if (getpeername(conn->fd, (struct sockaddr*)&conn->peer, &len) < 0)
+            conn->peer.ss_family = AF_UNSPEC;
+        conn->peer_known = true;
+    }
+    record->family = 0;
+    if (conn->peer.ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)&conn->peer;
+        record->family = AF_INET;
+        record->port = ntohs(in->sin_port);
+        memcpy(record->addr, &in->sin_addr, sizeof(in->sin_addr));
+    }
+    else if (conn->peer.ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)&conn->peer;
+        record->family = AF_INET6;
+        record->port = ntohs(in6->sin6_port);
+        memcpy(record->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+
+    // the request line is contiguous from the method to the end of the last token parsed
+    size_t line_end = parser->method.off + parser->method.len;
+    if (parser->target.len > 0)
+        line_end = parser->target.off + parser->target.len;
+    if (parser->version.len > 0)
+        line_end = parser->version.off + parser->version.len;
+    size_t line_len = parser->method.len > 0 ? line_end - parser->method.off : 0;
+    if (line_len > ACCESS_LINE_MAX)
+        line_len = ACCESS_LINE_MAX;
+    memcpy(record->line, request + parser->method.off, line_len);
+    record->line_len = (uint8_t)line_len;
+    access_log_commit(access_logger);
+}
+
+// queue a 304 response with the representation headers of what the client has
+static void queue_not_modified(connection* conn, const char* headers, int headers_len) {
+    size_t header_size;
+    char* response = not_modified_head(conn->http11, !conn->close_after, headers_len + 2, &header_size);
+    if (response == NULL) {
+        conn->close_after = true;
+        return;
+    }
+    memcpy(response + header_size, headers, headers_len);
+    memcpy(response + header_size + headers_len, "\r\n", 3);
+    header_size += headers_len + 2;
+    count_response(conn, 304);
+    queue_data(conn, response, header_size, free, response);
+}
+
+// segment release of compressed output
+static void release_gzip(void* blob) {
+    gzip_cache_release((gzip_blob*)blob);
+}
+
+// queue the gzip compressed 200 response of a text file or a directory listing, or a 304 if the
+// client has it. the source is compressed on this pool thread, once per version while it stays cached.
+// returns false, having queued nothing, if the source is below the threshold or not compressed.
+static bool send_compressed(connection* conn, const char* request, const http_parser* parser, char* path, file_entry* entry) {
+    char etag[sizeof(entry->etag) + 8] = "";
+    gzip_blob* blob;
+    if (entry->is_dir) {
+        if (listing_cache != NULL) {
+            dir_listing* listing = dir_cache_lookup(listing_cache, path, entry->fd);
+            if (listing == NULL)
+                return false;
+            blob = listing->len >= gzip_min_size
+                   ? gzip_cache_lookup_data(compressed_cache, path, listing->serial, listing->data, listing->len) : NULL;
+            dir_cache_release(listing);
+        }
+        else {
+            size_t len;
+            char* body = render_directory_listing(path, entry->fd, &len);
+            if (body == NULL)
+                return false;
+            blob = len >= gzip_min_size ? gzip_compress(compressed_cache, body, len) : NULL;
+            free(body);
+        }
+    }
+    else {
+        // the compressed representation has a tag of its own, the file's with a suffix
+        snprintf(etag, sizeof(etag), "%.*s-gzip\"", (int)strlen(entry->etag) - 1, entry->etag);
+        char headers[256];
+        int headers_len = snprintf(headers, sizeof(headers),
+                                   "ETag: %s\r\n"
+                                   "Last-Modified: %s\r\n"
+                                   "Content-Encoding: gzip\r\n"
+                                   "Vary: Accept-Encoding\r\n",
+                                   etag, entry->last_modified);
+        if (is_not_modified(request, parser, etag, entry->mtime)) {
+            queue_not_modified(conn, headers, headers_len);
+            return true;
+        }
+        blob = gzip_cache_lookup_file(compressed_cache, entry->resolved, hash_path(entry->etag), entry->fd, entry->size);
+    }
+    if (blob == NULL)
+        return false;
+
+    char entity[512];
+    int entity_len = snprintf(
+        entity, sizeof(entity),
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s%s%s"
+        "Last-Modified: %s\r\n"
+        "Content-Encoding: gzip\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "\r\n",
+        entry->is_dir ? "text/html" : entry->mime, blob->len,
+        etag[0] != '\0' ? "ETag: " : "", etag, etag[0] != '\0' ? "\r\n" : "",
+        entry->last_modified);
+    size_t header_size;
+    char* response = response_head(conn->http11, !conn->close_after, entity_len, &header_size);
+    if (response == NULL) {
+        gzip_cache_release(blob);
+        conn->close_after = true;
+        return true;
+    }
+    memcpy(response + header_size, entity, entity_len + 1);
+    header_size += entity_len;
+    count_response(conn, 200);
+    queue_data(conn, response, header_size, free, response);
+    queue_data(conn, blob->data, blob->len, release_gzip, blob);
+    return true;
+}
+
+// write the counters of the caches that are enabled, their sizes are read under the shard locks.
+static void write_cache_metrics(FILE* out) {
+    if (cache != NULL) {
+        file_cache_stats stats;
+        file_cache_get_stats(cache, &stats);
+        fprintf(out, "# HELP file_cache_hits_total File cache lookups answered from the cache.\n# TYPE file_cache_hits_total counter\n"
+                     "file_cache_hits_total %llu\n"
+                     "# HELP file_cache_misses_total File cache lookups that built the entry.\n# TYPE file_cache_misses_total counter\n"
+                     "file_cache_misses_total %llu\n"
+                     "# HELP file_cache_expired_total File cache misses because the entry outlived the ttl.\n# TYPE file_cache_expired_total counter\n"
+                     "file_cache_expired_total %llu\n"
+                     "# HELP file_cache_evictions_total File cache entries evicted.\n# TYPE file_cache_evictions_total counter\n"
+                     "file_cache_evictions_total %llu\n"
+                     "# HELP file_cache_entries Entries in the file cache.\n# TYPE file_cache_entries gauge\n"
+                     "file_cache_entries %d\n",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.expired, (unsigned long long)stats.evictions, stats.entries);
+    }
+    if (body_cache != NULL) {
+        content_cache_stats stats;
+        content_cache_get_stats(body_cache, &stats);
+        fprintf(out, "# HELP content_cache_hits_total Bodies answered from the content cache.\n# TYPE content_cache_hits_total counter\n"
+                     "content_cache_hits_total %llu\n"
+                     "# HELP content_cache_misses_total Content cache lookups that read the file.\n# TYPE content_cache_misses_total counter\n"
+                     "content_cache_misses_total %llu\n"
+                     "# HELP content_cache_admitted_total Bodies admitted to the content cache.\n# TYPE content_cache_admitted_total counter\n"
+                     "content_cache_admitted_total %llu\n"
+                     "# HELP content_cache_rejected_total Misses the admission policy kept out.\n# TYPE content_cache_rejected_total counter\n"
+                     "content_cache_rejected_total %llu\n"
+                     "# HELP content_cache_evictions_total Bodies evicted from the content cache.\n# TYPE content_cache_evictions_total counter\n"
+                     "content_cache_evictions_total %llu\n"
+                     "# HELP content_cache_bytes Bytes of the bodies in the content cache.\n# TYPE content_cache_bytes gauge\n"
+                     "content_cache_bytes %zu\n",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.admitted, (unsigned long long)stats.rejected,
+                (unsigned long long)stats.evictions, stats.bytes);
+    }
+    if (listing_cache != NULL) {
+        dir_cache_stats stats;
+        dir_cache_get_stats(listing_cache, &stats);
+        fprintf(out, "# HELP dir_cache_hits_total Directory listings answered from the cache.\n# TYPE dir_cache_hits_total counter\n"
+                     "dir_cache_hits_total %llu\n"
+                     "# HELP dir_cache_misses_total Directory listings rendered.\n# TYPE dir_cache_misses_total counter\n"
+                     "dir_cache_misses_total %llu\n"
+                     "# HELP dir_cache_invalidations_total Listings dropped because their directory changed.\n# TYPE dir_cache_invalidations_total counter\n"
+                     "dir_cache_invalidations_total %llu\n"
+                     "# HELP dir_cache_evictions_total Listings evicted from the cache.\n# TYPE dir_cache_evictions_total counter\n"
+                     "dir_cache_evictions_total %llu\n"
+                     "# HELP dir_cache_entries Listings in the cache.\n# TYPE dir_cache_entries gauge\n"
+                     "dir_cache_entries %d\n",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.invalidations, (unsigned long long)stats.evictions, stats.entries);
+    }
+    if (compressed_cache != NULL) {
+        gzip_cache_stats stats;
+        gzip_cache_get_stats(compressed_cache, &stats);
+        fprintf(out, "# HELP gzip_cache_hits_total Compressed bodies answered from the cache.\n# TYPE gzip_cache_hits_total counter\n"
+                     "gzip_cache_hits_total %llu\n"
+                     "# HELP gzip_cache_misses_total Sources compressed.\n# TYPE gzip_cache_misses_total counter\n"
+                     "gzip_cache_misses_total %llu\n"
+                     "# HELP gzip_cache_evictions_total Compressed bodies evicted from the cache.\n# TYPE gzip_cache_evictions_total counter\n"
+                     "gzip_cache_evictions_total %llu\n"
+                     "# HELP gzip_cache_bytes_in_total Bytes of the sources compressed.\n# TYPE gzip_cache_bytes_in_total counter\n"
+                     "gzip_cache_bytes_in_total %llu\n"
+                     "# HELP gzip_cache_bytes_out_total Bytes of their compressed output.\n# TYPE gzip_cache_bytes_out_total counter\n"
+                     "gzip_cache_bytes_out_total %llu\n"
+                     "# HELP gzip_cache_bytes Bytes of the compressed bodies in the cache.\n# TYPE gzip_cache_bytes gauge\n"
+                     "gzip_cache_bytes %zu\n",
+                (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                (unsigned long long)stats.evictions, (unsigned long long)stats.bytes_in,
+                (unsigned long long)stats.bytes_out, stats.bytes);
+    }
+}
+
+// queue the metrics in the Prometheus text format: the counters of metrics.c, then the gauges
+// of the pools and the engine, read without taking a lock, then the caches' counters.
+static void send_metrics(connection* conn) {
+    char* body;
+    size_t body_size;
+    FILE* out = open_memstream(&body, &body_size);
+    if (out == NULL) {
+        perror("open_memstream");
+        send_response(conn, 500, NULL, NULL);
+        return;
+    }
+    metrics_write(out);
+
+    int threads[MAX_POOLS];
+    int queued[MAX_POOLS];
+    for (int i = 0; i < num_pools; ++i)
+        threadpool_load(pools[i], &threads[i], &queued[i]);
+    fprintf(out, "# HELP threadpool_threads Threads running in a pool.\n# TYPE threadpool_threads gauge\n");
+    for (int i = 0; i < num_pools; ++i)
+        fprintf(out, "threadpool_threads{pool=\"%d\"} %d\n", i, threads[i]);
+    fprintf(out, "# HELP threadpool_queued_jobs Connections waiting in a pool's queue.\n# TYPE threadpool_queued_jobs gauge\n");
+    for (int i = 0; i < num_pools; ++i)
+        fprintf(out, "threadpool_queued_jobs{pool=\"%d\"} %d\n", i, queued[i]);
+    threadpool_stats pool_stats[MAX_POOLS];
+    for (int i = 0; i < num_pools; ++i)
+        threadpool_get_stats(pools[i], &pool_stats[i]);
+    fprintf(out, "# HELP threadpool_threads_started_total Threads a pool started after it was created.\n"
+                 "# TYPE threadpool_threads_started_total counter\n");
+    for (int i = 0; i < num_pools; ++i)
+        fprintf(out, "threadpool_threads_started_total{pool=\"%d\"} %llu\n", i, (unsigned long long)pool_stats[i].grown);
+    fprintf(out, "# HELP threadpool_threads_retired_total Threads that left a pool after waiting idle.\n"
+                 "# TYPE threadpool_threads_retired_total counter\n");
+    for (int i = 0; i < num_pools; ++i)
+        fprintf(out, "threadpool_threads_retired_total{pool=\"%d\"} %llu\n", i, (unsigned long long)pool_stats[i].retired);
+    fprintf(out, "# HELP threadpool_threads_peak The most threads a pool ran at once.\n# TYPE threadpool_threads_peak gauge\n");
+    for (int i = 0; i < num_pools; ++i)
+        fprintf(out, "threadpool_threads_peak{pool=\"%d\"} %d\n", i, pool_stats[i].peak_threads);
+    event_engine* engine = conn->loop->engine;
+    fprintf(out, "# HELP http_connections_active Open client connections.\n# TYPE http_connections_active gauge\n"
+                 "http_connections_active %d\n"
+                 "# HELP http_connections_accepted_total Client connections accepted.\n# TYPE http_connections_accepted_total counter\n"
+                 "http_connections_accepted_total %d\n"
+                 "# HELP http_rejected_total Connections answered with a 503 because the queue was full.\n# TYPE http_rejected_total counter\n"
+                 "http_rejected_total %llu\n"
+                 "# HELP http_shed_total Connections answered with a 503 because they waited too long.\n# TYPE http_shed_total counter\n"
+                 "http_shed_total %llu\n",
+            atomic_load(&engine->active), atomic_load(&engine->accepted),
+            (unsigned long long)atomic_load(&engine->rejected),
+            (unsigned long long)(shedder != NULL ? codel_shed_count(shedder) : 0));
+    if (access_logger != NULL) {
+        access_log_stats access_stats;
+        access_log_get_stats(access_logger, &access_stats);
+        fprintf(out, "# HELP access_log_dropped_total Access log records lost to a full ring or a failed write.\n"
+                     "# TYPE access_log_dropped_total counter\n"
+                     "access_log_dropped_total %llu\n", (unsigned long long)access_stats.dropped);
+    }
+    write_cache_metrics(out);
+    if (fclose(out) != 0) {
+        perror("fclose");
+        free(body);
+        send_response(conn, 500, NULL, NULL);
+        return;
+    }
+
+    char entity[128];
+    int entity_len = snprintf(entity, sizeof(entity),
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Cache-Control: no-store\r\n"
+                              "\r\n",
+                              body_size);
+    size_t header_size;
+    char* response = response_head(conn->http11, !conn->close_after, entity_len, &header_size);
+    if (response == NULL) {
+        free(body);
+        conn->close_after = true;
+        return;
+    }
+    memcpy(response + header_size, entity, entity_len + 1);
+    header_size += entity_len;
+    count_response(conn, 200);
+    queue_data(conn, response, header_size, free, response);
+    queue_data(conn, body, body_size, free, body);
+}
+
+// answer the request at the start of request, parsed by parser.
+static void handle_request(connection* conn, const char* request, const http_parser* parser) {
+    conn->requests++;
+    conn->http11 = false;
+    DEBUG_PRINT("%.*s %.*s\n", (int)parser->method.len, request + parser->method.off,
+                (int)parser->target.len, request + parser->target.off);
+
+    // room for the index.html that resolve_path appends to directories
+    char path[MAX_FIRST_LINE + sizeof("index.html")];
+
+    const int check_req = check_bad_request(request, parser, path, sizeof(path) - sizeof("index.html") + 1);
     DEBUG_PRINT("PATH: %s\n", path);
 
+    // the framing of a bad request can't be trusted, close after answering
     if (check_req== 400) {
-        send_response(*client_sock, "400 Bad Request", 400, path);
-        goto end;
+        conn->close_after = true;
+        send_response(conn, 400, NULL, NULL);
+        return;
     }
+    conn->http11 = http_slice_equals(request, parser->version, "HTTP/1.1");
     if (check_req == 501) {
-        send_response(*client_sock, "501 Not supported", 501, path);
-        goto end;
+        conn->close_after = true;
+        send_response(conn, 501, NULL, NULL);
+        return;
+    }
+
+    if (!wants_keep_alive(request, parser) || conn->requests >= conn->loop->engine->max_keepalive_requests)
+        conn->close_after = true;
+
+    // the metrics path is reserved, it never reaches the files
+    if (metrics_path != NULL && strcmp(path, metrics_path) == 0) {
+        send_metrics(conn);
+        return;
     }
 
-    const int checked_path = check_path(path);
+    file_entry* entry = file_cache_lookup(cache, path);
+    if (entry == NULL) {
+        send_response(conn, 500, NULL, NULL);
+        return;
+    }
+    const int checked_path = entry->status;
+    strcpy(path, entry->resolved);
 
     if (checked_path == 404) {
-        send_response(*client_sock, "404 Not Found", 404, path);
+        send_response(conn, 404, path, NULL);
     }
 
     else if (checked_path == 302) {
-        send_response(*client_sock, "302 Found", 302, path);
+        send_response(conn, 302, path, NULL);
     }
 
     else if (checked_path == 403) {
-        send_response(*client_sock, "403 Forbidden", 403, path);
+        send_response(conn, 403, path, NULL);
     }
 
     else if (checked_path == 200) {
-        send_response(*client_sock, "200 OK", 200, path);
+        // the precompressed sibling is a representation of its own, with its own validators and ranges
+        file_entry* chosen = entry;
+        bool gzip = false;
+        if (entry->vary || compresses_on_the_fly(entry)) {
+            int weights[NUM_ENCODINGS];
+            int identity_weight;
+            accepted_encodings(request, parser, weights, &identity_weight);
+            chosen = negotiate_encoding(entry, weights, identity_weight);
+            gzip = chosen == entry && compresses_on_the_fly(entry) &&
+                   weights[ENCODING_GZIP] > 0 && weights[ENCODING_GZIP] >= identity_weight;
+        }
+        byte_range ranges[MAX_RANGES];
+        int num_ranges;
+        if (gzip && send_compressed(conn, request, parser, path, entry))
+            ;
+        else if (!chosen->is_dir && is_not_modified(request, parser, chosen->etag, chosen->mtime))
+            send_response(conn, 304, path, chosen);
+        else if ((num_ranges = requested_ranges(request, parser, chosen, ranges)) >= 0)
+            send_ranges(conn, chosen, ranges, num_ranges);
+        else
+            send_response(conn, 200, path, chosen);
     }
 
-    end:
-    DEBUG_PRINT("CLOSING SOCKET: %d\n", *client_sock);
-    close(*client_sock);
-    free(arg);
-    return 0;
+    else {
+        send_response(conn, 500, NULL, NULL);
+    }
+    file_cache_release(entry);
 }
 
-// check what status code based on path
-int check_path(char *path) {
-    struct stat stat_buf;
-
-    DEBUG_PRINT("PATH IN CHECK PATH %s\n", path);
+// answer an overloaded connection with a 503 and close it. the engine calls this on the
+// loop thread when the pool's queue is full, handle_client when the request waited too long.
+int reject_client(void* arg) {
+    connection* conn = (connection*)arg;
+    size_t len;
+    int first_seg = conn->out_count;
+    uint64_t now = monotonic_ns();
+    conn->close_after = true;
+    // not conn->http11: on the loop thread it still holds the previous request's version
+    bool http11 = http_parse_done(&conn->parser) && http_slice_equals(conn->in, conn->parser.version, "HTTP/1.1");
+    char* response = service_unavailable_response(retry_after, http11, false, &len);
+    if (response != NULL) {
+        count_response(conn, 503);
+        queue_data(conn, response, len, free, response);
+    }
+    if (access_logger != NULL)
+        log_access(conn, conn->in, &conn->parser, first_seg, now - conn->dispatched_at, now);
+    return 0;
+}
 
-    if (strlen(path) == 1 && *path == '/')
-        stat(".", &stat_buf);
-    else {
-        if (!does_file_exist(path, &stat_buf)) {
-            return 404;
+// handle the requests buffered in the connection, in order.
+int handle_client(void* arg) {
+    connection* conn = (connection*)arg;
+    DEBUG_PRINT("socket = %d\n", conn->fd);
+    size_t consumed = 0;
+    uint64_t started = monotonic_ns();
+    uint64_t queued = started - conn->dispatched_at;
+    metrics_record_queue_wait(queued);
+
+    // a standing queue: shed instead of adding to it
+    if (shedder != NULL) {
+        if (codel_should_shed(shedder, queued, started)) {
+            reject_client(conn);
+            complete_connection(conn);
+            return 0;
         }
     }
 
-    if (S_ISDIR(stat_buf.st_mode)) {
-
-        if (path[strlen(path) - 1] != '/')
-            return 302;
-
-        const int check_index_html = is_index_html_in_directory(path);
-
-        if (check_index_html < 0)
-            return 500;
-
-        if (check_index_html == 1) {
-            strcat(path, "index.html");
-            stat(path+1, &stat_buf);
-            if (!(stat_buf.st_mode & S_IROTH) || !(stat_buf.st_mode & S_IRUSR) || !(stat_buf.st_mode & S_IRGRP))
-                return 403;
-            if (check_permission(path))
-                return 200;
-            return 403;
+    // most responses need two output segments, headers and file
+    while (!conn->close_after && conn->out_count + 2 <= CONN_MAX_SEGS) {
+        char* request = conn->in + consumed;
+        size_t available = conn->in_len - consumed;
+        int first_seg = conn->out_count;
+        uint64_t request_start = access_logger != NULL ? monotonic_ns() : 0;
+        // the first request was parsed by the loop as it arrived, this only resumes
+        http_parse_status status = http_parse(&conn->parser, request, available);
+
+        if (status == HTTP_PARSE_AGAIN) {
+            if (consumed > 0)
+                break;
+            if (conn->in_len == sizeof(conn->in) - 1)
+                // headers larger than the buffer
+                status = HTTP_PARSE_ERROR;
+            else {
+                // the client shut down after a request without the final empty line
+                status = http_parse_eof(&conn->parser, available);
+                conn->close_after = true;
+            }
+        }
+        if (status == HTTP_PARSE_ERROR) {
+            conn->close_after = true;
+            send_response(conn, 400, NULL, NULL);
+            if (access_logger != NULL)
+                log_access(conn, request, &conn->parser, first_seg, queued, request_start);
+            consumed = conn->in_len;
+            break;
         }
-        if (check_permission(path))
-            return 200;
 
-        return 403;
+        // a multipart response waits until the responses before it were sent
+        if (status == HTTP_PARSE_DONE && consumed > 0 &&
+            conn->out_count + response_segments(request, &conn->parser) > CONN_MAX_SEGS)
+            break;
+
+        // a body is skipped, the bytes after it are the next request. one that can't be
+        // delimited ends the pipeline: what follows it could be taken for a request.
+        long long body = status == HTTP_PARSE_DONE ? http_body_length(&conn->parser, request) : 0;
+        if (body == HTTP_BODY_INVALID) {
+            conn->http11 = false;
+            conn->close_after = true;
+            send_response(conn, 400, NULL, NULL);
+        }
+        else {
+            if (body == HTTP_BODY_UNFRAMED)
+                conn->close_after = true;
+            handle_request(conn, request, &conn->parser);
+        }
+        if (access_logger != NULL)
+            log_access(conn, request, &conn->parser, first_seg, queued, request_start);
+        consumed += conn->parser.pos;
+        if (body > 0) {
+            size_t skip = (unsigned long long) body < conn->in_len - consumed ? (size_t) body : conn->in_len - consumed;
+            consumed += skip;
+            conn->body_left = body - skip;
+        }
+        http_parser_init(&conn->parser);
     }
 
-    if (!S_ISREG(stat_buf.st_mode) || !(stat_buf.st_mode & S_IROTH) || !(stat_buf.st_mode & S_IRUSR) || !(stat_buf.st_mode & S_IRGRP) || !check_permission(path))
-        return 403;
+    // keep the pipelined requests that were not answered yet. the parser's
+    // slices are relative to the request, so a partly parsed one moves with it.
+    memmove(conn->in, conn->in + consumed, conn->in_len - consumed + 1);
+    conn->in_len -= consumed;
 
-    return 200;
+    metrics_record_service(monotonic_ns() - started);
+    complete_connection(conn);
+    return 0;
 }
 
-// check if request is a bad request. return 400 on bad request, 501 on not GET method and 0 if good.
-int check_bad_request(const char *request, char **path) {
-    if (request == NULL) {
-        return 400;
+// check if the connection should stay open after the response
+bool wants_keep_alive(const char* request, const http_parser* parser) {
+    bool keep_alive = http_slice_equals(request, parser->version, "HTTP/1.1");
+    size_t len;
+    const char* value = http_find_header(parser, request, "Connection", &len);
+    if (value == NULL)
+        return keep_alive;
+
+    // comma separated list of tokens
+    const char* value_end = value + len;
+    while (value < value_end) {
+        const char* token_end = memchr(value, ',', value_end - value);
+        if (token_end == NULL)
+            token_end = value_end;
+        const char* token = value;
+        const char* token_last = token_end;
+        while (token < token_last && (*token == ' ' || *token == '\t'))
+            token++;
+        while (token_last > token && (token_last[-1] == ' ' || token_last[-1] == '\t'))
+            token_last--;
+        size_t token_len = token_last - token;
+        if (token_len == 5 && strncasecmp(token, "close", 5) == 0)
+            return false;
+        if (token_len == 10 && strncasecmp(token, "keep-alive", 10) == 0)
+            keep_alive = true;
+        value = token_end + 1;
     }
-    char buffer[MAX_FIRST_LINE];
-    strncpy(buffer, request, sizeof(buffer) - 1);
-    buffer[sizeof(buffer) - 1] = '\0';
-
-    char *method = strtok(buffer, " ");
-    char *found_path = strtok(NULL, " ");
-    char *protocol = strtok(NULL, " ");
-    char *extra = strtok(NULL, " ");
+    return keep_alive;
+}
 
-    if (method == NULL || found_path == NULL || protocol == NULL || extra != NULL) {
+// check if request is a bad request. return 400 on bad request, 501 on not GET method and 0 if good.
+int check_bad_request(const char *request, const http_parser *parser, char *path, size_t path_size) {
+    if (request == NULL || parser->method.len == 0 || parser->target.len == 0 || parser->version.len == 0) {
         return 400;
     }
 
-    if (!isValidHttpVersion(protocol)) {
+    if (!isValidHttpVersion(request + parser->version.off, parser->version.len)) {
         return 400;
     }
 
-    if (strcmp(method, "GET") != 0) {
+    if (!http_slice_equals(request, parser->method, "GET")) {
         return 501;
     }
 
-    *path = found_path;
+    // only origin-form targets name a file, and the resolver takes them relative to the root
+    if (parser->target.len >= path_size || request[parser->target.off] != '/') {
+        return 400;
+    }
+    memcpy(path, request + parser->target.off, parser->target.len);
+    path[parser->target.len] = '\0';
 
     return 0;
 }
 
-// send response to client
-void send_response(const int client_sock, char* status, const int status_code, char* path) {
+// segment release of a cached file body
+static void release_entry(void* entry) {
+    file_cache_release((file_entry*)entry);
+}
+
+// segment release of a file served from memory
+static void release_blob(void* blob) {
+    content_cache_release((content_blob*)blob);
+}
+
+// queue a 200 response from the content cache. returns false if the file is not cached.
+static bool send_cached_file(connection* conn, file_entry* entry) {
+    size_t head_size;
+    content_blob* blob = content_cache_lookup(body_cache, entry);
+    if (blob == NULL)
+        return false;
+    char* head = response_head(conn->http11, !conn->close_after, 0, &head_size);
+    if (head == NULL) {
+        content_cache_release(blob);
+        return false;
+    }
+    queue_data(conn, head, head_size, free, head);
+    queue_data(conn, blob->data, blob->len, release_blob, blob);
+    return true;
+}
+
+// segment release of a cached directory listing
+static void release_listing(void* listing) {
+    dir_cache_release((dir_listing*)listing);
+}
+
+// queue the response on the connection. the event loop sends it.
+// error and redirect responses are rendered at startup and sent as one segment.
+// a 200 response has a headers and a body segment, written together with one sendmsg.
+// a 304 response is its head and the validators of the file, without a body.
+// entry is the cached metadata of path for 200 and 304 responses, NULL otherwise.
+void send_response(connection* conn, const int status_code, char* path, file_entry* entry) {
     size_t body_size;
-    size_t total_size;
-    char* response;
-    char* body = get_response_body(status_code, path, &body_size);
-    if (status_code == 200 && !is_directory(path))
-        response = create_response(status, status_code, path, NULL, body_size, &total_size);
-    else
-        response = create_response(status, status_code, path, body, body_size, &total_size);
-    if (response == NULL)
-        send_response(client_sock, "500 Internal Server Error", 500, NULL);
-    DEBUG_PRINT("%d\n", (int)total_size);
+    size_t header_size;
+    char* body = NULL;
+    DEBUG_PRINT("%d %s\n", status_code, path != NULL ? path : "");
+    if (status_code == 500)
+        conn->close_after = true;
+
+    if (status_code == 304) {
+        char validators[256];
+        int validators_len = format_representation_headers(validators, sizeof(validators), entry);
+        queue_not_modified(conn, validators, validators_len);
+        return;
+    }
+
+    if (status_code != 200) {
+        char* response = status_code == 302 ? redirect_response(path, conn->http11, !conn->close_after, &header_size)
+                                            : fixed_response(status_code, conn->http11, !conn->close_after, &header_size);
+        if (response == NULL) {
+            conn->close_after = true;
+            return;
+        }
+        count_response(conn, status_code);
+        queue_data(conn, response, header_size, free, response);
+        return;
+    }
+
+    bool is_file = !entry->is_dir;
+    if (is_file && body_cache != NULL && send_cached_file(conn, entry)) {
+        count_response(conn, 200);
+        return;
+    }
+    dir_listing* listing = NULL;
+    if (is_file)
+        body_size = entry->size;
+    else if (listing_cache != NULL) {
+        listing = dir_cache_lookup(listing_cache, path, entry->fd);
+        if (listing == NULL) {
+            send_response(conn, 500, NULL, NULL);
+            return;
+        }
+        body_size = listing->len;
+    }
+    else {
+        body = render_directory_listing(path, entry->fd, &body_size);
+        if (body == NULL) {
+            send_response(conn, 500, NULL, NULL);
+            return;
+        }
+    }
+    char* response = create_response(entry, body_size, conn->http11, !conn->close_after, &header_size);
+    if (response == NULL) {
+        free(body);
+        dir_cache_release(listing);
+        send_response(conn, 500, NULL, NULL);
+        return;
+    }
+    DEBUG_PRINT("%d\n", (int)header_size);
     DEBUG_PRINT("bytes: %zu\n", body_size);
-    send(client_sock, response, total_size, 0);
-    if (status_code == 200 && !is_directory(path)) {
-        if (send_file_to_socket(path + 1, client_sock) == -1)
-            send_response(client_sock, "500 Internal Server Error", 500, NULL);
+    // handle_client keeps room for both segments
+    count_response(conn, 200);
+    queue_data(conn, response, header_size, free, response);
+    if (is_file) {
+        // the segment holds its own reference to the cached descriptor
+        file_cache_retain(entry);
+        queue_file(conn, entry->fd, 0, entry->size, release_entry, entry);
     }
+    else if (listing != NULL)
+        queue_data(conn, listing->data, listing->len, release_listing, listing);
     else
-        free(body);
-    free(response);
+        queue_data(conn, body, body_size, free, body);
+}
+
+// a boundary of multipart/byteranges responses. it only has to be unlikely in the files,
+// so it mixes a per-process seed and a counter.
+static void make_boundary(char* buf, size_t size) {
+    static atomic_ullong counter;
+    unsigned long long x = atomic_fetch_add_explicit(&counter, 1, memory_order_relaxed) + (unsigned long long)getpid() * 0x9e3779b97f4a7c15ULL;
+    // splitmix64
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    snprintf(buf, size, "%016llx%08llx", x, (unsigned long long)time(NULL) & 0xffffffffULL);
+}
+
+// queue a 206 response with the ranges of the file, or a 416 if there are none.
+// one range is the body of the response; several are the parts of a multipart/byteranges
+// body, whose part headers are rendered into one buffer that the file ranges are sent between.
+// every range is sent from the cached descriptor at its offset, so it stays zero-copy.
+void send_ranges(connection* conn, file_entry* entry, const byte_range* ranges, int num_ranges) {
+    size_t header_size;
+    long long size = (long long)entry->size;
+    if (num_ranges == 0) {
+        char* response = range_not_satisfiable_response(size, conn->http11, !conn->close_after, &header_size);
+        if (response == NULL) {
+            conn->close_after = true;
+            return;
+        }
+        count_response(conn, 416);
+        queue_data(conn, response, header_size, free, response);
+        return;
+    }
+
+    char validators[256];
+    format_representation_headers(validators, sizeof(validators), entry);
+    char entity[1024];
+    int entity_len;
+    if (num_ranges == 1) {
+        entity_len = snprintf(
+            entity, sizeof(entity),
+            "%s%s%s"
+            "Content-Range: bytes %lld-%lld/%lld\r\n"
+            "Content-Length: %lld\r\n"
+            "%s"
+            "\r\n",
+            entry->mime != NULL ? "Content-Type: " : "", entry->mime != NULL ? entry->mime : "", entry->mime != NULL ? "\r\n" : "",
+            (long long)ranges[0].first, (long long)ranges[0].last, size,
+            (long long)(ranges[0].last - ranges[0].first + 1), validators);
+        char* response = partial_content_head(conn->http11, !conn->close_after, entity_len, &header_size);
+        if (response == NULL) {
+            conn->close_after = true;
+            return;
+        }
+        memcpy(response + header_size, entity, entity_len + 1);
+        header_size += entity_len;
+        count_response(conn, 206);
+        queue_data(conn, response, header_size, free, response);
+        file_cache_retain(entry);
+        queue_file(conn, entry->fd, ranges[0].first, ranges[0].last + 1, release_entry, entry);
+        return;
+    }
+
+    // the part headers, each after the CRLF that ends the part before it, and the closing boundary
+    char boundary[32];
+    make_boundary(boundary, sizeof(boundary));
+    char parts[MAX_RANGES + 1][256];
+    int part_len[MAX_RANGES + 1];
+    long long body_size = 0;
+    for (int i = 0; i < num_ranges; ++i) {
+        part_len[i] = snprintf(
+            parts[i], sizeof(parts[i]),
+            "%s--%s\r\n"
+            "%s%s%s"
+            "Content-Range: bytes %lld-%lld/%lld\r\n"
+            "\r\n",
+            i > 0 ? "\r\n" : "", boundary,
+            entry->mime != NULL ? "Content-Type: " : "", entry->mime != NULL ? entry->mime : "", entry->mime != NULL ? "\r\n" : "",
+            (long long)ranges[i].first, (long long)ranges[i].last, size);
+        body_size += part_len[i] + (ranges[i].last - ranges[i].first + 1);
+    }
+    part_len[num_ranges] = snprintf(parts[num_ranges], sizeof(parts[num_ranges]), "\r\n--%s--\r\n", boundary);
+    body_size += part_len[num_ranges];
+
+    entity_len = snprintf(
+        entity, sizeof(entity),
+        "Content-Type: multipart/byteranges; boundary=%s\r\n"
+        "Content-Length: %lld\r\n"
+        "%s"
+        "\r\n",
+        boundary, body_size, validators);
+    // the head, then the part headers after it in the same buffer
+    size_t parts_size = 0;
+    for (int i = 1; i <= num_ranges; ++i)
+        parts_size += part_len[i];
+    char* response = partial_content_head(conn->http11, !conn->close_after, entity_len + part_len[0] + parts_size, &header_size);
+    if (response == NULL) {
+        conn->close_after = true;
+        return;
+    }
+    memcpy(response + header_size, entity, entity_len);
+    header_size += entity_len;
+    memcpy(response + header_size, parts[0], part_len[0]);
+    header_size += part_len[0];
+    char* next_part = response + header_size;
+    for (int i = 1; i <= num_ranges; ++i) {
+        memcpy(next_part, parts[i], part_len[i]);
+        next_part += part_len[i];
+    }
+
+    // handle_client keeps room for every segment. the buffer is freed with the closing boundary, the last segment.
+    count_response(conn, 206);
+    queue_data(conn, response, header_size, NULL, NULL);
+    next_part = response + header_size;
+    for (int i = 0; i < num_ranges; ++i) {
+        file_cache_retain(entry);
+        queue_file(conn, entry->fd, ranges[i].first, ranges[i].last + 1, release_entry, entry);
+        bool last = i + 1 == num_ranges;
+        queue_data(conn, next_part, part_len[i + 1], last ? free : NULL, last ? response : NULL);
+        next_part += part_len[i + 1];
+    }
 }
 
 // check what type is a file
@@ -282,19 +1492,31 @@ char *get_mime_type(const char *name) {
     return NULL;
 }
 
-// create and return response
-char* create_response(char* status, const int status_code, char* path, char* body, size_t body_size, size_t* total_size) {
-    char time_buffer[128];
-    time_t now = time(NULL);
-    strftime(time_buffer, sizeof(time_buffer), RFC1123FMT, gmtime(&now));
+// format the headers that describe the representation of a file: its validators (ETag and
+// Last-Modified), the Content-Encoding of a precompressed sibling and the Vary of a file that has them
+int format_representation_headers(char* buf, size_t size, const file_entry* entry) {
+    return snprintf(
+        buf, size,
+        "%s%s%s"
+        "Last-Modified: %s\r\n"
+        "%s%s%s"
+        "%s",
+        entry->etag[0] != '\0' ? "ETag: " : "", entry->etag, entry->etag[0] != '\0' ? "\r\n" : "",
+        entry->last_modified,
+        entry->encoding != NULL ? "Content-Encoding: " : "", entry->encoding != NULL ? entry->encoding : "",
+        entry->encoding != NULL ? "\r\n" : "",
+        entry->vary || compresses_on_the_fly(entry) ? "Vary: Accept-Encoding\r\n" : "");
+}
 
+// format the headers that describe the body of a 200 response, and the empty line that ends the headers
+int format_entity_headers(char* buf, size_t size, const file_entry* entry, size_t body_size) {
     char content_type[512] = "";
     char* temp;
 
-    if ((status_code == 200 && is_directory(path)) || status_code != 200)
+    if (entry->is_dir)
         strcpy(content_type, "Content-Type: text/html\r\n");
     else {
-        temp = get_mime_type(path);
+        temp = (char*)entry->mime;
         if (temp != NULL) {
             strcpy(content_type, "Content-Type: ");
             strcat(content_type, temp);
@@ -302,83 +1524,40 @@ char* create_response(char* status, const int status_code, char* path, char* bod
         }
     }
 
-    char location_header[512] = "";
-    if (status_code == 302) {
-        snprintf(location_header, sizeof(location_header), "Location: %s/\r\n", path);
-    }
-
-    char mod_time[30];
-    char real_mod_time[40];
-    strcpy(real_mod_time, "\n");
-
-
-    DEBUG_PRINT("status code: %d, path: %s", status_code, path);
-
-    if (status_code == 200){
-
-        struct stat file_stat;
-        struct tm tm_time;
-
-        if (stat(path+1, &file_stat) == -1) {
-            perror("stat");
-            free(body);
-            return NULL;
-        }
-
-        gmtime_r(&file_stat.st_mtime, &tm_time);
-
-        strftime(mod_time, sizeof(mod_time), RFC1123FMT, &tm_time);
-        strcpy(real_mod_time, "last-modified: ");
-        strcat(real_mod_time, mod_time);
-        strcat(real_mod_time, "\n");
-    }
-
-    size_t response_size = snprintf(
-        NULL, 0,
-        "HTTP/1.0 %s\r\n"
-        "Server: webserver/1.0\r\n"
-        "Date: %s\r\n"
-        "%s"
+    char validators[256];
+    format_representation_headers(validators, sizeof(validators), entry);
+    return snprintf(
+        buf, size,
         "%s"
         "Content-Length: %zu\r\n"
         "%s"
-        "Connection: close\r\n"
+        "%s"
         "\r\n",
-        status, time_buffer, location_header, content_type, body_size, real_mod_time);
-
-    *total_size = response_size;
-    if (body != NULL)
-        *total_size += body_size;
+        content_type, body_size, entry->is_dir ? "" : "Accept-Ranges: bytes\r\n", validators);
+}
 
-    char* response = (char*)malloc(*total_size + 1);
+// render function of the content cache: the entity headers of a cached file
+int render_cached_headers(char* buf, size_t size, const file_entry* entry) {
+    return format_entity_headers(buf, size, entry, entry->size);
+}
 
-    if (!response) {
-        perror("malloc");
-        free(body);
+// create and return the headers of a 200 response: the prebuilt head and the entity headers
+char* create_response(const file_entry* entry, size_t body_size, bool http11, bool keep_alive, size_t* header_size) {
+    char entity[1024];
+    int entity_len = format_entity_headers(entity, sizeof(entity), entry, body_size);
+    if (entity_len < 0 || (size_t)entity_len >= sizeof(entity))
         return NULL;
-    }
-
-     snprintf(
-        response, *total_size + 1,
-        "HTTP/1.0 %s\r\n"
-        "Server: webserver/1.0\r\n"
-        "Date: %s\r\n"
-        "%s"
-        "%s"
-        "Content-Length: %zu\r\n"
-        "%s"
-        "Connection: close\r\n"
-        "\r\n",
-        status, time_buffer, location_header, content_type, body_size, real_mod_time);
-
-    if (body != NULL)
-        memcpy(response+response_size, body, body_size);
 
+    char* response = response_head(http11, keep_alive, entity_len, header_size);
+    if (!response)
+        return NULL;
+    memcpy(response + *header_size, entity, entity_len + 1);
+    *header_size += entity_len;
     return response;
 }
 
 // check if request uses valid http version
-bool isValidHttpVersion(const char *version) {
+bool isValidHttpVersion(const char *version, size_t len) {
     const char *validVersions[] = {
             "HTTP/1.0",
             "HTTP/1.1",
@@ -387,251 +1566,106 @@ bool isValidHttpVersion(const char *version) {
     };
     size_t numVersions = sizeof(validVersions) / sizeof(validVersions[0]);
     for (size_t i = 0; i < numVersions; ++i) {
-        if (strcmp(version, validVersions[i]) == 0) {
+        if (strlen(validVersions[i]) == len && memcmp(version, validVersions[i], len) == 0) {
             return true;
         }
     }
     return false;
 }
 
-// check if file exists.
-bool does_file_exist(const char *path, struct stat *stat_buf) {
-    DEBUG_PRINT("PATH IN DOES FILE %s\n", path+1);
-    return stat(path+1, stat_buf) == 0;
-}
-
-// check permission for all in path
-bool check_permission(const char *path) {
-    path++;
-    const size_t path_size = strlen(path) + 1;
-    char path_copy[path_size];
-    strncpy(path_copy, path, path_size);
-    path_copy[path_size - 1] = '\0';
-
-
-    char* current_path = path_copy;
-    char* directory = NULL;
-    struct stat dir_buf;
-
-    do {
-        directory = dirname(current_path);
-
-        if (stat(directory, &dir_buf) != 0 || !(dir_buf.st_mode & S_IXOTH))
+// a growing output buffer. its capacity doubles, so a listing of n rows costs O(log n) reallocs.
+typedef struct text_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+} text_buf;
+
+// append formatted text to the buffer. returns false if out of memory.
+static bool buf_printf(text_buf* buf, const char* format, ...) {
+    va_list args;
+    for (;;) {
+        va_start(args, format);
+        int needed = vsnprintf(buf->data + buf->len, buf->cap - buf->len, format, args);
+        va_end(args);
+        if (needed < 0)
             return false;
-
-        if (strcmp(directory, "/") != 0) {
-            current_path = directory;
+        if ((size_t)needed < buf->cap - buf->len) {
+            buf->len += needed;
+            return true;
         }
-    } while (strcmp(directory, ".") != 0);
-
-    DEBUG_PRINT("permission check passed\n");
-    return true;
-
-}
-
-// check if directory has file index.html
-int is_index_html_in_directory(char *directory_path) {
-    char copied_path[MAX_FIRST_LINE];
-    if (sprintf(copied_path, "%sindex.html", directory_path) < 0) {
-        perror("sprintf");
-        return -1;
+        size_t cap = buf->cap * 2;
+        while (cap <= buf->len + needed)
+            cap *= 2;
+        char* data = realloc(buf->data, cap);
+        if (!data) {
+            perror("realloc");
+            return false;
+        }
+        buf->data = data;
+        buf->cap = cap;
     }
-    DEBUG_PRINT("find_index_html: path: %s\n", copied_path);
-    struct stat file_stat;
-    return does_file_exist(copied_path, &file_stat) ? 1 : 0;
 }
 
-// returns response body
-char* get_response_body(int status_code, char* path, size_t* bytes_read) {
-    char* body;
-    DEBUG_PRINT("%d %s\n", status_code, path);
-
-    // directory listing
-    if (status_code == 200 && is_directory(path)) {
-        DIR* dir;
-        struct dirent* entry;
-        struct stat file_stat;
-        char* html_template = "<HTML>\r\n<HEAD><TITLE>Index of %s</TITLE></HEAD>\n\n<BODY>\r\n<H4>Index of %s</H4>\r\n<table CELLSPACING=8>\r\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\r\n";
-        char* footer = "</table>\r\n<HR>\r\n<ADDRESS>webserver/1.0</ADDRESS>\r\n</BODY></HTML>\r\n";
-
-        size_t body_size = 0;
-        size_t template_size = snprintf(NULL, 0, html_template, path, path) + 1;
-
-        body = (char*)malloc(template_size);
-        if (!body) {
-            perror("malloc");
-            return NULL;
-        }
+// render the html listing of the directory dir_fd at the request path
+char* render_directory_listing(const char* path, int dir_fd, size_t* len) {
+    DIR* dir;
+    struct dirent* entry;
+    struct stat file_stat;
+    text_buf buf = { .data = malloc(4096), .len = 0, .cap = 4096 };
+    if (!buf.data) {
+        perror("malloc");
+        return NULL;
+    }
 
-        snprintf(body, template_size, html_template, path, path);
-        body_size = strlen(body);
-        bool is_cwd = strlen(path) == 1 && *path == '/';
-        path++;
-        DEBUG_PRINT("path in dir listing: %s\n", path);
+    buf_printf(&buf, "<HTML>\r\n<HEAD><TITLE>Index of %s</TITLE></HEAD>\n\n<BODY>\r\n<H4>Index of %s</H4>\r\n<table CELLSPACING=8>\r\n<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\r\n", path, path);
+    DEBUG_PRINT("path in dir listing: %s\n", path + 1);
+
+    // the directory the path resolved to, whatever the path names now
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        perror("opendir");
+        if (fd >= 0)
+            close(fd);
+        free(buf.data);
+        return NULL;
+    }
 
-        if (is_cwd)
-        {
-            dir = opendir(".");
-            strcpy(path, "");
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
         }
-        else
-            dir = opendir(path);
 
-        if (!dir) {
-            perror("opendir");
-            free(body);
-            return NULL;
+        // relative to the open directory, no path to build
+        if (fstatat(dirfd(dir), entry->d_name, &file_stat, 0) == -1) {
+            perror("stat");
+            continue;
         }
 
-        while ((entry = readdir(dir)) != NULL) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-
-            size_t filepath_len = strlen(path) + strlen(entry->d_name) + 2;
-            char* filepath = malloc(filepath_len);
-            if (!filepath) {
-                perror("malloc");
-                closedir(dir);
-                free(body);
-                return NULL;
-            }
-
-
-            snprintf(filepath, filepath_len, "%s%s", path, entry->d_name);
-            if (stat(filepath, &file_stat) == -1) {
-                perror("stat");
-                free(filepath);
-                continue;
-            }
-
-            char mod_time[30];
-            strftime(mod_time, sizeof(mod_time), RFC1123FMT, gmtime(&file_stat.st_mtime));
-
-            char* row_template = "<tr><td><A HREF=\"%s%s\">%s%s</A></td><td>%s</td><td>%s</td>\r\n</tr>\r\n\r\n";
-            char size_str[32] = "";
-
-            if (S_ISDIR(file_stat.st_mode)) {
-                size_str[0] = '\0';
-            } else {
-                snprintf(size_str, sizeof(size_str), "%ld", file_stat.st_size);
-            }
-
-            size_t row_size = snprintf(NULL, 0, row_template, entry->d_name, S_ISDIR(file_stat.st_mode) ? "/" : "", entry->d_name, S_ISDIR(file_stat.st_mode) ? "/" : "", mod_time, size_str) + 1;
-            body = realloc(body, body_size + row_size);
-            if (!body) {
-                perror("realloc");
-                free(filepath);
-                closedir(dir);
-                return NULL;
-            }
-
-            snprintf(body + body_size, row_size, row_template, entry->d_name, S_ISDIR(file_stat.st_mode) ? "/" : "", entry->d_name, S_ISDIR(file_stat.st_mode) ? "/" : "", mod_time, size_str);
-            body_size += row_size - 1;
-
-            free(filepath);
-        }
+        char mod_time[30];
+        struct tm tm_time;
+        strftime(mod_time, sizeof(mod_time), RFC1123FMT, gmtime_r(&file_stat.st_mtime, &tm_time));
 
-        if (is_cwd)
-            strcpy(path, "/");
-        closedir(dir);
+        char size_str[32] = "";
+        const char* slash = S_ISDIR(file_stat.st_mode) ? "/" : "";
+        if (!S_ISDIR(file_stat.st_mode))
+            snprintf(size_str, sizeof(size_str), "%ld", file_stat.st_size);
 
-        size_t footer_size = strlen(footer);
-        body = realloc(body, body_size + footer_size + 1);
-        if (!body) {
-            perror("realloc");
+        if (!buf_printf(&buf, "<tr><td><A HREF=\"%s%s\">%s%s</A></td><td>%s</td><td>%s</td>\r\n</tr>\r\n\r\n",
+                        entry->d_name, slash, entry->d_name, slash, mod_time, size_str)) {
+            closedir(dir);
+            free(buf.data);
             return NULL;
         }
-
-        strcat(body, footer);
-        *bytes_read = body_size + footer_size;
     }
+    closedir(dir);
 
-    // file
-    else if (status_code == 200) {
-        path++;
-        FILE *file = fopen(path, "rb");
-        if (!file) {
-            perror("open file");
-            *bytes_read = 0;
-            return NULL;
-        }
-
-        fseek(file, 0, SEEK_END);
-        *bytes_read = ftell(file);
-
-        rewind(file);
-
-        fclose(file);
-
-        return "";
+    if (!buf_printf(&buf, "</table>\r\n<HR>\r\n<ADDRESS>webserver/1.0</ADDRESS>\r\n</BODY></HTML>\r\n")) {
+        free(buf.data);
+        return NULL;
     }
-
-    // errors
-    else {
-        if (status_code == 302) {
-            body = (char*)malloc(125);
-            snprintf(
-                body, 125,
-                "<HTML><HEAD><TITLE>302 Found</TITLE></HEAD>\r\n"
-                    "<BODY><H4>302 Found</H4>\r\n"
-                    "Directories must end with a slash.\r\n"
-                    "</BODY></HTML>\r\n");
-            *bytes_read = 125;
-        }
-        if (status_code == 400) {
-            body = (char*)malloc(114);
-            snprintf(
-                body, 114,
-                "<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\r\n"
-                    "<BODY><H4>400 Bad request</H4>\r\n"
-                    "Bad Request.\r\n"
-                    "</BODY></HTML>\r\n");
-            *bytes_read = 114;
-        }
-        if (status_code == 403) {
-            body = (char*)malloc(112);
-            snprintf(
-                body, 112,
-                "<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\r\n"
-                    "<BODY><H4>403 Forbidden</H4>\r\n"
-                    "Access denied.\r\n"
-                    "</BODY></HTML>\r\n");
-            *bytes_read = 109;
-        }
-        if (status_code == 404) {
-            body = (char*)malloc(113);
-            snprintf(
-                body, 113,
-                "<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\r\n"
-                    "<BODY><H4>404 Not Found</H4>\r\n"
-                    "File not found.\r\n"
-                    "</BODY></HTML>\r\n");
-            *bytes_read = 113;
-        }
-        if (status_code == 500) {
-            body = (char*)malloc(145);
-            snprintf(
-                body, 145,
-                "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\r\n"
-                    "<BODY><H4>500 Internal Server Error</H4>\r\n"
-                    "Some server side error.\r\n"
-                    "</BODY></HTML>\r\n");
-            *bytes_read = 145;
-        }
-        if (status_code == 501) {
-            body = (char*)malloc(130);
-            snprintf(
-                body, 130,
-                "<HTML><HEAD><TITLE>501 Not supported</TITLE></HEAD>\r\n"
-                    "<BODY><H4>501 Not supported</H4>\r\n"
-                    "Method is not supported.\r\n"
-                    "</BODY></HTML>\r\n");
-            *bytes_read = 130;
-        }
-    }
-
-    return body;
+    *len = buf.len;
+    return buf.data;
 }
 
 // check if path end in directory
@@ -639,42 +1673,132 @@ bool is_directory(const char* path) {
     return path[strlen(path) - 1] == '/';
 }
 
-// send file contents to client
-int send_file_to_socket(const char *path, int client_socket) {
-    int file_descriptor = open(path, O_RDONLY);
-    if (file_descriptor < 0) {
-        perror("Failed to open file");
-        return -1;
+void set_sendfile_chunk(size_t chunk) {
+    sendfile_chunk = chunk;
+}
+
+// bytes of the segment that the next call may move
+static size_t next_chunk(const out_seg* seg) {
+    if ((off_t)sendfile_chunk < seg->end - seg->off)
+        return sendfile_chunk;
+    return seg->end - seg->off;
+}
+
+// send file segment with sendfile. returns 1 done, 0 would block, -1 error, 2 not supported
+static int sendfile_segment(out_seg* seg, int client_socket) {
+    while (seg->off < seg->end) {
+        ssize_t bytes_sent = sendfile(client_socket, seg->fd, &seg->off, next_chunk(seg));
+        if (bytes_sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+                return 2;
+            perror("sendfile");
+            return -1;
+        }
+        // the file shrank after the headers were built
+        if (bytes_sent == 0)
+            return -1;
     }
+    return 1;
+}
 
-    char buffer[MAX_FIRST_LINE] = {0};
-    ssize_t bytes_read;
-    ssize_t bytes_total = 0;
-
-    while ((bytes_read = read(file_descriptor, buffer, sizeof(buffer))) > 0) {
-        ssize_t total_written = 0;
-        while (total_written < bytes_read) {
-            ssize_t bytes_written = write(client_socket, buffer + total_written, bytes_read - total_written);
-            if (bytes_written < 0) {
-                perror("Failed to send data to socket");
-                close(file_descriptor);
+// send file segment with splice through a pipe. returns like sendfile_segment
+static int splice_segment(out_seg* seg, int client_socket) {
+    if (seg->pipe_fds[0] < 0 && pipe2(seg->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        return 2;
+    }
+    while (seg->off < seg->end || seg->piped > 0) {
+        if (seg->piped == 0) {
+            ssize_t bytes_in = splice(seg->fd, &seg->off, seg->pipe_fds[1], NULL, next_chunk(seg), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytes_in < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+                    return 2;
+                perror("splice");
                 return -1;
             }
-            total_written += bytes_written;
+            if (bytes_in == 0)
+                return -1;
+            seg->piped = bytes_in;
+        }
+        ssize_t bytes_out = splice(seg->pipe_fds[0], NULL, client_socket, NULL, seg->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (bytes_out < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("splice");
+            return -1;
         }
-        bytes_total += total_written;
+        seg->piped -= bytes_out;
     }
-    DEBUG_PRINT("total: %zu\n", bytes_total);
+    return 1;
+}
 
-    if (bytes_read < 0) {
-        perror("Failed to read from file");
-        close(file_descriptor);
-        return -1;
-    }
+// send file segment through a user space buffer
+static int copy_segment(out_seg* seg, int client_socket) {
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t bytes_read;
 
-    close(file_descriptor);
-    return 0;
-}
+    while (seg->off < seg->end) {
+        size_t want = sizeof(buffer);
+        if ((off_t)want > seg->end - seg->off)
+            want = seg->end - seg->off;
+        bytes_read = pread(seg->fd, buffer, want, seg->off);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read from file");
+            return -1;
+        }
+        // the file shrank after the headers were built
+        if (bytes_read == 0)
+            return -1;
 
+        ssize_t bytes_written = send(client_socket, buffer, bytes_read, MSG_NOSIGNAL);
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("Failed to send data to socket");
+            return -1;
+        }
+        seg->off += bytes_written;
+    }
+    return 1;
+}
 
+// send file segment with the first method the kernel supports
+static int write_file_segment(out_seg* seg, int client_socket) {
+    int sent;
+    if (seg->mode == SEND_SENDFILE) {
+        sent = sendfile_segment(seg, client_socket);
+        if (sent != 2)
+            return sent;
+        DEBUG_PRINT("sendfile not supported, trying splice\n");
+        seg->mode = SEND_SPLICE;
+    }
+    if (seg->mode == SEND_SPLICE) {
+        sent = splice_segment(seg, client_socket);
+        if (sent != 2)
+            return sent;
+        DEBUG_PRINT("splice not supported, copying\n");
+        seg->mode = SEND_COPY;
+    }
+    return copy_segment(seg, client_socket);
+}
 
+// send file contents to client
+int send_file_to_socket(out_seg* seg, int client_socket) {
+    // bytes still in the splice pipe were read from the file but not sent yet
+    off_t before = seg->off - seg->piped;
+    int sent = write_file_segment(seg, client_socket);
+    metrics_add_bytes_sent(seg->off - seg->piped - before);
+    return sent;
+}
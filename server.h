@@ -0,0 +1,125 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "event_loop.h"
+#include "file_cache.h"
+#include "access_log.h"
+
+/**
+ * server.h
+ *
+ * This file declares the request handling functions of the
+ * server, shared between server.c and the event loop.
+ */
+
+#define DEBUG 0
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+
+#if DEBUG
+#define DEBUG_PRINT(fmt, ...) \
+        fprintf(stderr, "DEBUG: " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(fmt, ...) \
+        do { } while (0)
+#endif
+
+#define MAX_RANGES 8            //ranges of one request served, a Range with more is ignored
+
+/**
+ * a range of a file, first and last byte included
+ */
+typedef struct byte_range {
+    off_t first;
+    off_t last;
+} byte_range;
+
+/**
+ * runtime configuration of the server.
+ * the first four fields come from the positional arguments,
+ * the rest from optional --name=value flags.
+ */
+typedef struct server_config {
+    int port;
+    int pool_size;          //threads of the pools at most
+    int min_threads;        //threads the pools keep, the pools grow from it up to pool-size
+    int grow_threshold;     //queued jobs at which a pool starts another thread
+    int thread_idle_timeout; //milliseconds a surplus thread waits for a job before it exits
+    size_t thread_stack_size; //0 keeps the default
+    int max_queue_size;
+    int max_requests;       //number of connections to accept before shutting down
+    int num_loops;          //number of event-loop threads
+    int keepalive_timeout;  //idle seconds before a persistent connection is closed
+    int max_keepalive_requests; //requests per connection
+    size_t sendfile_chunk;  //max bytes per sendfile/splice call
+    int file_cache_entries; //capacity of the path metadata cache
+    int file_cache_ttl;     //seconds a cached path is trusted
+    size_t content_cache_bytes; //memory budget of the small file cache, 0 disables it
+    size_t content_cache_max_file; //largest file held in memory
+    int dir_cache_entries;  //rendered directory listings kept, 0 disables the cache
+    size_t gzip_cache_bytes; //memory budget of the compressed output, 0 disables compression on the fly
+    size_t gzip_min_size;   //smaller responses are not compressed
+    queue_kind queue;       //job queue backend of the threadpool
+    int listeners;          //listening sockets, more than one share the port with SO_REUSEPORT
+    int backlog;            //listen backlog of each socket
+    int pools;              //threadpools the pool-size threads are split into, loop i uses pool i % pools
+    io_backend io;          //how the loops do their socket and file I/O
+    int retry_after;        //seconds a 503 asks the client to wait
+    int codel_target;       //milliseconds of queue delay before shedding, 0 disables it
+    int codel_interval;     //milliseconds the delay must stay above the target
+    const char* metrics_path; //request path answered with the metrics, NULL disables it
+    const char* access_log_path; //NULL disables the access log
+    size_t access_log_max_bytes; //size at which the log is rotated, 0 never rotates it
+    access_log_format access_log_format;
+} server_config;
+
+/**
+ * handle_client is the threadpool routine of the server.
+ * it parses the requests buffered in the connection (arg), runs
+ * the blocking filesystem checks and queues a response for each
+ * complete request, in order. the connection is handed back to
+ * its event loop with complete_connection.
+ */
+int handle_client(void* arg);
+
+/**
+ * reject_client queues a 503 with a Retry-After on the connection
+ * (arg) and marks it to be closed. the event loop calls it when the
+ * pool has no room for the connection.
+ */
+int reject_client(void* arg);
+
+int check_bad_request(const char *request, const http_parser *parser, char *path, size_t path_size);
+bool isValidHttpVersion(const char *version, size_t len);
+void send_response(connection* conn, int status_code, char* path, file_entry* entry);
+void send_ranges(connection* conn, file_entry* entry, const byte_range* ranges, int num_ranges);
+bool wants_keep_alive(const char* request, const http_parser* parser);
+char *get_mime_type(const char *name);
+char* create_response(const file_entry* entry, size_t body_size, bool http11, bool keep_alive, size_t* header_size);
+int format_representation_headers(char* buf, size_t size, const file_entry* entry);
+int format_entity_headers(char* buf, size_t size, const file_entry* entry, size_t body_size);
+int render_cached_headers(char* buf, size_t size, const file_entry* entry);
+char* render_directory_listing(const char* path, int dir_fd, size_t* len);
+bool is_directory(const char* path);
+
+/**
+ * send_file_to_socket writes the file segment seg, from seg->off
+ * up to seg->end, to client_socket.
+ * the data goes from the page cache to the socket with sendfile,
+ * or with splice through a pipe where sendfile is not supported.
+ * copying through a buffer is the last fallback.
+ * the socket is non-blocking, so the function stops when the
+ * socket buffer is full.
+ * returns 1 when the whole segment was sent, 0 if the socket would
+ * block and -1 on error.
+ */
+int send_file_to_socket(out_seg* seg, int client_socket);
+
+/**
+ * set_sendfile_chunk sets the max number of bytes moved by a single
+ * sendfile or splice call.
+ */
+void set_sendfile_chunk(size_t chunk);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+// index of this thread's cache in every slab, -1 until its first use, SLAB_MAX_THREADS without one
+static __thread int thread_index = -1;
+
+// the indices of running threads and the slabs, under registry_lock. an exiting thread
+// empties its caches and gives its index back in the destructor of index_key.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool index_used[SLAB_MAX_THREADS];
+static slab* slabs;
+static pthread_key_t index_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+// move the objects of a cache to the shared list. the registry lock is held.
+static void empty_cache(slab* pool, slab_cache* cache) {
+    pthread_mutex_lock(&pool->lock);
+    while (cache->count > 0) {
+        void* obj = cache->objs[--cache->count];
+        *(void**) obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    cache->allocates = false;
+}
+
+// destructor of index_key: an exiting thread's caches would be stranded
+static void release_index(void* arg) {
+    int index = (int) (intptr_t) arg - 1;
+    pthread_mutex_lock(&registry_lock);
+    for (slab* pool = slabs; pool != NULL; pool = pool->next)
+        empty_cache(pool, &pool->caches[index]);
+    index_used[index] = false;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void create_index_key(void) {
+    if (pthread_key_create(&index_key, release_index) != 0)
+        perror("pthread_key_create");
+}
+
+// give the calling thread the lowest free index
+static void claim_index(void) {
+    pthread_once(&key_once, create_index_key);
+    pthread_mutex_lock(&registry_lock);
+    int index = 0;
+    while (index < SLAB_MAX_THREADS && index_used[index])
+        index++;
+    if (index < SLAB_MAX_THREADS)
+        index_used[index] = true;
+    pthread_mutex_unlock(&registry_lock);
+    // the key's value is never NULL, so the destructor runs
+    if (index < SLAB_MAX_THREADS && pthread_setspecific(index_key, (void*) (intptr_t) (index + 1)) != 0) {
+        perror("pthread_setspecific");
+        pthread_mutex_lock(&registry_lock);
+        index_used[index] = false;
+        pthread_mutex_unlock(&registry_lock);
+        index = SLAB_MAX_THREADS;
+    }
+    thread_index = index;
+}
+
+slab* create_slab(size_t obj_size, int capacity) {
+    if (capacity <= 0 || obj_size == 0)
+        return NULL;
+    slab* pool = (slab*) calloc(1, sizeof(slab));
+    if (pool == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    // room for the free list link, and every object aligned like malloc's
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+    obj_size = (obj_size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    pool->obj_size = obj_size;
+    pool->capacity = capacity;
+    pool->batch = capacity / 8;
+    if (pool->batch > SLAB_BATCH)
+        pool->batch = SLAB_BATCH;
+    if (pool->batch < 1)
+        pool->batch = 1;
+    pool->block = (char*) malloc(obj_size * capacity);
+    pool->caches = (slab_cache*) aligned_alloc(_Alignof(slab_cache), SLAB_MAX_THREADS * sizeof(slab_cache));
+    if (pool->block == NULL || pool->caches == NULL) {
+        perror("malloc");
+        free(pool->block);
+        free(pool->caches);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->caches, 0, SLAB_MAX_THREADS * sizeof(slab_cache));
+    // the first object on top, so the block is used from its start
+    for (int i = capacity - 1; i >= 0; --i) {
+        void* obj = pool->block + (size_t) i * obj_size;
+        *(void**) obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_lock(&registry_lock);
+    pool->next = slabs;
+    slabs = pool;
+    pthread_mutex_unlock(&registry_lock);
+    return pool;
+}
+
+// the cache of the calling thread, NULL if there are too many threads
+static slab_cache* thread_cache(slab* pool) {
+    if (thread_index < 0)
+        claim_index();
+    return thread_index < SLAB_MAX_THREADS ? &pool->caches[thread_index] : NULL;
+}
+
+static int in_block(const slab* pool, const void* obj) {
+    uintptr_t addr = (uintptr_t) obj;
+    uintptr_t start = (uintptr_t) pool->block;
+    return addr >= start && addr < start + pool->obj_size * pool->capacity;
+}
+
+// move up to a batch of objects from the shared list to a cache
+static void refill(slab* pool, slab_cache* cache) {
+    pthread_mutex_lock(&pool->lock);
+    while (cache->count < pool->batch && pool->free_list != NULL) {
+        void* obj = pool->free_list;
+        pool->free_list = *(void**) obj;
+        cache->objs[cache->count++] = obj;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// move a batch of objects from a full cache to the shared list
+static void flush(slab* pool, slab_cache* cache) {
+    // link the batch outside the lock, then splice it in
+    void* first = cache->objs[cache->count - 1];
+    void* last = cache->objs[cache->count - pool->batch];
+    for (int i = cache->count - 1; i > cache->count - pool->batch; --i)
+        *(void**) cache->objs[i] = cache->objs[i - 1];
+    cache->count -= pool->batch;
+    pthread_mutex_lock(&pool->lock);
+    *(void**) last = pool->free_list;
+    pool->free_list = first;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void* slab_alloc(slab* pool) {
+    slab_cache* cache = thread_cache(pool);
+    if (cache != NULL) {
+        cache->allocates = true;
+        if (cache->count == 0)
+            refill(pool, cache);
+        if (cache->count > 0)
+            return cache->objs[--cache->count];
+    }
+    else {
+        pthread_mutex_lock(&pool->lock);
+        void* obj = pool->free_list;
+        if (obj != NULL)
+            pool->free_list = *(void**) obj;
+        pthread_mutex_unlock(&pool->lock);
+        if (obj != NULL)
+            return obj;
+    }
+    atomic_fetch_add_explicit(&pool->fallbacks, 1, memory_order_relaxed);
+    void* obj = malloc(pool->obj_size);
+    if (obj == NULL)
+        perror("malloc");
+    return obj;
+}
+
+void slab_free(slab* pool, void* obj) {
+    if (obj == NULL)
+        return;
+    if (!in_block(pool, obj)) {
+        free(obj);
+        return;
+    }
+    // a thread that doesn't allocate from the pool would only hoard what it frees
+    slab_cache* cache = thread_cache(pool);
+    if (cache == NULL || !cache->allocates) {
+        pthread_mutex_lock(&pool->lock);
+        *(void**) obj = pool->free_list;
+        pool->free_list = obj;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    if (cache->count == 2 * pool->batch)
+        flush(pool, cache);
+    cache->objs[cache->count++] = obj;
+}
+
+void destroy_slab(slab* pool) {
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&registry_lock);
+    slab** link = &slabs;
+    while (*link != pool)
+        link = &(*link)->next;
+    *link = pool->next;
+    pthread_mutex_unlock(&registry_lock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->caches);
+    free(pool->block);
+    free(pool);
+}
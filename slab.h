@@ -0,0 +1,78 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * slab.h
+ *
+ * This file declares a pool of fixed-size objects, for the
+ * bookkeeping objects that are allocated on one thread and freed on
+ * another (the threadpool's work_t, the event loop's connections).
+ * the objects are preallocated in one block. every thread keeps a
+ * small cache of free objects and trades them with a shared free
+ * list in batches, so in the steady state an allocation or a free
+ * is a few instructions and takes the shared lock only once per
+ * batch. a small pool gets small batches, so the caches can't hoard
+ * most of it, and a thread that only frees (a pool worker freeing
+ * what a loop allocated) returns the objects to the shared list
+ * instead of keeping them. a thread's cache goes back to the shared
+ * lists when it exits, and its index to the next thread. when the
+ * block is used up, objects come from malloc and go back to free.
+ */
+
+#define SLAB_BATCH 16           //most objects moved between a thread cache and the shared list at once
+#define SLAB_CACHE (2 * SLAB_BATCH) //most free objects a thread keeps
+#define SLAB_MAX_THREADS 256    //running threads with a cache; more use the shared list directly
+
+/**
+ * the free objects one thread keeps. only that thread touches it.
+ */
+typedef struct slab_cache {
+    _Alignas(64) int count;
+    bool allocates;             //the thread allocated from the pool, so its frees are kept for it
+    void* objs[SLAB_CACHE];
+} slab_cache;
+
+/**
+ * The pool
+ */
+typedef struct slab {
+    char* block;                //the preallocated objects
+    size_t obj_size;
+    int capacity;
+    int batch;                  //objects moved at once, a thread keeps at most twice as many
+    pthread_mutex_t lock;       //lock on free_list
+    void* free_list;            //linked through the first word of each object
+    slab_cache* caches;         //SLAB_MAX_THREADS of them
+    atomic_long fallbacks;      //allocations served by malloc
+    struct slab* next;          //in the list of slabs, whose caches an exiting thread empties
+} slab;
+
+/**
+ * create_slab preallocates capacity objects of obj_size bytes.
+ * returns NULL on failure.
+ */
+slab* create_slab(size_t obj_size, int capacity);
+
+/**
+ * slab_alloc returns an uninitialized object, or NULL if the block
+ * is used up and malloc fails.
+ */
+void* slab_alloc(slab* pool);
+
+/**
+ * slab_free returns an object of slab_alloc to the pool. any thread
+ * may free an object allocated on another.
+ */
+void slab_free(slab* pool, void* obj);
+
+/**
+ * destroy_slab frees the block. every object must have been freed.
+ */
+void destroy_slab(slab* pool);
+
+#endif
@@ -0,0 +1,91 @@
+#include "../http_parser.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * fuzz_parser checks the request parser on arbitrary input.
+ * built with -fsanitize=fuzzer (cmake -DFUZZ=ON, clang) it is a
+ * libFuzzer target, and tests/fuzz/ is its seed corpus. otherwise it
+ * replays the files given on the command line.
+ * every input is parsed whole and again one byte at a time: the
+ * outcome, every slice and the framing of the body must be the same,
+ * and the slices inside the input.
+ */
+
+static void check_slice(http_slice slice, size_t len) {
+	if ((size_t) slice.off + slice.len > len)
+		abort();
+}
+
+static void check_same(const http_parser* a, const http_parser* b) {
+	if (a->pos != b->pos || a->num_headers != b->num_headers ||
+	    memcmp(&a->method, &b->method, sizeof(http_slice)) != 0 ||
+	    memcmp(&a->target, &b->target, sizeof(http_slice)) != 0 ||
+	    memcmp(&a->version, &b->version, sizeof(http_slice)) != 0 ||
+	    memcmp(a->headers, b->headers, a->num_headers * sizeof(http_header)) != 0)
+		abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	// the parser may look at every byte it was given, and no further
+	char* request = (char*) malloc(size + 1);
+	if (request == NULL)
+		return 0;
+	memcpy(request, data, size);
+
+	http_parser whole;
+	http_parser_init(&whole);
+	http_parse_status status = http_parse(&whole, request, size);
+
+	http_parser split;
+	http_parser_init(&split);
+	http_parse_status split_status = HTTP_PARSE_AGAIN;
+	for (size_t len = 1; len <= size && split_status == HTTP_PARSE_AGAIN; ++len)
+		split_status = http_parse(&split, request, len);
+
+	if (status != split_status)
+		abort();
+	if (status == HTTP_PARSE_DONE) {
+		check_same(&whole, &split);
+		long long body = http_body_length(&whole, request);
+		if (body != http_body_length(&split, request) || body < HTTP_BODY_INVALID)
+			abort();
+		if (whole.pos > size)
+			abort();
+		check_slice(whole.method, whole.pos);
+		check_slice(whole.target, whole.pos);
+		check_slice(whole.version, whole.pos);
+		for (int i = 0; i < whole.num_headers; ++i) {
+			check_slice(whole.headers[i].name, whole.pos);
+			check_slice(whole.headers[i].value, whole.pos);
+		}
+	}
+	else if (status == HTTP_PARSE_AGAIN && http_parse_eof(&whole, size) == HTTP_PARSE_DONE && whole.version.len == 0)
+		abort();
+	free(request);
+	return 0;
+}
+
+#ifndef FUZZING
+int main(int argc, char* args[]) {
+	if (argc < 2) {
+		printf("Usage: fuzz_parser <file>...\n");
+		exit(1);
+	}
+	for (int i = 1; i < argc; ++i) {
+		FILE* file = fopen(args[i], "rb");
+		if (file == NULL) {
+			perror(args[i]);
+			exit(1);
+		}
+		static uint8_t buf[1 << 16];
+		size_t size = fread(buf, 1, sizeof(buf), file);
+		fclose(file);
+		LLVMFuzzerTestOneInput(buf, size);
+	}
+	printf("%d inputs passed\n", argc - 1);
+	return 0;
+}
+#endif
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * loadgen sends GET requests for the files under a docroot (the
+ * directory the server runs in) over a number of connections, one
+ * thread each, and reports the throughput, latency percentiles, a
+ * latency histogram and the responses by status code.
+ * closed loop: a connection sends its next request as soon as the
+ *     response to the last one arrived, so the load follows the
+ *     server.
+ * open loop (--rate): the requests are scheduled at a constant total
+ *     rate, spread over the connections, and a request's latency is
+ *     counted from its scheduled time. a server that stalls is charged
+ *     for the requests that should have been sent meanwhile, instead
+ *     of the stall holding the load back (coordinated omission).
+ * requests are sent with keep-alive, or with --close on a new
+ * connection each.
+ */
+
+#define MAX_PATHS 65536
+#define MAX_PATH_LEN 512
+#define MAX_CONNECTIONS 1024
+#define RESPONSE_BUF (64 * 1024)
+#define HIST_SUB_BITS 5                 //32 buckets per power of two, about 3% wide
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+enum { ERR_CONNECT, ERR_SEND, ERR_RECEIVE, ERR_TIMEOUT, ERR_PROTOCOL, NUM_ERRORS };
+static const char* error_names[NUM_ERRORS] = { "connect", "send", "receive", "timeout", "protocol" };
+
+typedef struct worker {
+	pthread_t thread;
+	int index;
+	int fd;                             //-1 when not connected
+	unsigned rng;
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t status[600];
+	uint64_t errors[NUM_ERRORS];
+	uint64_t hist[HIST_BUCKETS];
+	uint64_t latency_sum;
+	uint64_t latency_max;
+	char buf[RESPONSE_BUF + 1];
+} worker;
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static char host_header[300];
+static char* paths[MAX_PATHS];
+static int num_paths;
+static int connections = 16;
+static double duration = 10;
+static double rate;                     //requests per second of all connections, 0 is a closed loop
+static bool close_each;
+static bool gzip;
+static int timeout_ms = 5000;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when) {
+	struct timespec ts = { (time_t) (when / 1000000000), (long) (when % 1000000000) };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int bucket_of(uint64_t ns) {
+	if (ns < HIST_SUB_BUCKETS)
+		return (int) ns;
+	int exp = 63 - __builtin_clzll(ns);
+	int index = (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + (int) ((ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+	return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// the largest value counted in a bucket
+static uint64_t bucket_top(int index) {
+	if (index < HIST_SUB_BUCKETS)
+		return index;
+	int group = index / HIST_SUB_BUCKETS;
+	int exp = group + HIST_SUB_BITS - 1;
+	uint64_t width = 1ULL << (exp - HIST_SUB_BITS);
+	return (1ULL << exp) + (index % HIST_SUB_BUCKETS + 1) * width - 1;
+}
+
+// the files under dir, as request paths relative to the docroot. names a request target
+// can't carry unescaped are skipped, the server doesn't decode percent escapes.
+static void scan_docroot(const char* dir, const char* prefix) {
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		perror(dir);
+		return;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL && num_paths < MAX_PATHS) {
+		if (entry->d_name[0] == '.' || strpbrk(entry->d_name, " %?#\"\\") != NULL)
+			continue;
+		char full[MAX_PATH_LEN];
+		char path[MAX_PATH_LEN];
+		if (snprintf(full, sizeof(full), "%s/%s", dir, entry->d_name) >= (int) sizeof(full) ||
+		    snprintf(path, sizeof(path), "%s/%s", prefix, entry->d_name) >= (int) sizeof(path))
+			continue;
+		struct stat st;
+		if (stat(full, &st) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			scan_docroot(full, path);
+		else if (S_ISREG(st.st_mode))
+			paths[num_paths++] = strdup(path);
+	}
+	closedir(d);
+}
+
+static int open_connection(worker* w) {
+	w->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (w->fd < 0) {
+		w->errors[ERR_CONNECT]++;
+		return -1;
+	}
+	struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(w->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	int one = 1;
+	setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(w->fd, (struct sockaddr*) &server_addr, server_addr_len) < 0) {
+		w->errors[errno == EINPROGRESS || errno == EAGAIN ? ERR_TIMEOUT : ERR_CONNECT]++;
+		close(w->fd);
+		w->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void close_connection(worker* w) {
+	if (w->fd >= 0)
+		close(w->fd);
+	w->fd = -1;
+}
+
+// count a failed receive as a timeout or an error
+static int receive_failed(worker* w, ssize_t n) {
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		w->errors[ERR_TIMEOUT]++;
+	else
+		w->errors[ERR_RECEIVE]++;
+	return -1;
+}
+
+// read one response. returns its status code, or -1 after counting an error.
+// *server_close is set when the connection can't carry another request.
+static int read_response(worker* w, bool* server_close) {
+	size_t len = 0;
+	char* head_end = NULL;
+	while (head_end == NULL) {
+		if (len == RESPONSE_BUF) {
+			w->errors[ERR_PROTOCOL]++;
+			return -1;
+		}
+		ssize_t n = recv(w->fd, w->buf + len, RESPONSE_BUF - len, 0);
+		if (n <= 0)
+			return receive_failed(w, n);
+		len += n;
+		w->buf[len] = '\0';
+		head_end = strstr(w->buf, "\r\n\r\n");
+	}
+	int status;
+	if (sscanf(w->buf, "HTTP/1.%*d %d", &status) != 1 || status < 100 || status > 599) {
+		w->errors[ERR_PROTOCOL]++;
+		return -1;
+	}
+	size_t head_len = head_end + 4 - w->buf;
+	*head_end = '\0';
+	*server_close = strcasestr(w->buf, "\r\nConnection: close") != NULL || strncmp(w->buf, "HTTP/1.0", 8) == 0;
+	const char* length = strcasestr(w->buf, "\r\nContent-Length:");
+
+	long long body_left;
+	if (status == 304 || status == 204 || status < 200)
+		body_left = 0;
+	else if (length != NULL)
+		body_left = atoll(length + strlen("\r\nContent-Length:"));
+	else
+		body_left = -1;                 //until the server closes
+	w->bytes += len;
+	if (body_left >= 0)
+		body_left -= len - head_len;
+	while (body_left != 0) {
+		ssize_t n = recv(w->fd, w->buf, RESPONSE_BUF, 0);
+		if (n == 0 && body_left < 0) {
+			*server_close = true;
+			break;
+		}
+		if (n <= 0)
+			return receive_failed(w, n);
+		w->bytes += n;
+		if (body_left > 0)
+			body_left = body_left > n ? body_left - n : 0;
+	}
+	return status;
+}
+
+// send a request for a random path and wait for its response, reconnecting as needed.
+// returns false if it failed.
+static bool run_request(worker* w) {
+	if (w->fd < 0 && open_connection(w) < 0)
+		return false;
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 17;
+	w->rng ^= w->rng << 5;
+	char request[MAX_PATH_LEN + 400];
+	int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+	                           paths[w->rng % num_paths], host_header,
+	                           gzip ? "Accept-Encoding: gzip\r\n" : "", close_each ? "Connection: close\r\n" : "");
+	if (send(w->fd, request, request_len, MSG_NOSIGNAL) != request_len) {
+		w->errors[errno == EAGAIN ? ERR_TIMEOUT : ERR_SEND]++;
+		close_connection(w);
+		return false;
+	}
+	bool server_close = false;
+	int status = read_response(w, &server_close);
+	if (status < 0 || server_close || close_each)
+		close_connection(w);
+	if (status < 0)
+		return false;
+	w->status[status]++;
+	return true;
+}
+
+static void record_latency(worker* w, uint64_t latency) {
+	w->requests++;
+	w->hist[bucket_of(latency)]++;
+	w->latency_sum += latency;
+	if (latency > w->latency_max)
+		w->latency_max = latency;
+}
+
+// closed loop: back to back requests until the end
+static void* run_closed(void* arg) {
+	worker* w = (worker*) arg;
+	uint64_t sent;
+	while ((sent = now_ns()) < end_ns) {
+		if (run_request(w))
+			record_latency(w, now_ns() - sent);
+	}
+	close_connection(w);
+	return NULL;
+}
+
+// open loop: connection k sends requests k, k + connections, ... of the schedule
+static void* run_open(void* arg) {
+	worker* w = (worker*) arg;
+	double interval = 1e9 / rate;
+	for (uint64_t i = w->index;; i += connections) {
+		uint64_t scheduled = start_ns + (uint64_t) (i * interval);
+		if (scheduled >= end_ns)
+			break;
+		if (now_ns() < scheduled)
+			sleep_until(scheduled);
+		if (run_request(w))
+			record_latency(w, now_ns() - scheduled);
+	}
+	close_connection(w);
+	return NULL;
+}
+
+static int resolve(const char* host, const char* port) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* result;
+	int rc = getaddrinfo(host, port, &hints, &result);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+		return -1;
+	}
+	memcpy(&server_addr, result->ai_addr, result->ai_addrlen);
+	server_addr_len = result->ai_addrlen;
+	freeaddrinfo(result);
+	snprintf(host_header, sizeof(host_header), "%s:%s", host, port);
+	return 0;
+}
+
+static void report(worker* workers, double elapsed) {
+	static uint64_t hist[HIST_BUCKETS];
+	uint64_t requests = 0, bytes = 0, latency_sum = 0, latency_max = 0;
+	uint64_t status[600] = { 0 };
+	uint64_t errors[NUM_ERRORS] = { 0 };
+	for (int i = 0; i < connections; ++i) {
+		worker* w = &workers[i];
+		requests += w->requests;
+		bytes += w->bytes;
+		latency_sum += w->latency_sum;
+		if (w->latency_max > latency_max)
+			latency_max = w->latency_max;
+		for (int b = 0; b < HIST_BUCKETS; ++b)
+			hist[b] += w->hist[b];
+		for (int s = 0; s < 600; ++s)
+			status[s] += w->status[s];
+		for (int e = 0; e < NUM_ERRORS; ++e)
+			errors[e] += w->errors[e];
+	}
+
+	printf("requests: %llu in %.2fs, %.1f req/s, %.2f MB/s\n", (unsigned long long) requests, elapsed,
+	       requests / elapsed, bytes / elapsed / 1e6);
+	if (requests > 0) {
+		static const double percentiles[] = { 50, 90, 99, 99.9 };
+		printf("latency (us): mean %.1f", latency_sum / 1e3 / requests);
+		int b = 0;
+		uint64_t cumulative = 0;
+		for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+			// the smallest bucket that holds at least this share of the requests
+			uint64_t rank = (uint64_t) (percentiles[p] / 100 * requests + 0.999999);
+			while (cumulative + hist[b] < rank)
+				cumulative += hist[b++];
+			uint64_t top = bucket_top(b);
+			printf("  p%g %.1f", percentiles[p], (top < latency_max ? top : latency_max) / 1e3);
+		}
+		printf("  max %.1f\n", latency_max / 1e3);
+
+		printf("latency histogram:\n");
+		cumulative = 0;
+		for (int group = 0; group < HIST_BUCKETS / HIST_SUB_BUCKETS; ++group) {
+			uint64_t count = 0;
+			for (int i = 0; i < HIST_SUB_BUCKETS; ++i)
+				count += hist[group * HIST_SUB_BUCKETS + i];
+			if (count == 0)
+				continue;
+			cumulative += count;
+			printf("  < %10.1f us %10llu  %6.2f%%  %6.2f%%\n", bucket_top((group + 1) * HIST_SUB_BUCKETS - 1) / 1e3 + 1e-3,
+			       (unsigned long long) count, 100.0 * count / requests, 100.0 * cumulative / requests);
+		}
+	}
+	printf("status:");
+	for (int s = 0; s < 600; ++s)
+		if (status[s] > 0)
+			printf("  %d: %llu", s, (unsigned long long) status[s]);
+	printf("\nerrors:");
+	for (int e = 0; e < NUM_ERRORS; ++e)
+		printf("  %s: %llu", error_names[e], (unsigned long long) errors[e]);
+	printf("\n");
+}
+
+int main(int argc, char* args[]) {
+	if (argc < 4) {
+		printf("Usage: loadgen <host> <port> <docroot> [--connections=<n>] [--duration=<seconds>] [--rate=<requests/s>]\n"
+		       "       [--close] [--gzip] [--timeout=<ms>]\n");
+		exit(1);
+	}
+	for (int i = 4; i < argc; ++i) {
+		if (strncmp(args[i], "--connections=", 14) == 0)
+			connections = atoi(args[i] + 14);
+		else if (strncmp(args[i], "--duration=", 11) == 0)
+			duration = atof(args[i] + 11);
+		else if (strncmp(args[i], "--rate=", 7) == 0)
+			rate = atof(args[i] + 7);
+		else if (strncmp(args[i], "--timeout=", 10) == 0)
+			timeout_ms = atoi(args[i] + 10);
+		else if (strcmp(args[i], "--close") == 0)
+			close_each = true;
+		else if (strcmp(args[i], "--gzip") == 0)
+			gzip = true;
+		else {
+			printf("unknown option %s\n", args[i]);
+			exit(1);
+		}
+	}
+	if (connections <= 0 || connections > MAX_CONNECTIONS || duration <= 0 || rate < 0 || timeout_ms <= 0) {
+		printf("connections must be 1 to %d, duration and timeout positive and rate not negative\n", MAX_CONNECTIONS);
+		exit(1);
+	}
+	if (resolve(args[1], args[2]) < 0)
+		exit(1);
+	scan_docroot(args[3], "");
+	if (num_paths == 0) {
+		printf("no files under %s\n", args[3]);
+		exit(1);
+	}
+
+	worker* workers = (worker*) calloc(connections, sizeof(worker));
+	if (workers == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	printf("loadgen: %d connections, %s, %s, %.0fs, %d paths\n", connections,
+	       rate > 0 ? "open loop" : "closed loop", close_each ? "a connection per request" : "keep-alive", duration, num_paths);
+	if (rate > 0)
+		printf("target rate: %.1f req/s\n", rate);
+	start_ns = now_ns();
+	end_ns = start_ns + (uint64_t) (duration * 1e9);
+	for (int i = 0; i < connections; ++i) {
+		workers[i].index = i;
+		workers[i].fd = -1;
+		workers[i].rng = 2463534242u + i * 0x9e3779b9u;
+		if (pthread_create(&workers[i].thread, NULL, rate > 0 ? run_open : run_closed, &workers[i]) != 0) {
+			perror("create thread");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < connections; ++i)
+		pthread_join(workers[i].thread, NULL);
+	report(workers, (now_ns() - start_ns) / 1e9);
+
+	for (int i = 0; i < num_paths; ++i)
+		free(paths[i]);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+
+#include "../http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/**
+ * parser_bench measures the request parser on a typical browser
+ * request, parsed whole and fed in small pieces as if it arrived
+ * over several reads, against the strstr/strtok parsing it replaced
+ * (which rescans the buffer from the start after every read).
+ */
+
+static const char request[] =
+	"GET /static/css/site.min.css?v=20240101 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/css,*/*;q=0.1\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Referer: https://www.example.com/articles/2024/some-long-article-name.html\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=4f9a1c0e7d2b48a6b3e5; theme=dark; consent=1\r\n"
+	"Sec-Fetch-Dest: style\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+	"\r\n";
+
+static volatile size_t sink;
+
+static double seconds_since(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// parse the request fed chunk bytes at a time (chunk 0: whole)
+static void parse_incremental(const char* buf, size_t len, size_t chunk) {
+	http_parser parser;
+	http_parser_init(&parser);
+	size_t have = chunk == 0 ? len : 0;
+	http_parse_status status;
+	do {
+		if (chunk != 0)
+			have = have + chunk < len ? have + chunk : len;
+		status = http_parse(&parser, buf, have);
+	} while (status == HTTP_PARSE_AGAIN && have < len);
+	size_t value_len;
+	const char* value = http_find_header(&parser, buf, "Connection", &value_len);
+	sink += parser.target.len + parser.num_headers + (value != NULL ? value_len : 0);
+}
+
+// what the server did before: look for the end of the head after every read,
+// then copy and tokenize the request line and search the headers for Connection
+static void parse_strtok(char* buf, size_t len, size_t chunk) {
+	size_t have = chunk == 0 ? len : 0;
+	char* end_of_headers;
+	do {
+		if (chunk != 0)
+			have = have + chunk < len ? have + chunk : len;
+		char saved = buf[have];
+		buf[have] = '\0';
+		end_of_headers = strstr(buf, "\r\n\r\n");
+		buf[have] = saved;
+	} while (end_of_headers == NULL && have < len);
+
+	char* end_of_first_line = strstr(buf, "\r\n");
+	char line[4000];
+	size_t line_len = end_of_first_line - buf;
+	memcpy(line, buf, line_len);
+	line[line_len] = '\0';
+	char* method = strtok(line, " ");
+	char* path = strtok(NULL, " ");
+	char* protocol = strtok(NULL, " ");
+	const char* header = end_of_first_line + 2;
+	size_t value_len = 0;
+	while (header < end_of_headers) {
+		const char* header_end = memmem(header, end_of_headers + 2 - header, "\r\n", 2);
+		if (header_end - header > 11 && header[10] == ':' && strncasecmp(header, "Connection", 10) == 0)
+			value_len = header_end - header - 12;
+		header = header_end + 2;
+	}
+	sink += strlen(method) + strlen(path) + strlen(protocol) + value_len;
+}
+
+int main(int argc, char* args[]) {
+	long iterations = argc > 1 ? atol(args[1]) : 1000000;
+	if (iterations <= 0) {
+		printf("Usage: parser_bench [iterations]\n");
+		exit(1);
+	}
+	size_t len = sizeof(request) - 1;
+	char* buf = (char*) malloc(len + 1);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(buf, request, len + 1);
+
+	const size_t chunks[] = { 0, 64, 16 };
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < iterations; ++i)
+			parse_incremental(buf, len, chunks[c]);
+		double incremental = seconds_since(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (long i = 0; i < iterations; ++i)
+			parse_strtok(buf, len, chunks[c]);
+		double old = seconds_since(&start);
+
+		printf("%zu byte request, %s: parser %.0f ns, strstr/strtok %.0f ns, %.2f GB/s\n", len,
+		       chunks[c] == 0 ? "whole" : chunks[c] == 64 ? "64 byte reads" : "16 byte reads",
+		       incremental * 1e9 / iterations, old * 1e9 / iterations, len * iterations / incremental / 1e9);
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include "../http_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * parser_test checks the framing of request bodies: a request's body
+ * ends where http_body_length says, so the bytes after it are parsed
+ * as the next pipelined request and never the body's own bytes.
+ * a body that can't be delimited must be reported, the server then
+ * stops reading the connection.
+ */
+
+static int failures;
+static int checks;
+
+static void expect_length(const char* name, const char* request, long long expected) {
+	http_parser parser;
+	http_parser_init(&parser);
+	checks++;
+	if (http_parse(&parser, request, strlen(request)) != HTTP_PARSE_DONE) {
+		printf("%s: the head was not parsed\n", name);
+		failures++;
+		return;
+	}
+	long long length = http_body_length(&parser, request);
+	if (length != expected) {
+		printf("%s: body length %lld, expected %lld\n", name, length, expected);
+		failures++;
+	}
+}
+
+// a body that holds a request line is skipped, the request after it is the next one
+static void expect_pipeline(void) {
+	const char* stream = "GET /a HTTP/1.1\r\nContent-Length: 29\r\n\r\n"
+	                     "GET /priv/s.html HTTP/1.1\r\n\r\n"
+	                     "GET /b HTTP/1.1\r\n\r\n";
+	size_t len = strlen(stream);
+	const char* targets[] = { "/a", "/b" };
+	size_t consumed = 0;
+	checks++;
+	for (int i = 0; i < 2; ++i) {
+		http_parser parser;
+		http_parser_init(&parser);
+		const char* request = stream + consumed;
+		if (http_parse(&parser, request, len - consumed) != HTTP_PARSE_DONE ||
+		    !http_slice_equals(request, parser.target, targets[i])) {
+			printf("pipeline: request %d is not %s\n", i, targets[i]);
+			failures++;
+			return;
+		}
+		long long body = http_body_length(&parser, request);
+		consumed += parser.pos + (body > 0 ? (size_t) body : 0);
+	}
+	if (consumed != len) {
+		printf("pipeline: %zu of %zu bytes consumed\n", consumed, len);
+		failures++;
+	}
+}
+
+// a 503 sent before the pool parsed the request reads its version only from a complete head
+static void expect_done(void) {
+	const char* request = "GET / HTTP/1.0\r\nHost: a\r\n\r\n";
+	http_parser parser;
+	http_parser_init(&parser);
+	checks++;
+	http_parse(&parser, request, 20);
+	if (http_parse_done(&parser)) {
+		printf("done: a partial head was reported complete\n");
+		failures++;
+		return;
+	}
+	http_parse(&parser, request, strlen(request));
+	if (!http_parse_done(&parser) || !http_slice_equals(request, parser.version, "HTTP/1.0")) {
+		printf("done: the complete head was not reported with its version\n");
+		failures++;
+	}
+}
+
+int main(void) {
+	expect_length("no body", "GET / HTTP/1.1\r\nHost: a\r\n\r\n", 0);
+	expect_length("content-length", "GET / HTTP/1.1\r\nContent-Length: 30\r\n\r\n", 30);
+	expect_length("lower case name", "GET / HTTP/1.1\r\ncontent-length: 7\r\n\r\n", 7);
+	expect_length("zero", "GET / HTTP/1.1\r\nContent-Length: 0\r\n\r\n", 0);
+	expect_length("repeated, same value", "GET / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n", 5);
+	expect_length("repeated, other value", "GET / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("sign", "GET / HTTP/1.1\r\nContent-Length: +5\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("negative", "GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("trailing junk", "GET / HTTP/1.1\r\nContent-Length: 5a\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("list", "GET / HTTP/1.1\r\nContent-Length: 5, 5\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("empty", "GET / HTTP/1.1\r\nContent-Length:\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("overflow", "GET / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n", HTTP_BODY_INVALID);
+	expect_length("chunked", "GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", HTTP_BODY_UNFRAMED);
+	expect_length("any transfer-encoding", "GET / HTTP/1.1\r\ntransfer-encoding: gzip\r\n\r\n", HTTP_BODY_UNFRAMED);
+	expect_length("chunked with content-length",
+	              "GET / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n", HTTP_BODY_UNFRAMED);
+	expect_pipeline();
+	expect_done();
+
+	printf("%d of %d checks passed\n", checks - failures, checks);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,351 @@
+#include "../threadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * pool_bench measures a threadpool queue backend and writes one CSV
+ * row (or JSON object) per result, to compare runs when the queues
+ * change:
+ * dispatch:    one thread dispatches empty jobs, the rate they are
+ *              run at and the time of a dispatch call.
+ * latency:     a single job dispatched to an idle pool, the time until
+ *              it starts and until the dispatcher sees it done.
+ * contention:  the rate of empty jobs dispatched by each number of
+ *              producer threads.
+ * saturation:  workers blocked and the queue full: the jobs accepted,
+ *              a refused try_dispatch, dispatch_timeout's wait and
+ *              how soon a dispatch blocked on the full queue returns
+ *              once the workers go on.
+ * drain:       destroy_threadpool of an idle pool and of one with a
+ *              full queue.
+ */
+
+#define MAX_PRODUCERS 64
+#define MAX_PRODUCER_COUNTS 16
+#define TIMEOUT_MS 10
+
+static const char* names[] = { "mutex", "ring", "stealing" };
+
+static int threads;
+static int queue_size;
+static long jobs = 200000;
+static int samples = 1000;
+static int producer_counts[MAX_PRODUCER_COUNTS] = { 1, 2, 4, 8 };
+static int num_producer_counts = 4;
+static bool json;
+static bool first_result = true;
+
+static atomic_long done;
+
+// the gate blocked jobs wait at
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static bool gate_open;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+static void result(queue_kind kind, const char* bench, int producers, const char* metric, double value, const char* unit) {
+	if (json)
+		printf("%s\n  {\"queue\": \"%s\", \"benchmark\": \"%s\", \"threads\": %d, \"max_queue_size\": %d, \"producers\": %d, "
+		       "\"metric\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}", first_result ? "[" : ",",
+		       names[kind], bench, threads, queue_size, producers, metric, value, unit);
+	else
+		printf("%s,%s,%d,%d,%d,%s,%.3f,%s\n", names[kind], bench, threads, queue_size, producers, metric, value, unit);
+	first_result = false;
+	fflush(stdout);
+}
+
+static int count_job(void* arg) {
+	(void) arg;
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	return 0;
+}
+
+static int gate_job(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&gate_lock);
+	while (!gate_open)
+		pthread_cond_wait(&gate_cond, &gate_lock);
+	pthread_mutex_unlock(&gate_lock);
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	return 0;
+}
+
+static void set_gate(bool open) {
+	pthread_mutex_lock(&gate_lock);
+	gate_open = open;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&gate_lock);
+}
+
+static void wait_done(long count) {
+	while (atomic_load_explicit(&done, memory_order_relaxed) < count)
+		sched_yield();
+}
+
+static threadpool* create_pool(queue_kind kind) {
+	threadpool* pool = create_threadpool_with_queue(threads, queue_size, kind);
+	if (pool == NULL) {
+		printf("can't create a %s pool of %d threads and queue size %d\n", names[kind], threads, queue_size);
+		exit(1);
+	}
+	return pool;
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+// the percentiles of sorted values, in microseconds
+static void percentile_results(queue_kind kind, const char* bench, const char* metric, uint64_t* values, int count) {
+	static const double percentiles[] = { 50, 90, 99 };
+	char name[64];
+	qsort(values, count, sizeof(uint64_t), compare_u64);
+	for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); ++p) {
+		int index = (int) (percentiles[p] / 100 * count);
+		snprintf(name, sizeof(name), "%s_p%g", metric, percentiles[p]);
+		result(kind, bench, 1, name, values[index < count ? index : count - 1] / 1e3, "us");
+	}
+	snprintf(name, sizeof(name), "%s_max", metric);
+	result(kind, bench, 1, name, values[count - 1] / 1e3, "us");
+}
+
+static void bench_dispatch(queue_kind kind) {
+	threadpool* pool = create_pool(kind);
+	atomic_store(&done, 0);
+	uint64_t start = now_ns();
+	for (long i = 0; i < jobs; ++i)
+		dispatch(pool, count_job, NULL);
+	uint64_t dispatched = now_ns();
+	wait_done(jobs);
+	uint64_t finished = now_ns();
+	destroy_threadpool(pool);
+	result(kind, "dispatch", 1, "throughput", jobs / ((finished - start) / 1e9), "jobs/s");
+	result(kind, "dispatch", 1, "dispatch_call", (double) (dispatched - start) / jobs, "ns");
+}
+
+typedef struct latency_sample {
+	atomic_uint_fast64_t started;
+	atomic_int finished;
+} latency_sample;
+
+static int latency_job(void* arg) {
+	latency_sample* sample = (latency_sample*) arg;
+	atomic_store_explicit(&sample->started, now_ns(), memory_order_relaxed);
+	atomic_store_explicit(&sample->finished, 1, memory_order_release);
+	return 0;
+}
+
+// one job at a time, after a pause that lets the workers go to sleep
+static void bench_latency(queue_kind kind) {
+	threadpool* pool = create_pool(kind);
+	uint64_t* start_latency = (uint64_t*) malloc(samples * sizeof(uint64_t));
+	uint64_t* round_trip = (uint64_t*) malloc(samples * sizeof(uint64_t));
+	if (start_latency == NULL || round_trip == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	latency_sample sample;
+	for (int i = 0; i < samples; ++i) {
+		sleep_ms(1);
+		atomic_store(&sample.finished, 0);
+		uint64_t dispatched = now_ns();
+		dispatch(pool, latency_job, &sample);
+		while (!atomic_load_explicit(&sample.finished, memory_order_acquire))
+			sched_yield();
+		round_trip[i] = now_ns() - dispatched;
+		start_latency[i] = atomic_load_explicit(&sample.started, memory_order_relaxed) - dispatched;
+	}
+	destroy_threadpool(pool);
+	percentile_results(kind, "latency", "start", start_latency, samples);
+	percentile_results(kind, "latency", "round_trip", round_trip, samples);
+	free(start_latency);
+	free(round_trip);
+}
+
+typedef struct producer {
+	threadpool* pool;
+	long jobs;
+} producer;
+
+static void* produce(void* arg) {
+	producer* p = (producer*) arg;
+	for (long i = 0; i < p->jobs; ++i)
+		dispatch(p->pool, count_job, NULL);
+	return NULL;
+}
+
+static void bench_contention(queue_kind kind, int producers) {
+	pthread_t tids[MAX_PRODUCERS];
+	producer p = { create_pool(kind), jobs / producers };
+	atomic_store(&done, 0);
+	uint64_t start = now_ns();
+	for (int i = 0; i < producers; ++i)
+		pthread_create(&tids[i], NULL, produce, &p);
+	for (int i = 0; i < producers; ++i)
+		pthread_join(tids[i], NULL);
+	wait_done(p.jobs * producers);
+	uint64_t finished = now_ns();
+	destroy_threadpool(p.pool);
+	result(kind, "contention", producers, "throughput", p.jobs * producers / ((finished - start) / 1e9), "jobs/s");
+}
+
+// block every worker on the gate and fill the queue behind them. returns the jobs accepted,
+// counted once try_dispatch was refused a few times in a row, with time for workers to take jobs.
+static long fill_blocked(threadpool* pool) {
+	long accepted = 0;
+	int refused = 0;
+	set_gate(false);
+	while (refused < 3) {
+		if (try_dispatch(pool, gate_job, NULL) == 0) {
+			accepted++;
+			refused = 0;
+		}
+		else {
+			refused++;
+			sleep_ms(5);
+		}
+	}
+	return accepted;
+}
+
+typedef struct blocked_dispatch {
+	threadpool* pool;
+	atomic_uint_fast64_t returned;
+} blocked_dispatch;
+
+static void* dispatch_blocked(void* arg) {
+	blocked_dispatch* b = (blocked_dispatch*) arg;
+	dispatch(b->pool, count_job, NULL);
+	atomic_store(&b->returned, now_ns());
+	return NULL;
+}
+
+static void bench_saturation(queue_kind kind) {
+	threadpool* pool = create_pool(kind);
+	atomic_store(&done, 0);
+	long accepted = fill_blocked(pool);
+	result(kind, "saturation", 1, "accepted", accepted, "jobs");
+
+	int refusals = 10000;
+	uint64_t start = now_ns();
+	for (int i = 0; i < refusals; ++i)
+		try_dispatch(pool, count_job, NULL);
+	result(kind, "saturation", 1, "refused_try_dispatch", (double) (now_ns() - start) / refusals, "ns");
+
+	start = now_ns();
+	int queued = dispatch_timeout(pool, count_job, NULL, TIMEOUT_MS);
+	result(kind, "saturation", 1, "dispatch_timeout_wait", (now_ns() - start) / 1e3, "us");
+	result(kind, "saturation", 1, "dispatch_timeout_queued", queued == 0, "jobs");
+
+	blocked_dispatch b = { pool, 0 };
+	pthread_t tid;
+	pthread_create(&tid, NULL, dispatch_blocked, &b);
+	sleep_ms(20);
+	start = now_ns();
+	set_gate(true);
+	pthread_join(tid, NULL);
+	result(kind, "saturation", 1, "blocked_dispatch_wakeup", (atomic_load(&b.returned) - start) / 1e3, "us");
+	destroy_threadpool(pool);
+}
+
+static void bench_drain(queue_kind kind) {
+	threadpool* pool = create_pool(kind);
+	sleep_ms(10);
+	uint64_t start = now_ns();
+	destroy_threadpool(pool);
+	result(kind, "drain", 1, "destroy_idle", (now_ns() - start) / 1e3, "us");
+
+	pool = create_pool(kind);
+	atomic_store(&done, 0);
+	long accepted = fill_blocked(pool);
+	start = now_ns();
+	set_gate(true);
+	destroy_threadpool(pool);
+	result(kind, "drain", 1, "destroy_full", (now_ns() - start) / 1e3, "us");
+	result(kind, "drain", 1, "drained", atomic_load(&done) == accepted ? accepted : -1, "jobs");
+}
+
+// a comma separated list of producer counts
+static int parse_producers(const char* list) {
+	num_producer_counts = 0;
+	while (*list != '\0' && num_producer_counts < MAX_PRODUCER_COUNTS) {
+		int count = atoi(list);
+		if (count <= 0 || count > MAX_PRODUCERS)
+			return -1;
+		producer_counts[num_producer_counts++] = count;
+		list += strcspn(list, ",");
+		if (*list == ',')
+			list++;
+	}
+	return num_producer_counts > 0 ? 0 : -1;
+}
+
+int main(int argc, char* args[]) {
+	if (argc < 3) {
+		printf("Usage: pool_bench <threads> <max-queue-size> [--queue=mutex|ring|stealing] [--jobs=<n>] [--samples=<n>]\n"
+		       "       [--producers=<n>[,<n>...]] [--format=csv|json]\n");
+		exit(1);
+	}
+	threads = atoi(args[1]);
+	queue_size = atoi(args[2]);
+	int first_kind = QUEUE_MUTEX;
+	int last_kind = QUEUE_STEALING;
+	for (int i = 3; i < argc; ++i) {
+		bool ok = true;
+		if (strncmp(args[i], "--queue=", 8) == 0) {
+			int kind;
+			for (kind = QUEUE_MUTEX; kind <= QUEUE_STEALING && strcmp(args[i] + 8, names[kind]) != 0; ++kind)
+				;
+			ok = kind <= QUEUE_STEALING;
+			first_kind = last_kind = kind;
+		}
+		else if (strncmp(args[i], "--jobs=", 7) == 0)
+			ok = (jobs = atol(args[i] + 7)) > 0;
+		else if (strncmp(args[i], "--samples=", 10) == 0)
+			ok = (samples = atoi(args[i] + 10)) > 0;
+		else if (strncmp(args[i], "--producers=", 12) == 0)
+			ok = parse_producers(args[i] + 12) == 0;
+		else if (strcmp(args[i], "--format=json") == 0)
+			json = true;
+		else if (strcmp(args[i], "--format=csv") == 0)
+			json = false;
+		else
+			ok = false;
+		if (!ok) {
+			printf("bad option %s\n", args[i]);
+			exit(1);
+		}
+	}
+
+	if (!json)
+		printf("queue,benchmark,threads,max_queue_size,producers,metric,value,unit\n");
+	for (int kind = first_kind; kind <= last_kind; ++kind) {
+		bench_dispatch(kind);
+		bench_latency(kind);
+		for (int i = 0; i < num_producer_counts; ++i)
+			bench_contention(kind, producer_counts[i]);
+		bench_saturation(kind);
+		bench_drain(kind);
+	}
+	if (json)
+		printf(first_result ? "[]\n" : "\n]\n");
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include "../threadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * queue_bench compares the threadpool queue backends on two loads:
+ * producers: jobs dispatched by threads outside the pool.
+ * chains:    jobs dispatched by the pool's own workers. every job
+ *            dispatches its successor until its chain is done, so the
+ *            pool feeds itself (a stealing worker keeps it in its own
+ *            deque).
+ */
+
+static atomic_long done;
+static threadpool* chain_pool;
+
+static const char* names[] = { "mutex", "ring", "stealing" };
+
+static int count_job(void* arg) {
+	(void) arg;
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	return 0;
+}
+
+static int chain_job(void* arg) {
+	long left = (long) arg;
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	if (left > 1)
+		dispatch(chain_pool, chain_job, (void*) (left - 1));
+	return 0;
+}
+
+typedef struct producer {
+	threadpool* pool;
+	long jobs;
+} producer;
+
+static void* produce(void* arg) {
+	producer* p = (producer*) arg;
+	for (long i = 0; i < p->jobs; ++i)
+		dispatch(p->pool, count_job, NULL);
+	return NULL;
+}
+
+static double seconds_since(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench_producers(queue_kind kind, int threads, int queue_size, int producers, long jobs) {
+	pthread_t tids[64];
+	producer p = { NULL, jobs };
+	struct timespec start;
+	atomic_store(&done, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	p.pool = create_threadpool_with_queue(threads, queue_size, kind);
+	if (p.pool == NULL) {
+		printf("%-9s producers: can't create the pool\n", names[kind]);
+		return;
+	}
+	for (int i = 0; i < producers; ++i)
+		pthread_create(&tids[i], NULL, produce, &p);
+	for (int i = 0; i < producers; ++i)
+		pthread_join(tids[i], NULL);
+	destroy_threadpool(p.pool);
+	double elapsed = seconds_since(&start);
+	printf("%-9s producers: %ld jobs in %.3fs, %.0f jobs/s\n", names[kind], atomic_load(&done), elapsed, atomic_load(&done) / elapsed);
+}
+
+// chains, one more than the pool has threads, so all of them are busy. a chain's
+// next job is dispatched after its job was taken, so they never fill the queue.
+static void bench_chains(queue_kind kind, int threads, int queue_size, long jobs) {
+	struct timespec start;
+	int chains = threads + 1 < queue_size ? threads + 1 : queue_size;
+	atomic_store(&done, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	chain_pool = create_threadpool_with_queue(threads, queue_size, kind);
+	if (chain_pool == NULL) {
+		printf("%-9s chains:    can't create the pool\n", names[kind]);
+		return;
+	}
+	for (int i = 0; i < chains; ++i)
+		dispatch(chain_pool, chain_job, (void*) jobs);
+	// the pool drops jobs dispatched once it is being destroyed
+	while (atomic_load(&done) < chains * jobs)
+		sched_yield();
+	destroy_threadpool(chain_pool);
+	double elapsed = seconds_since(&start);
+	printf("%-9s chains:    %ld jobs in %.3fs, %.0f jobs/s\n", names[kind], atomic_load(&done), elapsed, atomic_load(&done) / elapsed);
+}
+
+int main(int argc, char* args[]) {
+	if (argc != 5) {
+		printf("Usage: queue_bench <number of threads> <max queue size> <producers> <jobs per producer>\n");
+		exit(1);
+	}
+	int threads = atoi(args[1]);
+	int queue_size = atoi(args[2]);
+	int producers = atoi(args[3]);
+	long jobs = atol(args[4]);
+	if (producers <= 0 || producers > 64 || jobs <= 0) {
+		printf("producers must be 1 to 64 and jobs positive\n");
+		exit(1);
+	}
+	for (queue_kind kind = QUEUE_MUTEX; kind <= QUEUE_STEALING; ++kind)
+		bench_producers(kind, threads, queue_size, producers, jobs);
+	for (queue_kind kind = QUEUE_MUTEX; kind <= QUEUE_STEALING; ++kind)
+		bench_chains(kind, threads, queue_size, jobs);
+	return 0;
+}
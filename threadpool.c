@@ -1,85 +1,657 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "threadpool.h"
 
+// polls of the ring before a thread goes to sleep
+#define RING_SPINS 128
+
+// state of a slot of the threads array
+enum { SLOT_FREE, SLOT_RUNNING, SLOT_EXITED };
+
+// tell the cpu we are spinning
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+// sleep while *word is still key, at most timeout (NULL: no limit)
+static void futex_wait(atomic_int* word, int key, const struct timespec* timeout) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, key, timeout, NULL, 0);
+}
+
+// the monotonic time timeout_ms from now
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// store the time left until deadline in left. returns false if it passed.
+static bool time_left(const struct timespec* deadline, struct timespec* left) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000L;
+    }
+    return left->tv_sec >= 0 && (left->tv_sec > 0 || left->tv_nsec > 0);
+}
+
+static void futex_wake(atomic_int* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// wake one sleeper, if any. the caller just changed the ring.
+static void ring_notify(ring_waiters* waiters) {
+    // orders the change of the ring before reading count, see ring_wait
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&waiters->count, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&waiters->seq, 1);
+        futex_wake(&waiters->seq, 1);
+    }
+}
+
+static job_ring* create_ring(size_t capacity) {
+    // with a single slot "free for position pos + 1" and "full at position pos" look the same
+    if (capacity < 2)
+        capacity = 2;
+    job_ring* ring = (job_ring*) aligned_alloc(_Alignof(job_ring), sizeof(job_ring));
+    if (ring == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(ring, 0, sizeof(job_ring));
+    ring->capacity = capacity;
+    // spinning only helps when another cpu can make progress meanwhile
+    ring->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 0;
+    ring->cells = (ring_cell*) aligned_alloc(_Alignof(ring_cell), capacity * sizeof(ring_cell));
+    if (ring->cells == NULL) {
+        perror("malloc");
+        free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; ++i)
+        atomic_init(&ring->cells[i].seq, i);
+    return ring;
+}
+
+static void destroy_ring(job_ring* ring) {
+    if (ring != NULL) {
+        free(ring->cells);
+        free(ring);
+    }
+}
+
+// put a job in the ring. returns 0 if it is full.
+static int ring_push(job_ring* ring, dispatch_fn routine, void* arg) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    ring_cell* cell;
+    for (;;) {
+        cell = &ring->cells[pos % ring->capacity];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long) (seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return 0;
+        else
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    }
+    cell->routine = routine;
+    cell->arg = arg;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+// take the oldest job of the ring. returns 0 if it is empty.
+static int ring_pop(job_ring* ring, work_t* job) {
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    ring_cell* cell;
+    for (;;) {
+        cell = &ring->cells[pos % ring->capacity];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        long diff = (long) (seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return 0;
+        else
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    }
+    job->routine = cell->routine;
+    job->arg = cell->arg;
+    // the slot is free for the producer one lap later
+    atomic_store_explicit(&cell->seq, pos + ring->capacity, memory_order_release);
+    return 1;
+}
+
+// sleep on waiters until ready says the ring changed, or at most timeout. ready is checked again
+// after registering, so a change that raced with the registration is not missed.
+static void ring_wait(ring_waiters* waiters, int (*ready)(job_ring*), job_ring* ring, const struct timespec* timeout) {
+    int key = atomic_load(&waiters->seq);
+    atomic_fetch_add(&waiters->count, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready(ring))
+        futex_wait(&waiters->seq, key, timeout);
+    atomic_fetch_sub(&waiters->count, 1);
+}
+
+// a job may be waiting, or the workers must exit
+static int ring_has_jobs(job_ring* ring) {
+    size_t pos = atomic_load(&ring->dequeue_pos);
+    size_t seq = atomic_load(&ring->cells[pos % ring->capacity].seq);
+    return seq == pos + 1 || atomic_load(&ring->stopping);
+}
+
+// a slot may be free, or dispatch must give up
+static int ring_has_room(job_ring* ring) {
+    size_t pos = atomic_load(&ring->enqueue_pos);
+    size_t seq = atomic_load(&ring->cells[pos % ring->capacity].seq);
+    return seq == pos || atomic_load(&ring->closed);
+}
+
+// the ring (and for QUEUE_STEALING the deques) hold no job
+static int ring_is_empty(job_ring* ring) {
+    return atomic_load(&ring->enqueue_pos) == atomic_load(&ring->dequeue_pos) && atomic_load(&ring->queued) == 0;
+}
+
+// the ring is empty and no dispatch can still add to it
+static int ring_is_drained(job_ring* ring) {
+    return atomic_load(&ring->dispatching) == 0 && ring_is_empty(ring);
+}
+
+// a dispatch ends. the last one out of a closed ring may be what destroy waits for.
+static void end_dispatch(job_ring* ring) {
+    if (atomic_fetch_sub(&ring->dispatching, 1) == 1 && atomic_load(&ring->closed)) {
+        atomic_fetch_add(&ring->not_full.seq, 1);
+        futex_wake(&ring->not_full.seq, INT_MAX);
+    }
+}
+
+// a dispatch begins, unless the ring is closed. it is counted before closed is read, and
+// destroy stores closed before reading the count, so either the dispatch sees the ring
+// closed or destroy sees the dispatch and waits for its job.
+static int begin_dispatch(job_ring* ring) {
+    atomic_fetch_add(&ring->dispatching, 1);
+    if (!atomic_load(&ring->closed))
+        return 1;
+    end_dispatch(ring);
+    return 0;
+}
+
+// QUEUE_STEALING: a job is queued somewhere, or the workers must exit
+static int pool_has_jobs(job_ring* ring) {
+    return atomic_load(&ring->queued) > 0 || atomic_load(&ring->stopping);
+}
+
+// QUEUE_STEALING: fewer than max_qsize jobs are queued, or dispatch must give up
+static int pool_has_room(job_ring* ring) {
+    return atomic_load(&ring->queued) < (int) ring->capacity || atomic_load(&ring->closed);
+}
+
+// the worker of a QUEUE_STEALING pool running on this thread
+static __thread threadpool* current_pool;
+static __thread steal_worker* current_worker;
+
+static steal_worker* create_workers(int num_threads, int max_queue_size) {
+    steal_worker* workers = (steal_worker*) aligned_alloc(_Alignof(steal_worker), num_threads * sizeof(steal_worker));
+    if (workers == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(workers, 0, num_threads * sizeof(steal_worker));
+    // a deque never holds more than the whole pool may queue
+    long size = 2;
+    while (size < max_queue_size)
+        size <<= 1;
+    for (int i = 0; i < num_threads; ++i) {
+        workers[i].slots = (steal_slot*) calloc(size, sizeof(steal_slot));
+        if (workers[i].slots == NULL) {
+            perror("malloc");
+            for (int j = 0; j < i; ++j)
+                free(workers[j].slots);
+            free(workers);
+            return NULL;
+        }
+        workers[i].mask = size - 1;
+        workers[i].rng = 2654435761u * (i + 1);
+    }
+    return workers;
+}
+
+static void destroy_workers(steal_worker* workers, int num_threads) {
+    if (workers == NULL)
+        return;
+    for (int i = 0; i < num_threads; ++i)
+        free(workers[i].slots);
+    free(workers);
+}
+
+// push a job at the bottom of the worker's own deque. only its owner calls this.
+static void deque_push(steal_worker* worker, dispatch_fn routine, void* arg) {
+    long bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+    steal_slot* slot = &worker->slots[bottom & worker->mask];
+    atomic_store_explicit(&slot->routine, routine, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg, arg, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// pop the newest job of the worker's own deque. only its owner calls this.
+static int deque_pop(steal_worker* worker, work_t* job) {
+    long bottom = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&worker->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&worker->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+        return 0;
+    }
+    steal_slot* slot = &worker->slots[bottom & worker->mask];
+    job->routine = atomic_load_explicit(&slot->routine, memory_order_relaxed);
+    job->arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    if (top == bottom) {
+        // the last job: race the thieves for it
+        int won = atomic_compare_exchange_strong_explicit(&worker->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&worker->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+// take the oldest job of another worker's deque. returns 0 if it is empty or another thief won.
+static int deque_steal(steal_worker* victim, work_t* job) {
+    long top = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return 0;
+    steal_slot* slot = &victim->slots[top & victim->mask];
+    job->routine = atomic_load_explicit(&slot->routine, memory_order_relaxed);
+    job->arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// count one more queued job unless max_qsize are queued
+static int reserve_job(job_ring* ring) {
+    int queued = atomic_load(&ring->queued);
+    while (queued < (int) ring->capacity)
+        if (atomic_compare_exchange_weak(&ring->queued, &queued, queued + 1))
+            return 1;
+    return 0;
+}
+
 threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size) {
-    if (num_threads_in_pool > MAXT_IN_POOL || num_threads_in_pool <= 0)
+    return create_threadpool_with_queue(num_threads_in_pool, max_queue_size, QUEUE_MUTEX);
+}
+
+threadpool* create_threadpool_with_queue(int num_threads_in_pool, int max_queue_size, queue_kind kind) {
+    threadpool_config config = {
+        .min_threads = num_threads_in_pool,
+        .max_threads = num_threads_in_pool,
+        .max_queue_size = max_queue_size,
+        .kind = kind,
+        .grow_threshold = 1,
+        .idle_timeout_ms = 0,
+        .stack_size = 0
+    };
+    return create_threadpool_with_config(&config);
+}
+
+// start a thread in a free (or exited) slot. the lock is held.
+static int start_thread(threadpool* pool, int slot) {
+    if (pool->slot_state[slot] == SLOT_EXITED)
+        pthread_join(pool->threads[slot], NULL);
+    pool->slot_state[slot] = SLOT_FREE;
+    if (pthread_create(&pool->threads[slot], &pool->attr, do_work, pool) != 0) {
+        perror("create thread");
+        return -1;
+    }
+    pool->slot_state[slot] = SLOT_RUNNING;
+    pool->num_threads++;
+    atomic_store_explicit(&pool->running, pool->num_threads, memory_order_relaxed);
+    if (pool->num_threads > atomic_load_explicit(&pool->peak_threads, memory_order_relaxed))
+        atomic_store_explicit(&pool->peak_threads, pool->num_threads, memory_order_relaxed);
+    return 0;
+}
+
+// join the threads of all the slots
+static void join_threads(threadpool* pool) {
+    for (int i = 0; i < pool->max_threads; ++i) {
+        if (pool->slot_state[i] != SLOT_FREE)
+            pthread_join(pool->threads[i], NULL);
+        pool->slot_state[i] = SLOT_FREE;
+    }
+}
+
+threadpool* create_threadpool_with_config(const threadpool_config* config) {
+    int min_threads = config->min_threads;
+    int max_threads = config->max_threads;
+    int max_queue_size = config->max_queue_size;
+    queue_kind kind = config->kind;
+    if (max_threads > MAXT_IN_POOL || max_threads <= 0 || min_threads <= 0 || min_threads > max_threads)
         return NULL;
     if (max_queue_size > MAXW_IN_QUEUE || max_queue_size <= 0)
         return NULL;
+    // the stealing deques and the ring's spinning assume a fixed set of workers
+    if (kind != QUEUE_MUTEX)
+        min_threads = max_threads;
     threadpool *pThreadpoolSt = (threadpool *) malloc(sizeof(threadpool));
     if (pThreadpoolSt == NULL) {
         perror("malloc");
         return NULL;
     }
-    pThreadpoolSt->num_threads = num_threads_in_pool;
+    pThreadpoolSt->num_threads = 0;
+    pThreadpoolSt->min_threads = min_threads;
+    pThreadpoolSt->max_threads = max_threads;
+    pThreadpoolSt->grow_threshold = config->grow_threshold > 0 ? config->grow_threshold : 1;
+    pThreadpoolSt->idle_timeout_ms = config->idle_timeout_ms;
+    pThreadpoolSt->idle_threads = 0;
+    atomic_init(&pThreadpoolSt->peak_threads, 0);
+    atomic_init(&pThreadpoolSt->grown, 0);
+    atomic_init(&pThreadpoolSt->retired, 0);
     pThreadpoolSt->max_qsize = max_queue_size;
     pThreadpoolSt->qsize = 0;
-    pThreadpoolSt->threads = (pthread_t *) malloc(sizeof(pthread_t) * num_threads_in_pool);
-    if (pThreadpoolSt->threads == NULL) {
+    atomic_init(&pThreadpoolSt->running, 0);
+    atomic_init(&pThreadpoolSt->queued, 0);
+    pThreadpoolSt->threads = (pthread_t *) malloc(sizeof(pthread_t) * max_threads);
+    pThreadpoolSt->slot_state = (char *) calloc(max_threads, sizeof(char));
+    if (pThreadpoolSt->threads == NULL || pThreadpoolSt->slot_state == NULL) {
         perror("malloc");
+        free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
         free(pThreadpoolSt);
         return NULL;
     }
     pThreadpoolSt->qhead = pThreadpoolSt->qtail = NULL;
+    pThreadpoolSt->kind = kind;
+    pThreadpoolSt->ring = NULL;
+    pThreadpoolSt->workers = NULL;
+    atomic_init(&pThreadpoolSt->next_worker, 0);
+    pThreadpoolSt->work_slab = NULL;
+    // a work_t lives from dispatch until its job returns: queued, or being run by a thread
+    if (kind == QUEUE_MUTEX && (pThreadpoolSt->work_slab = create_slab(sizeof(work_t), max_queue_size + max_threads)) == NULL) {
+        free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        free(pThreadpoolSt);
+        return NULL;
+    }
+    if (kind != QUEUE_MUTEX && (pThreadpoolSt->ring = create_ring(max_queue_size)) == NULL) {
+        free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        free(pThreadpoolSt);
+        return NULL;
+    }
+    if (kind == QUEUE_STEALING && (pThreadpoolSt->workers = create_workers(max_threads, max_queue_size)) == NULL) {
+        destroy_ring(pThreadpoolSt->ring);
+        free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        free(pThreadpoolSt);
+        return NULL;
+    }
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    // idle timeouts and dispatch deadlines are measured on the monotonic clock
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_attr_init(&pThreadpoolSt->attr);
+    if (config->stack_size > 0 && pthread_attr_setstacksize(&pThreadpoolSt->attr, config->stack_size) != 0)
+        fprintf(stderr, "invalid thread stack size %zu, using the default\n", config->stack_size);
     if (pthread_mutex_init(&pThreadpoolSt->qlock, NULL) != 0) {
         perror("init mutex");
         free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        pthread_attr_destroy(&pThreadpoolSt->attr);
+        destroy_ring(pThreadpoolSt->ring);
+        destroy_workers(pThreadpoolSt->workers, max_threads);
+        destroy_slab(pThreadpoolSt->work_slab);
         free(pThreadpoolSt);
         return NULL;
     }
-    if (pthread_cond_init(&pThreadpoolSt->q_not_empty, NULL) != 0) {
+    if (pthread_cond_init(&pThreadpoolSt->q_not_empty, &cond_attr) != 0) {
         perror("init cond");
         free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        pthread_attr_destroy(&pThreadpoolSt->attr);
         pthread_mutex_destroy(&pThreadpoolSt->qlock);
+        destroy_ring(pThreadpoolSt->ring);
+        destroy_workers(pThreadpoolSt->workers, max_threads);
+        destroy_slab(pThreadpoolSt->work_slab);
         free(pThreadpoolSt);
         return NULL;
     }
-    if (pthread_cond_init(&pThreadpoolSt->q_not_full, NULL) != 0) {
+    if (pthread_cond_init(&pThreadpoolSt->q_not_full, &cond_attr) != 0) {
         perror("init cond");
         free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        pthread_attr_destroy(&pThreadpoolSt->attr);
         pthread_mutex_destroy(&pThreadpoolSt->qlock);
         pthread_cond_destroy(&pThreadpoolSt->q_not_empty);
+        destroy_ring(pThreadpoolSt->ring);
+        destroy_workers(pThreadpoolSt->workers, max_threads);
+        destroy_slab(pThreadpoolSt->work_slab);
         free(pThreadpoolSt);
         return NULL;
     }
+    if (pthread_cond_init(&pThreadpoolSt->q_empty, NULL) != 0) {
+        perror("init cond");
+        free(pThreadpoolSt->threads);
+        free(pThreadpoolSt->slot_state);
+        pthread_attr_destroy(&pThreadpoolSt->attr);
+        pthread_mutex_destroy(&pThreadpoolSt->qlock);
+        pthread_cond_destroy(&pThreadpoolSt->q_not_empty);
+        pthread_cond_destroy(&pThreadpoolSt->q_not_full);
+        destroy_ring(pThreadpoolSt->ring);
+        destroy_workers(pThreadpoolSt->workers, max_threads);
+        destroy_slab(pThreadpoolSt->work_slab);
+        free(pThreadpoolSt);
+        return NULL;
+    }
+    pthread_condattr_destroy(&cond_attr);
     pThreadpoolSt->shutdown = pThreadpoolSt->dont_accept = 0;
-    for (int i = 0; i < num_threads_in_pool; ++i) {
-        if (pthread_create(&pThreadpoolSt->threads[i], NULL, do_work, pThreadpoolSt) != 0) {
-            perror("create thread");
+    // under the lock: a starting thread may already look at num_threads
+    pthread_mutex_lock(&pThreadpoolSt->qlock);
+    for (int i = 0; i < min_threads; ++i) {
+        if (start_thread(pThreadpoolSt, i) != 0) {
+            pThreadpoolSt->shutdown = pThreadpoolSt->dont_accept = 1;
+            pthread_cond_broadcast(&pThreadpoolSt->q_not_empty);
+            pthread_mutex_unlock(&pThreadpoolSt->qlock);
+            if (pThreadpoolSt->ring != NULL) {
+                atomic_store(&pThreadpoolSt->ring->stopping, 1);
+                atomic_fetch_add(&pThreadpoolSt->ring->not_empty.seq, 1);
+                futex_wake(&pThreadpoolSt->ring->not_empty.seq, INT_MAX);
+            }
+            join_threads(pThreadpoolSt);
             pthread_mutex_destroy(&pThreadpoolSt->qlock);
             pthread_cond_destroy(&pThreadpoolSt->q_not_empty);
             pthread_cond_destroy(&pThreadpoolSt->q_not_full);
-            for (int j = 0; i < j; j++) {
-                pthread_join(pThreadpoolSt->threads[i], NULL);
-            }
+            pthread_cond_destroy(&pThreadpoolSt->q_empty);
+            pthread_attr_destroy(&pThreadpoolSt->attr);
             free(pThreadpoolSt->threads);
+            free(pThreadpoolSt->slot_state);
+            destroy_ring(pThreadpoolSt->ring);
+            destroy_workers(pThreadpoolSt->workers, max_threads);
+            destroy_slab(pThreadpoolSt->work_slab);
             free(pThreadpoolSt);
             return NULL;
         }
     }
+    pthread_mutex_unlock(&pThreadpoolSt->qlock);
     return pThreadpoolSt;
 }
 
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
-    work_t *work = (work_t *) malloc(sizeof(work_t));
-    if (work == NULL) {
-        perror("malloc");
-        return;
+void threadpool_get_stats(threadpool* pool, threadpool_stats* stats) {
+    stats->threads = atomic_load_explicit(&pool->running, memory_order_relaxed);
+    stats->peak_threads = atomic_load_explicit(&pool->peak_threads, memory_order_relaxed);
+    stats->grown = atomic_load_explicit(&pool->grown, memory_order_relaxed);
+    stats->retired = atomic_load_explicit(&pool->retired, memory_order_relaxed);
+}
+
+void threadpool_load(threadpool* pool, int* threads, int* queued) {
+    *threads = atomic_load_explicit(&pool->running, memory_order_relaxed);
+    if (pool->kind == QUEUE_STEALING)
+        *queued = atomic_load_explicit(&pool->ring->queued, memory_order_relaxed);
+    else if (pool->kind == QUEUE_RING) {
+        // the consumer position first: it never passes the producer position read after it
+        size_t dequeued = atomic_load_explicit(&pool->ring->dequeue_pos, memory_order_acquire);
+        *queued = (int) (atomic_load_explicit(&pool->ring->enqueue_pos, memory_order_acquire) - dequeued);
+    }
+    else
+        *queued = atomic_load_explicit(&pool->queued, memory_order_relaxed);
+}
+
+// the threads fall behind the queue: start another one. the lock is held.
+static void grow_pool(threadpool* pool) {
+    for (int i = 0; i < pool->max_threads; ++i) {
+        if (pool->slot_state[i] != SLOT_RUNNING) {
+            if (start_thread(pool, i) == 0)
+                atomic_fetch_add_explicit(&pool->grown, 1, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+// a surplus thread leaves the pool, its slot is joined when reused. the lock is held.
+static void retire_thread(threadpool* pool) {
+    pthread_t self = pthread_self();
+    for (int i = 0; i < pool->max_threads; ++i) {
+        if (pool->slot_state[i] == SLOT_RUNNING && pthread_equal(pool->threads[i], self)) {
+            pool->slot_state[i] = SLOT_EXITED;
+            break;
+        }
+    }
+    pool->num_threads--;
+    atomic_store_explicit(&pool->running, pool->num_threads, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->retired, 1, memory_order_relaxed);
+}
+
+// wait for room in a ring or stealing pool: spin a little, then sleep until the deadline
+// (NULL: without a limit). returns false once the deadline passed.
+static bool wait_for_room(job_ring* ring, int (*has_room)(job_ring*), int* spins, const struct timespec* deadline) {
+    struct timespec left;
+    if (deadline != NULL && !time_left(deadline, &left))
+        return false;
+    if (*spins < ring->spins) {
+        cpu_relax();
+        (*spins)++;
+        return true;
+    }
+    ring_wait(&ring->not_full, has_room, ring, deadline != NULL ? &left : NULL);
+    *spins = 0;
+    return true;
+}
+
+// dispatch to the ring: no lock, wait only while it is full
+static int ring_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, const struct timespec* deadline) {
+    job_ring* ring = from_me->ring;
+    int spins = 0;
+    if (!begin_dispatch(ring))
+        return -1;
+    while (!atomic_load_explicit(&ring->closed, memory_order_relaxed)) {
+        if (ring_push(ring, dispatch_to_here, arg)) {
+            ring_notify(&ring->not_empty);
+            end_dispatch(ring);
+            return 0;
+        }
+        if (!wait_for_room(ring, ring_has_room, &spins, deadline))
+            break;
+    }
+    end_dispatch(ring);
+    return -1;
+}
+
+// dispatch to a stealing pool: a worker of the pool pushes to its own deque,
+// anyone else to the shared ring
+static int stealing_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, const struct timespec* deadline) {
+    job_ring* ring = from_me->ring;
+    if (!begin_dispatch(ring))
+        return -1;
+    if (current_pool == from_me) {
+        // waiting for room here could wait for this very worker: run the job now instead
+        if (!reserve_job(ring)) {
+            end_dispatch(ring);
+            dispatch_to_here(arg);
+            return 0;
+        }
+        deque_push(current_worker, dispatch_to_here, arg);
+        ring_notify(&ring->not_empty);
+        end_dispatch(ring);
+        return 0;
     }
+    int spins = 0;
+    while (!atomic_load_explicit(&ring->closed, memory_order_relaxed)) {
+        if (reserve_job(ring)) {
+            // a worker that took the job before ours may still be releasing its cell
+            while (!ring_push(ring, dispatch_to_here, arg))
+                sched_yield();
+            ring_notify(&ring->not_empty);
+            end_dispatch(ring);
+            return 0;
+        }
+        if (!wait_for_room(ring, pool_has_room, &spins, deadline))
+            break;
+    }
+    end_dispatch(ring);
+    return -1;
+}
+
+// dispatch to a pool of any queue, waiting for room until deadline (NULL: without a limit)
+static int dispatch_until(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, const struct timespec* deadline) {
+    if (from_me->kind == QUEUE_RING)
+        return ring_dispatch(from_me, dispatch_to_here, arg, deadline);
+    if (from_me->kind == QUEUE_STEALING)
+        return stealing_dispatch(from_me, dispatch_to_here, arg, deadline);
+    work_t *work = (work_t *) slab_alloc(from_me->work_slab);
+    if (work == NULL)
+        return -1;
     work->routine = dispatch_to_here;
     work->arg = arg;
+    work->next = NULL;
     pthread_mutex_lock(&from_me->qlock);
     if (from_me->dont_accept) {
-        free(work);
-        return;
+        pthread_mutex_unlock(&from_me->qlock);
+        slab_free(from_me->work_slab, work);
+        return -1;
     }
-    while (from_me->qsize == from_me->max_qsize) {
-        pthread_cond_wait(&from_me->q_not_full, &from_me->qlock);
+    while (from_me->qsize == from_me->max_qsize && !from_me->dont_accept) {
+        struct timespec left;
+        if (deadline == NULL)
+            pthread_cond_wait(&from_me->q_not_full, &from_me->qlock);
+        else if (!time_left(deadline, &left) ||
+                 pthread_cond_timedwait(&from_me->q_not_full, &from_me->qlock, deadline) == ETIMEDOUT) {
+            // one more look: room may have come with the timeout
+            if (from_me->qsize < from_me->max_qsize)
+                break;
+            pthread_mutex_unlock(&from_me->qlock);
+            slab_free(from_me->work_slab, work);
+            return -1;
+        }
     }
     if (from_me->dont_accept) {
-        free(work);
-        return;
+        pthread_mutex_unlock(&from_me->qlock);
+        slab_free(from_me->work_slab, work);
+        return -1;
     }
     if (from_me->qsize == 0) {
         from_me->qhead = from_me->qtail = work;
@@ -89,17 +661,135 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
         from_me->qtail = from_me->qtail->next;
     }
     from_me->qsize++;
+    atomic_store_explicit(&from_me->queued, from_me->qsize, memory_order_relaxed);
     pthread_cond_signal(&from_me->q_not_empty);
+    if (from_me->qsize >= from_me->grow_threshold && from_me->qsize > from_me->idle_threads &&
+        from_me->num_threads < from_me->max_threads)
+        grow_pool(from_me);
     pthread_mutex_unlock(&from_me->qlock);
+    return 0;
+}
+
+void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
+    dispatch_until(from_me, dispatch_to_here, arg, NULL);
+}
+
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return dispatch_until(from_me, dispatch_to_here, arg, &now);
+}
+
+int dispatch_timeout(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, int timeout_ms) {
+    if (timeout_ms < 0)
+        return dispatch_until(from_me, dispatch_to_here, arg, NULL);
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+    return dispatch_until(from_me, dispatch_to_here, arg, &deadline);
+}
+
+// work loop of a ring pool: spin briefly on an empty ring, then sleep
+static void ring_work(threadpool* thread_pool) {
+    job_ring* ring = thread_pool->ring;
+    work_t job;
+    for (int spins = 0; ; ++spins) {
+        if (ring_pop(ring, &job)) {
+            ring_notify(&ring->not_full);
+            job.routine(job.arg);
+            spins = 0;
+            continue;
+        }
+        if (atomic_load(&ring->stopping))
+            break;
+        if (spins < ring->spins)
+            cpu_relax();
+        else {
+            ring_wait(&ring->not_empty, ring_has_jobs, ring, NULL);
+            spins = 0;
+        }
+    }
 }
 
+// take a job for a worker of a stealing pool: its own newest job, the oldest
+// job of the shared ring, or the oldest job of another worker, in this order
+static int stealing_take(threadpool* thread_pool, steal_worker* me, work_t* job) {
+    if (deque_pop(me, job) || ring_pop(thread_pool->ring, job))
+        return 1;
+    int n = thread_pool->max_threads;
+    // xorshift: victims are tried from a random one, so thieves spread out
+    me->rng ^= me->rng << 13;
+    me->rng ^= me->rng >> 17;
+    me->rng ^= me->rng << 5;
+    int first = me->rng % n;
+    for (int i = 0; i < n; ++i) {
+        steal_worker* victim = &thread_pool->workers[(first + i) % n];
+        if (victim != me && deque_steal(victim, job))
+            return 1;
+    }
+    return 0;
+}
+
+// work loop of a stealing pool: spin briefly while nothing can be taken, then sleep
+static void stealing_work(threadpool* thread_pool) {
+    job_ring* ring = thread_pool->ring;
+    steal_worker* me = &thread_pool->workers[atomic_fetch_add(&thread_pool->next_worker, 1)];
+    current_pool = thread_pool;
+    current_worker = me;
+    work_t job;
+    for (int spins = 0; ; ++spins) {
+        if (stealing_take(thread_pool, me, &job)) {
+            atomic_fetch_sub(&ring->queued, 1);
+            ring_notify(&ring->not_full);
+            job.routine(job.arg);
+            spins = 0;
+            continue;
+        }
+        if (atomic_load(&ring->stopping))
+            break;
+        if (spins < ring->spins)
+            cpu_relax();
+        else {
+            ring_wait(&ring->not_empty, pool_has_jobs, ring, NULL);
+            spins = 0;
+        }
+    }
+    current_pool = NULL;
+    current_worker = NULL;
+}
 
 void* do_work(void* p) {
     threadpool* thread_pool = (threadpool*) p;
+    if (thread_pool->kind == QUEUE_RING) {
+        ring_work(thread_pool);
+        pthread_exit(NULL);
+    }
+    if (thread_pool->kind == QUEUE_STEALING) {
+        stealing_work(thread_pool);
+        pthread_exit(NULL);
+    }
     while (1) {
         pthread_mutex_lock(&thread_pool->qlock);
-        while (thread_pool->qsize == 0 && !thread_pool->shutdown) {
-            pthread_cond_wait(&thread_pool->q_not_empty, &thread_pool->qlock);
+        // a thread above min_threads waits for a job until the idle deadline
+        struct timespec deadline;
+        deadline_after(&deadline, thread_pool->idle_timeout_ms);
+        int waited = 0;
+        while (thread_pool->qsize == 0 && !thread_pool->shutdown && waited != ETIMEDOUT) {
+            thread_pool->idle_threads++;
+            if (thread_pool->num_threads > thread_pool->min_threads)
+                waited = pthread_cond_timedwait(&thread_pool->q_not_empty, &thread_pool->qlock, &deadline);
+            else
+                pthread_cond_wait(&thread_pool->q_not_empty, &thread_pool->qlock);
+            thread_pool->idle_threads--;
+        }
+        if (thread_pool->qsize == 0 && !thread_pool->shutdown) {
+            // timed out, but another surplus thread may have retired meanwhile
+            if (thread_pool->num_threads > thread_pool->min_threads) {
+                retire_thread(thread_pool);
+                pthread_mutex_unlock(&thread_pool->qlock);
+                break;
+            }
+            pthread_mutex_unlock(&thread_pool->qlock);
+            continue;
         }
         if (thread_pool->shutdown) {
             pthread_mutex_unlock(&thread_pool->qlock);
@@ -117,34 +807,59 @@ void* do_work(void* p) {
         }
         thread_pool->qhead = thread_pool->qhead->next;
         thread_pool->qsize--;
+        atomic_store_explicit(&thread_pool->queued, thread_pool->qsize, memory_order_relaxed);
         if (thread_pool->qsize == 0 && thread_pool->dont_accept) {
             pthread_cond_signal(&thread_pool->q_empty);
         }
         pthread_mutex_unlock(&thread_pool->qlock);
         work->routine(work->arg);
-        free(work);
+        slab_free(thread_pool->work_slab, work);
     }
     pthread_exit(NULL);
 }
 
 
-void destroy_threadpool(threadpool* destroyme) {
-    pthread_mutex_lock(&destroyme->qlock);
+// stop a ring or stealing pool once the jobs already queued were taken
+static void destroy_ring_pool(threadpool* destroyme) {
+    job_ring* ring = destroyme->ring;
     destroyme->dont_accept = 1;
-    while (destroyme->qsize > 0) {
-        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
-    }
+    atomic_store(&ring->closed, 1);
+    // dispatchers waiting for room give up
+    atomic_fetch_add(&ring->not_full.seq, 1);
+    futex_wake(&ring->not_full.seq, INT_MAX);
+    while (!ring_is_drained(ring))
+        ring_wait(&ring->not_full, ring_is_drained, ring, NULL);
     destroyme->shutdown = 1;
-    pthread_cond_broadcast(&destroyme->q_not_empty);
-    pthread_mutex_unlock(&destroyme->qlock);
-    for (int i = 0; i < destroyme->num_threads; ++i) {
-        pthread_join(destroyme->threads[i], NULL);
+    atomic_store(&ring->stopping, 1);
+    atomic_fetch_add(&ring->not_empty.seq, 1);
+    futex_wake(&ring->not_empty.seq, INT_MAX);
+}
+
+void destroy_threadpool(threadpool* destroyme) {
+    if (destroyme->kind != QUEUE_MUTEX) {
+        destroy_ring_pool(destroyme);
+    }
+    else {
+        pthread_mutex_lock(&destroyme->qlock);
+        destroyme->dont_accept = 1;
+        while (destroyme->qsize > 0) {
+            pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
+        }
+        destroyme->shutdown = 1;
+        pthread_cond_broadcast(&destroyme->q_not_empty);
+        pthread_mutex_unlock(&destroyme->qlock);
     }
+    join_threads(destroyme);
     pthread_cond_destroy(&destroyme->q_not_empty);
     pthread_cond_destroy(&destroyme->q_not_full);
     pthread_cond_destroy(&destroyme->q_empty);
     pthread_mutex_destroy(&destroyme->qlock);
+    destroy_ring(destroyme->ring);
+    destroy_workers(destroyme->workers, destroyme->max_threads);
+    destroy_slab(destroyme->work_slab);
+    pthread_attr_destroy(&destroyme->attr);
     free(destroyme->threads);
+    free(destroyme->slot_state);
     free(destroyme);
 
 }
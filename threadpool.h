@@ -1,4 +1,11 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "slab.h"
 
 /**
  * threadpool.h
@@ -21,6 +28,116 @@ typedef struct work_st{
 } work_t;
 
 
+// "dispatch_fn" declares a typed function pointer.  A
+// variable of type "dispatch_fn" points to a function
+// with the following signature:
+// 
+//     int dispatch_function(void *arg);
+
+typedef int (*dispatch_fn)(void *);
+
+/**
+ * the queue backend of a pool.
+ * QUEUE_MUTEX is a linked list of work_t under qlock.
+ * QUEUE_RING is a fixed-capacity lock-free ring of jobs; threads
+ * spin briefly and then sleep on a futex when it is empty (or full).
+ * QUEUE_STEALING gives every worker its own deque: jobs dispatched by
+ * a worker go to its deque, jobs dispatched from outside the pool go
+ * to a shared injection ring, and an idle worker steals from random
+ * other workers. max_qsize bounds the jobs queued in all of them.
+ */
+typedef enum {
+    QUEUE_MUTEX,
+    QUEUE_RING,
+    QUEUE_STEALING
+} queue_kind;
+
+/**
+ * sizing of a pool. an elastic pool starts min_threads threads and
+ * adds one, up to max_threads, whenever a job is dispatched while
+ * at least grow_threshold jobs (and more than the idle threads) are
+ * queued. a thread above min_threads that waited idle_timeout_ms
+ * for a job exits. only QUEUE_MUTEX pools are elastic, the others
+ * start max_threads threads. stack_size 0 keeps the default stack.
+ */
+typedef struct threadpool_config {
+    int min_threads;
+    int max_threads;            //at most MAXT_IN_POOL
+    int max_queue_size;
+    queue_kind kind;
+    int grow_threshold;         //the high-water mark of the queue
+    int idle_timeout_ms;
+    size_t stack_size;
+} threadpool_config;
+
+/**
+ * counters of the pool size
+ */
+typedef struct threadpool_stats {
+    int threads;                //running now
+    int peak_threads;
+    uint64_t grown;             //threads started after create
+    uint64_t retired;           //threads that exited idle
+} threadpool_stats;
+
+/**
+ * a slot of the ring. seq tells whose turn the slot is:
+ * pos for the producer of position pos, pos + 1 for its consumer.
+ */
+typedef struct ring_cell {
+    _Alignas(64) atomic_size_t seq;
+    dispatch_fn routine;
+    void* arg;
+} ring_cell;
+
+/**
+ * threads sleeping on a condition of the ring. seq is the futex word,
+ * bumped whenever the condition may have changed and a thread waits.
+ */
+typedef struct ring_waiters {
+    _Alignas(64) atomic_int seq;
+    atomic_int count;
+} ring_waiters;
+
+/**
+ * bounded multi-producer multi-consumer queue of jobs
+ */
+typedef struct job_ring {
+    ring_cell* cells;
+    size_t capacity;
+    int spins;                  //polls of the ring before sleeping
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+    ring_waiters not_empty;     //workers waiting for a job
+    ring_waiters not_full;      //dispatchers (and destroy) waiting for a free slot
+    atomic_int closed;          //dispatch drops new jobs
+    atomic_int stopping;        //workers exit once the ring is empty
+    atomic_int dispatching;     //dispatch calls past their check of closed, destroy waits for them
+    _Alignas(64) atomic_int queued; //QUEUE_STEALING: jobs in the ring and the deques
+} job_ring;
+
+/**
+ * a job in a worker's deque. a thief may read a slot while its
+ * owner reuses it, so the fields are atomic; the thief's claim on
+ * top decides whether what it read is used.
+ */
+typedef struct steal_slot {
+    _Atomic(dispatch_fn) routine;
+    _Atomic(void*) arg;
+} steal_slot;
+
+/**
+ * a worker of a QUEUE_STEALING pool and its (Chase-Lev) deque.
+ * the owner pushes and pops at bottom, thieves take from top.
+ */
+typedef struct steal_worker {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    steal_slot* slots;
+    long mask;                  //slots - 1, a power of two
+    unsigned rng;               //victim selection, used by the owner only
+} steal_worker;
+
 /**
  * The actual pool
  */
@@ -37,17 +154,25 @@ typedef struct _threadpool_st {
 	pthread_cond_t q_not_full;      //full conditional variable
     int shutdown;            //1 if the pool is in distruction process     
     int dont_accept;       //1 if destroy function has begun
+    queue_kind kind;        //queue backend
+    job_ring* ring;         //the queue for QUEUE_RING, the injection queue for QUEUE_STEALING
+    steal_worker* workers;  //QUEUE_STEALING: one per thread, NULL otherwise
+    atomic_int next_worker; //QUEUE_STEALING: index handed to the next starting thread
+    slab* work_slab;        //QUEUE_MUTEX: the work_t nodes, NULL otherwise
+    int min_threads;        //elastic sizing, see threadpool_config
+    int max_threads;
+    int grow_threshold;
+    int idle_timeout_ms;
+    int idle_threads;       //threads waiting for a job
+    char* slot_state;       //of each of the max_threads slots of threads: free, running or exited
+    pthread_attr_t attr;    //attributes of the threads, their stack size
+    atomic_int peak_threads;
+    atomic_uint_fast64_t grown;
+    atomic_uint_fast64_t retired; //stored under the lock, threadpool_get_stats reads them without it
+    atomic_int running;     //num_threads and, for QUEUE_MUTEX, qsize, stored under the lock
+    atomic_int queued;      //for threadpool_load, which reads them without it
 } threadpool;
 
-
-// "dispatch_fn" declares a typed function pointer.  A
-// variable of type "dispatch_fn" points to a function
-// with the following signature:
-// 
-//     int dispatch_function(void *arg);
-
-typedef int (*dispatch_fn)(void *);
-
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -60,6 +185,33 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size);
 
+/**
+ * create_threadpool_with_queue creates a pool like create_threadpool,
+ * with the given queue backend. create_threadpool uses QUEUE_MUTEX.
+ */
+threadpool* create_threadpool_with_queue(int num_threads_in_pool, int max_queue_size, queue_kind kind);
+
+/**
+ * create_threadpool_with_config creates a pool sized by config,
+ * elastic when min_threads < max_threads.
+ * returns NULL on failure.
+ */
+threadpool* create_threadpool_with_config(const threadpool_config* config);
+
+/**
+ * threadpool_get_stats copies the size counters of the pool without
+ * taking qlock, like threadpool_load. each counter was current when
+ * read, they are not a consistent snapshot.
+ */
+void threadpool_get_stats(threadpool* pool, threadpool_stats* stats);
+
+/**
+ * threadpool_load reads the threads running and the jobs queued
+ * without taking qlock, for monitoring a busy pool. each value was
+ * current when read, the two are not a consistent snapshot.
+ */
+void threadpool_load(threadpool* pool, int* threads, int* queued);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -71,10 +223,32 @@ threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size);
  * 3. if queue is full, wait
  * 4. add the work_t element to the queue
  * 5. unlock mutex
+ * an elastic pool starts a thread here when the queue is above its
+ * high-water mark.
+ * with QUEUE_RING the job is put in a free slot of the ring without
+ * a lock, and dispatch waits only while the ring is full.
+ * with QUEUE_STEALING a job dispatched by a worker of the pool goes
+ * to its own deque, and is run right away by the worker instead of
+ * waiting when max_qsize jobs are queued.
  *
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * try_dispatch is dispatch without waiting: when the queue is full
+ * (or the pool is being destroyed) the job is not queued.
+ * returns 0 if the job was queued and -1 if not.
+ */
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_timeout is dispatch that waits at most timeout_ms for
+ * room in the queue (0 is try_dispatch, a negative timeout waits
+ * like dispatch).
+ * returns 0 if the job was queued and -1 if not.
+ */
+int dispatch_timeout(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, int timeout_ms);
+
 /**
  * The work function of the thread
  * this function should:
@@ -83,6 +257,8 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
  * 3. take the first element from the queue (work_t)
  * 4. unlock mutex
  * 5. call the thread routine
+ * a surplus thread of an elastic pool waits at most idle_timeout_ms
+ * and then exits.
  *
  */
 void* do_work(void* p);
@@ -95,4 +271,4 @@ void* do_work(void* p);
  */
 void destroy_threadpool(threadpool* destroyme);
 
-
+#endif